@@ -0,0 +1,116 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/allocation-counter.h"
+
+#include <stdlib.h>
+
+#include <cstddef>
+#include <new>
+
+namespace protostore {
+namespace internal {
+namespace {
+
+// Trivially constructed, so usable by allocations made before main() and
+// while threads exit.
+thread_local uint64_t thread_allocations = 0;
+
+void* Allocate(size_t size, size_t alignment) {
+  thread_allocations++;
+  if (size == 0) {
+    size = 1;
+  }
+  void* ptr = nullptr;
+  if (alignment <= alignof(std::max_align_t)) {
+    ptr = malloc(size);
+  } else if (posix_memalign(&ptr, alignment, size) != 0) {
+    ptr = nullptr;
+  }
+  return ptr;
+}
+
+void* AllocateOrThrow(size_t size, size_t alignment) {
+  void* ptr = Allocate(size, alignment);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+}  // namespace
+
+uint64_t ThreadAllocations() { return thread_allocations; }
+
+}  // namespace internal
+}  // namespace protostore
+
+using protostore::internal::Allocate;
+using protostore::internal::AllocateOrThrow;
+
+constexpr size_t kDefaultAlignment = alignof(std::max_align_t);
+
+void* operator new(size_t size) {
+  return AllocateOrThrow(size, kDefaultAlignment);
+}
+void* operator new[](size_t size) {
+  return AllocateOrThrow(size, kDefaultAlignment);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size, kDefaultAlignment);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return Allocate(size, kDefaultAlignment);
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+  return AllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return AllocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return Allocate(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return Allocate(size, static_cast<size_t>(alignment));
+}
+
+// Both malloc() and posix_memalign() memory is released with free().
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+  free(ptr);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+  free(ptr);
+}
+void operator delete(void* ptr, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  free(ptr);
+}
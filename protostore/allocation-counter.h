@@ -0,0 +1,57 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_ALLOCATION_COUNTER_H_
+#define PROTOSTORE_ALLOCATION_COUNTER_H_
+
+#include <cstdint>
+
+namespace protostore {
+
+namespace internal {
+
+// Number of heap allocations made so far by the calling thread.
+uint64_t ThreadAllocations();
+
+}  // namespace internal
+
+/// \brief Counts the heap allocations made by the calling thread while it is
+/// alive, so that tests can assert that a path does not allocate.
+///
+/// Linking the allocation-counter target replaces the global operator new
+/// and delete with versions that count each allocation; it is meant for
+/// tests and benchmarks only. Allocations made on other threads, e.g. by
+/// executors, are not counted.
+class AllocationCounter {
+ public:
+  AllocationCounter() : start_(internal::ThreadAllocations()) {}
+
+  AllocationCounter(const AllocationCounter&) = delete;
+  AllocationCounter& operator=(const AllocationCounter&) = delete;
+
+  /// Allocations made since construction or the last Reset().
+  uint64_t allocations() const {
+    return internal::ThreadAllocations() - start_;
+  }
+
+  void Reset() { start_ = internal::ThreadAllocations(); }
+
+ private:
+  uint64_t start_;
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_ALLOCATION_COUNTER_H_
@@ -0,0 +1,64 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/allocation-counter.h"
+
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+
+TEST(AllocationCounterTest, CountsAllocationsOfThisThread) {
+  AllocationCounter counter;
+  EXPECT_THAT(counter.allocations(), Eq(0));
+
+  auto value = std::make_unique<int>(1);
+  EXPECT_THAT(counter.allocations(), Eq(1));
+  std::vector<char> bytes(100);
+  auto* aligned = new (std::align_val_t(4096)) char[10];
+  EXPECT_THAT(reinterpret_cast<uintptr_t>(aligned) % 4096, Eq(0));
+  ::operator delete[](aligned, std::align_val_t(4096));
+  EXPECT_THAT(counter.allocations(), Eq(3));
+
+  counter.Reset();
+  EXPECT_THAT(counter.allocations(), Eq(0));
+}
+
+TEST(AllocationCounterTest, IgnoresOtherThreads) {
+  AllocationCounter counter;
+  uint64_t other_allocations = 0;
+  std::thread other([&]() {
+    AllocationCounter other_counter;
+    auto value = std::make_unique<int>(1);
+    other_allocations = other_counter.allocations();
+  });
+  // Starting the thread allocates on this one.
+  const uint64_t started = counter.allocations();
+  other.join();
+  EXPECT_THAT(other_allocations, Eq(1));
+  EXPECT_THAT(counter.allocations(), Eq(started));
+}
+
+}  // namespace
+}  // namespace protostore
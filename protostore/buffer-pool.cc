@@ -0,0 +1,141 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/buffer-pool.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <new>
+
+#include "absl/numeric/bits.h"
+
+namespace protostore {
+namespace {
+
+constexpr size_t kHugePageSize = 2 << 20;
+
+size_t PageSize() {
+  static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+  return kPageSize;
+}
+
+// Huge pages only help if the buffer covers whole, aligned huge pages.
+std::align_val_t Alignment(size_t capacity) {
+  return std::align_val_t(capacity >= kHugePageSize ? kHugePageSize
+                                                    : PageSize());
+}
+
+void Free(char* data, size_t capacity) {
+  ::operator delete(data, Alignment(capacity));
+}
+
+}  // namespace
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept {
+  if (this != &other) {
+    Reset();
+    pool_ = other.pool_;
+    data_ = other.data_;
+    capacity_ = other.capacity_;
+    other.pool_ = nullptr;
+    other.data_ = nullptr;
+    other.capacity_ = 0;
+  }
+  return *this;
+}
+
+void BufferPool::Buffer::Reset() {
+  if (data_ != nullptr) {
+    pool_->Release(data_, capacity_);
+  }
+  pool_ = nullptr;
+  data_ = nullptr;
+  capacity_ = 0;
+}
+
+BufferPool::BufferPool(Options options)
+    : options_(options), free_(std::numeric_limits<size_t>::digits) {}
+
+BufferPool::~BufferPool() {
+  for (size_t i = 0; i < free_.size(); i++) {
+    for (char* data : free_[i]) {
+      Free(data, size_t{1} << i);
+    }
+  }
+}
+
+BufferPool* BufferPool::Default() {
+  static BufferPool* const kPool = new BufferPool();
+  return kPool;
+}
+
+BufferPool::Buffer BufferPool::Acquire(size_t size) {
+  const size_t capacity = absl::bit_ceil(std::max(size, PageSize()));
+  const int size_class = absl::countr_zero(capacity);
+  {
+    absl::MutexLock lock(&mutex_);
+    std::vector<char*>& free = free_[size_class];
+    if (!free.empty()) {
+      char* data = free.back();
+      free.pop_back();
+      stats_.hits++;
+      stats_.retained_bytes -= capacity;
+      return Buffer(this, data, capacity);
+    }
+    stats_.misses++;
+  }
+  return Buffer(this, Allocate(capacity), capacity);
+}
+
+absl::Cord BufferPool::MakeCord(Buffer buffer, size_t size) {
+  const absl::string_view data(buffer.data(), size);
+  return absl::MakeCordFromExternal(
+      data, [buffer = std::move(buffer)](absl::string_view) {});
+}
+
+BufferPool::Stats BufferPool::stats() const {
+  absl::MutexLock lock(&mutex_);
+  return stats_;
+}
+
+void BufferPool::Release(char* data, size_t capacity) {
+  {
+    absl::MutexLock lock(&mutex_);
+    if (stats_.retained_bytes + capacity <= options_.max_retained_bytes) {
+      free_[absl::countr_zero(capacity)].push_back(data);
+      stats_.retained_bytes += capacity;
+      return;
+    }
+    stats_.evictions++;
+  }
+  Free(data, capacity);
+}
+
+char* BufferPool::Allocate(size_t capacity) const {
+  char* data =
+      static_cast<char*>(::operator new(capacity, Alignment(capacity)));
+  if (options_.huge_page_threshold > 0 &&
+      capacity >= options_.huge_page_threshold &&
+      capacity >= kHugePageSize) {
+    // Advisory; failure (e.g. THP disabled) leaves regular pages.
+    madvise(data, capacity, MADV_HUGEPAGE);
+  }
+  return data;
+}
+
+}  // namespace protostore
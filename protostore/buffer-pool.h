@@ -0,0 +1,118 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_BUFFER_POOL_H_
+#define PROTOSTORE_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+
+namespace protostore {
+
+/// \brief Recycles page-aligned buffers for reading and serializing protos,
+/// so that repeated loads and writes do not go through the allocator.
+///
+/// Buffers are handed out in power-of-two size classes of at least a page.
+/// Released buffers are kept for reuse as long as the pool retains at most
+/// Options::max_retained_bytes; beyond that they are freed. Thread-safe.
+class BufferPool {
+ public:
+  struct Options {
+    // Upper bound of the bytes held by released buffers.
+    size_t max_retained_bytes = 64 << 20;
+
+    // If non-zero, buffers of at least this many bytes are aligned to huge
+    // pages and advised to be backed by transparent huge pages.
+    size_t huge_page_threshold = 0;
+  };
+
+  struct Stats {
+    // Acquisitions served by a retained buffer.
+    uint64_t hits = 0;
+    // Acquisitions that allocated.
+    uint64_t misses = 0;
+    // Releases that freed the buffer to honor Options::max_retained_bytes.
+    uint64_t evictions = 0;
+    uint64_t retained_bytes = 0;
+  };
+
+  /// \brief A buffer owned by the caller until it is destroyed, which hands
+  /// it back to the pool.
+  class Buffer {
+   public:
+    Buffer() = default;
+    Buffer(Buffer&& other) noexcept { *this = std::move(other); }
+    Buffer& operator=(Buffer&& other) noexcept;
+    ~Buffer() { Reset(); }
+
+    /// Page-aligned, with room for capacity() bytes; left uninitialized.
+    char* data() const { return data_; }
+    size_t capacity() const { return capacity_; }
+
+    /// Hands the buffer back to the pool, leaving this one empty.
+    void Reset();
+
+   private:
+    friend class BufferPool;
+    Buffer(BufferPool* pool, char* data, size_t capacity)
+        : pool_(pool), data_(data), capacity_(capacity) {}
+
+    BufferPool* pool_ = nullptr;
+    char* data_ = nullptr;
+    size_t capacity_ = 0;
+  };
+
+  BufferPool() : BufferPool(Options()) {}
+  explicit BufferPool(Options options);
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+  /// Frees the retained buffers; all acquired ones must have been released.
+  ~BufferPool();
+
+  /// Returns a process-wide instance with default options.
+  static BufferPool* Default();
+
+  /// Returns a buffer of at least `size` bytes.
+  Buffer Acquire(size_t size) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  /// Returns a Cord owning `buffer`, holding its first `size` bytes. The
+  /// buffer goes back to the pool when the Cord no longer references it.
+  static absl::Cord MakeCord(Buffer buffer, size_t size);
+
+  Stats stats() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  void Release(char* data, size_t capacity) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  char* Allocate(size_t capacity) const;
+
+  const Options options_;
+
+  mutable absl::Mutex mutex_;
+  // Released buffers, indexed by the log2 of their capacity.
+  std::vector<std::vector<char*>> free_ ABSL_GUARDED_BY(mutex_);
+  Stats stats_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_BUFFER_POOL_H_
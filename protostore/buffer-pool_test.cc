@@ -0,0 +1,96 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/buffer-pool.h"
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Ge;
+
+TEST(BufferPoolTest, RoundsUpToPageAlignedSizeClasses) {
+  BufferPool pool;
+  BufferPool::Buffer small = pool.Acquire(1);
+  EXPECT_THAT(small.capacity(), Ge(4096));
+  EXPECT_THAT(reinterpret_cast<uintptr_t>(small.data()) % 4096, Eq(0));
+
+  BufferPool::Buffer large = pool.Acquire(100000);
+  EXPECT_THAT(large.capacity(), Eq(131072));
+  std::memset(large.data(), 'x', large.capacity());
+}
+
+TEST(BufferPoolTest, ReusesReleasedBuffers) {
+  BufferPool pool;
+  char* data;
+  {
+    BufferPool::Buffer buffer = pool.Acquire(10000);
+    data = buffer.data();
+  }
+  EXPECT_THAT(pool.stats().retained_bytes, Eq(16384));
+
+  BufferPool::Buffer buffer = pool.Acquire(9000);
+  EXPECT_THAT(buffer.data(), Eq(data));
+  // Another size class is not served from the retained buffer.
+  BufferPool::Buffer other = pool.Acquire(100);
+
+  const BufferPool::Stats stats = pool.stats();
+  EXPECT_THAT(stats.hits, Eq(1));
+  EXPECT_THAT(stats.misses, Eq(2));
+  EXPECT_THAT(stats.retained_bytes, Eq(0));
+}
+
+TEST(BufferPoolTest, FreesBuffersBeyondRetainedCap) {
+  BufferPool pool({.max_retained_bytes = 3 * 4096});
+  {
+    BufferPool::Buffer a = pool.Acquire(4096);
+    BufferPool::Buffer b = pool.Acquire(4096);
+    BufferPool::Buffer c = pool.Acquire(8192);
+  }
+  // `c` and `b` are released first and retained; `a` no longer fits.
+  const BufferPool::Stats stats = pool.stats();
+  EXPECT_THAT(stats.retained_bytes, Eq(3 * 4096));
+  EXPECT_THAT(stats.evictions, Eq(1));
+}
+
+TEST(BufferPoolTest, CordReleasesBufferWhenDestroyed) {
+  BufferPool pool;
+  {
+    BufferPool::Buffer buffer = pool.Acquire(5);
+    std::memcpy(buffer.data(), "hello", 5);
+    absl::Cord cord = BufferPool::MakeCord(std::move(buffer), 5);
+    EXPECT_THAT(cord, Eq("hello"));
+    EXPECT_THAT(pool.stats().retained_bytes, Eq(0));
+  }
+  EXPECT_THAT(pool.stats().retained_bytes, Eq(4096));
+}
+
+TEST(BufferPoolTest, HugePageBuffersAreAligned) {
+  BufferPool pool({.huge_page_threshold = 2 << 20});
+  BufferPool::Buffer buffer = pool.Acquire(3 << 20);
+  EXPECT_THAT(buffer.capacity(), Eq(4 << 20));
+  EXPECT_THAT(reinterpret_cast<uintptr_t>(buffer.data()) % (2 << 20), Eq(0));
+  std::memset(buffer.data(), 'x', buffer.capacity());
+}
+
+}  // namespace
+}  // namespace protostore
@@ -0,0 +1,203 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/columnar.h"
+
+#include <utility>
+
+#include "absl/algorithm/container.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+
+namespace protostore {
+namespace {
+
+// Bytes per value of the fixed-width encodings, or 0.
+size_t FixedWidth(ColumnEncoding encoding) {
+  switch (encoding) {
+    case ColumnEncoding::kFixed32:
+      return 4;
+    case ColumnEncoding::kFixed64:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+// Returns the raw value of a scalar field as a 64-bit integer.
+uint64_t ScalarValue(const internal::WireField& field) {
+  uint64_t value = 0;
+  if (field.wire_type == internal::kVarint) {
+    absl::string_view bytes = field.value;
+    internal::ReadVarint(&bytes, &value);
+  } else {
+    std::memcpy(&value, field.value.data(), field.value.size());
+  }
+  return value;
+}
+
+// Appends the encoding of `values` to `*out`.
+void EncodeColumn(ColumnEncoding encoding, const std::vector<uint64_t>& values,
+                  std::string* out) {
+  const size_t width = FixedWidth(encoding);
+  if (width > 0) {
+    // Little-endian hosts store the low bytes first.
+    for (uint64_t value : values) {
+      out->append(reinterpret_cast<const char*>(&value), width);
+    }
+    return;
+  }
+  uint64_t previous = 0;
+  for (uint64_t value : values) {
+    const int64_t delta = static_cast<int64_t>(value - previous);
+    const uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^
+                            static_cast<uint64_t>(delta >> 63);
+    internal::AppendVarint(zigzag, out);
+    previous = value;
+  }
+}
+
+}  // namespace
+
+absl::StatusOr<Columns> Columns::Decode(absl::string_view encoded,
+                                        int field_number,
+                                        std::shared_ptr<const void> owner) {
+  const absl::Status corrupted = absl::InternalError("Malformed columns");
+  absl::string_view rest = encoded;
+  uint64_t num_fields;
+  if (!internal::ReadVarint(&rest, &num_fields)) {
+    return corrupted;
+  }
+  for (uint64_t i = 0; i < num_fields; i++) {
+    uint64_t number;
+    uint64_t rows;
+    uint64_t num_columns;
+    if (!internal::ReadVarint(&rest, &number) ||
+        !internal::ReadVarint(&rest, &rows) ||
+        !internal::ReadVarint(&rest, &num_columns)) {
+      return corrupted;
+    }
+    Columns result;
+    result.rows_ = rows;
+    for (uint64_t c = 0; c < num_columns; c++) {
+      uint64_t subfield_number;
+      uint64_t encoding;
+      uint64_t length;
+      if (!internal::ReadVarint(&rest, &subfield_number) ||
+          !internal::ReadVarint(&rest, &encoding) ||
+          !internal::ReadVarint(&rest, &length) || length > rest.size() ||
+          encoding > static_cast<uint64_t>(ColumnEncoding::kFixed64)) {
+        return corrupted;
+      }
+      Column column;
+      column.subfield_number_ = subfield_number;
+      column.encoding_ = static_cast<ColumnEncoding>(encoding);
+      column.size_ = rows;
+      column.data_ = rest.substr(0, length);
+      rest.remove_prefix(length);
+      const size_t width = FixedWidth(column.encoding_);
+      if (width > 0 && (rows > length || length != rows * width)) {
+        return corrupted;
+      }
+      if (number == static_cast<uint64_t>(field_number)) {
+        result.columns_.push_back(column);
+      }
+    }
+    if (number == static_cast<uint64_t>(field_number)) {
+      result.owner_ = std::move(owner);
+      return result;
+    }
+  }
+  return absl::NotFoundError(
+      absl::StrCat("No columns for field ", field_number));
+}
+
+const Column* Columns::Find(int subfield_number) const {
+  for (const Column& column : columns_) {
+    if (column.subfield_number() == subfield_number) {
+      return &column;
+    }
+  }
+  return nullptr;
+}
+
+namespace internal {
+
+bool EncodeColumns(absl::string_view data,
+                   absl::Span<const ColumnarField> fields, std::string* out) {
+  AppendVarint(fields.size(), out);
+  for (const ColumnarField& spec : fields) {
+    const std::vector<int>& subfields = spec.subfield_numbers;
+    std::vector<std::vector<uint64_t>> values(subfields.size());
+    // Wire type of each column, set by its first occurrence.
+    std::vector<int> wire_types(subfields.size(), -1);
+    size_t rows = 0;
+    WireFieldScanner scanner(data);
+    WireField field;
+    while (scanner.Next(&field)) {
+      if (field.number != spec.field_number ||
+          field.wire_type != kLengthDelimited) {
+        continue;
+      }
+      rows++;
+      for (std::vector<uint64_t>& column : values) {
+        column.push_back(0);
+      }
+      WireFieldScanner element(field.value);
+      WireField subfield;
+      while (element.Next(&subfield)) {
+        auto it = absl::c_find(subfields, subfield.number);
+        if (it == subfields.end()) {
+          continue;
+        }
+        const size_t c = it - subfields.begin();
+        if (wire_types[c] == -1 && (subfield.wire_type == kVarint ||
+                                    subfield.wire_type == kFixed32 ||
+                                    subfield.wire_type == kFixed64)) {
+          wire_types[c] = subfield.wire_type;
+        }
+        if (subfield.wire_type == wire_types[c]) {
+          values[c].back() = ScalarValue(subfield);
+        }
+      }
+      if (!element.ok()) {
+        return false;
+      }
+    }
+    if (!scanner.ok()) {
+      return false;
+    }
+
+    AppendVarint(spec.field_number, out);
+    AppendVarint(rows, out);
+    AppendVarint(subfields.size(), out);
+    for (size_t c = 0; c < subfields.size(); c++) {
+      const ColumnEncoding encoding =
+          wire_types[c] == kFixed32   ? ColumnEncoding::kFixed32
+          : wire_types[c] == kFixed64 ? ColumnEncoding::kFixed64
+                                      : ColumnEncoding::kDeltaVarint;
+      std::string column;
+      EncodeColumn(encoding, values[c], &column);
+      AppendVarint(subfields[c], out);
+      AppendVarint(static_cast<uint64_t>(encoding), out);
+      AppendVarint(column.size(), out);
+      out->append(column);
+    }
+  }
+  return true;
+}
+
+}  // namespace internal
+}  // namespace protostore
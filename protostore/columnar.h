@@ -0,0 +1,217 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_COLUMNAR_H_
+#define PROTOSTORE_COLUMNAR_H_
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "absl/base/casts.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "protostore/status-macros.h"
+#include "protostore/store-extensions.h"
+#include "protostore/wire-format.h"
+
+namespace protostore {
+
+/// \brief A repeated message field of which scalar subfields are also
+/// stored column by column, see ColumnarFieldEncoder.
+struct ColumnarField {
+  // Number of the top-level repeated message field.
+  int field_number = 0;
+  // Numbers of the scalar subfields of its elements to store as columns.
+  std::vector<int> subfield_numbers;
+};
+
+/// \brief How the values of a column are laid out.
+enum class ColumnEncoding {
+  // Varint fields: the zigzag-encoded difference to the previous value, as
+  // a varint, so that sorted or clustered values pack into a byte or two.
+  kDeltaVarint = 0,
+  // fixed32, sfixed32 and float fields: an array of little-endian values.
+  kFixed32 = 1,
+  // fixed64, sfixed64 and double fields: an array of little-endian values.
+  kFixed64 = 2,
+};
+
+/// \brief The values of one scalar subfield across the elements of a
+/// repeated field, in order. Elements lacking the subfield hold 0; for
+/// those having it several times, the last occurrence counts. Aliases the
+/// stored bytes, and is valid as long as the Columns it belongs to.
+class Column {
+ public:
+  int subfield_number() const { return subfield_number_; }
+  ColumnEncoding encoding() const { return encoding_; }
+  size_t size() const { return size_; }
+
+  /// \brief Calls `fn(T value)` with each value in order. Floating-point
+  /// types read float and double fields; integer types read the others as
+  /// their C++ type would, e.g. int32_t for int32 and sfixed32 fields.
+  /// sint32 and sint64 fields come back zigzag-encoded.
+  ///
+  /// Returns false if the column is corrupted.
+  template <typename T, typename Fn>
+  bool ForEach(Fn fn) const;
+
+ private:
+  friend class Columns;
+
+  int subfield_number_ = 0;
+  ColumnEncoding encoding_ = ColumnEncoding::kDeltaVarint;
+  size_t size_ = 0;
+  absl::string_view data_;
+};
+
+/// \brief The columns stored for the elements of one ColumnarField, as
+/// returned by ReadColumns(). Keeps the stored bytes alive.
+class Columns {
+ public:
+  Columns() = default;
+
+  /// \brief Returns the columns of `field_number` within `encoded`, as
+  /// produced by internal::EncodeColumns(), aliasing it. `owner` keeps
+  /// `encoded` alive.
+  ///
+  /// Returns NOT_FOUND if `field_number` has no columns and INTERNAL if
+  /// `encoded` is malformed.
+  static absl::StatusOr<Columns> Decode(absl::string_view encoded,
+                                        int field_number,
+                                        std::shared_ptr<const void> owner);
+
+  /// Number of elements of the repeated field.
+  size_t rows() const { return rows_; }
+
+  const std::vector<Column>& columns() const { return columns_; }
+
+  /// Returns the column of `subfield_number`, or nullptr if it is not
+  /// stored.
+  const Column* Find(int subfield_number) const;
+
+ private:
+  std::shared_ptr<const void> owner_;
+  size_t rows_ = 0;
+  std::vector<Column> columns_;
+};
+
+namespace internal {
+
+// Appends to `*out` the columns of `fields` of the serialized proto `data`,
+// to be stored as the payload of a length-delimited field.
+//
+// Returns false if the data is malformed.
+bool EncodeColumns(absl::string_view data,
+                   absl::Span<const ColumnarField> fields, std::string* out);
+
+}  // namespace internal
+
+/// \brief Stores the scalar subfields of `fields` column by column, ahead
+/// of the proto in the file, for ReadColumns(); set it as
+/// ProtoDataStore::Options::column_encoder. Write() then needs the
+/// serialized proto in one piece, copying it if it has a chunk_size, and
+/// does not stream it. Readers should set an encoder too, so that Read()
+/// skips the columns rather than keeping them as unknown fields.
+class ColumnarFieldEncoder final : public ColumnEncoder {
+ public:
+  explicit ColumnarFieldEncoder(std::vector<ColumnarField> fields)
+      : fields_(std::move(fields)) {}
+
+  bool Encode(absl::string_view data, std::string* out) const override {
+    return internal::EncodeColumns(data, fields_, out);
+  }
+
+ private:
+  const std::vector<ColumnarField> fields_;
+};
+
+/// \brief Returns the columns that `store`, a ProtoDataStore, holds for the
+/// repeated field `field_number`, one of those of its ColumnarFieldEncoder,
+/// without parsing the proto. The columns alias the mapping of the file and
+/// keep it alive; scanning one touches only its own bytes. Works in any
+/// read mode; the checksum of the file is verified once per version,
+/// whatever the verification of loads.
+///
+/// Returns NOT_FOUND if the file does not exist or holds no columns for
+/// the field, e.g. if it was written without a column encoder.
+/// Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+template <typename StoreT>
+absl::StatusOr<Columns> ReadColumns(const StoreT& store, int field_number) {
+  PDS_ASSIGN_OR_RETURN(absl::Cord encoded, store.ReadEncodedColumns());
+  auto owner = std::make_shared<absl::Cord>(std::move(encoded));
+  // Aliases the mapping unless the payload is small enough to be copied.
+  const absl::string_view flat = owner->Flatten();
+  return Columns::Decode(flat, field_number, std::move(owner));
+}
+
+template <typename T, typename Fn>
+bool Column::ForEach(Fn fn) const {
+  static_assert(std::is_arithmetic<T>::value, "Columns hold numbers");
+  const char* p = data_.data();
+  switch (encoding_) {
+    case ColumnEncoding::kDeltaVarint: {
+      absl::string_view rest = data_;
+      uint64_t value = 0;
+      for (size_t i = 0; i < size_; i++) {
+        uint64_t delta;
+        if (!internal::ReadVarint(&rest, &delta)) {
+          return false;
+        }
+        // Undo the zigzag encoding; wraps around like the writer.
+        value += (delta >> 1) ^ (~(delta & 1) + 1);
+        if (std::is_floating_point<T>::value) {
+          fn(static_cast<T>(static_cast<int64_t>(value)));
+        } else {
+          fn(static_cast<T>(value));
+        }
+      }
+      return rest.empty();
+    }
+    case ColumnEncoding::kFixed32:
+      for (size_t i = 0; i < size_; i++, p += 4) {
+        uint32_t value;
+        std::memcpy(&value, p, 4);
+        if (std::is_floating_point<T>::value) {
+          fn(static_cast<T>(absl::bit_cast<float>(value)));
+        } else {
+          fn(static_cast<T>(value));
+        }
+      }
+      return true;
+    case ColumnEncoding::kFixed64:
+      for (size_t i = 0; i < size_; i++, p += 8) {
+        uint64_t value;
+        std::memcpy(&value, p, 8);
+        if (std::is_floating_point<T>::value) {
+          fn(static_cast<T>(absl::bit_cast<double>(value)));
+        } else {
+          fn(static_cast<T>(value));
+        }
+      }
+      return true;
+  }
+  return false;
+}
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_COLUMNAR_H_
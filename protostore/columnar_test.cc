@@ -0,0 +1,112 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/columnar.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protostore/test.pb.h"
+#include "protostore/testing-matchers.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::IsNull;
+using ::testing::IsTrue;
+using ::testing::Le;
+using ::testing::Ne;
+using testing::IsOk;
+using testing::StatusIs;
+
+template <typename T>
+std::vector<T> Values(const Column& column) {
+  std::vector<T> values;
+  EXPECT_THAT(column.ForEach<T>([&](T value) { values.push_back(value); }),
+              IsTrue());
+  return values;
+}
+
+TEST(ColumnarTest, EncodesScalarSubfields) {
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  TestProto::Entry* entry = testproto.add_entries();
+  entry->set_value(-5);
+  entry->set_weight(0.5);
+  // No value or weight.
+  testproto.add_entries()->set_key("b");
+  entry = testproto.add_entries();
+  entry->set_value(1LL << 40);
+  entry->set_weight(-2);
+  std::string data = testproto.SerializeAsString();
+  // An element with value 1, then 7; the last occurrence counts.
+  data += std::string("\x1a\x04\x10\x01\x10\x07", 6);
+
+  std::string encoded;
+  ASSERT_THAT(internal::EncodeColumns(data, {ColumnarField{3, {2, 3, 9}}},
+                                      &encoded),
+              IsTrue());
+  absl::StatusOr<Columns> columns = Columns::Decode(encoded, 3, nullptr);
+  ASSERT_THAT(columns, IsOk());
+  EXPECT_THAT(columns->rows(), Eq(4));
+  ASSERT_THAT(columns->columns().size(), Eq(3));
+
+  const Column* values = columns->Find(2);
+  ASSERT_THAT(values, Ne(nullptr));
+  EXPECT_THAT(values->encoding(), Eq(ColumnEncoding::kDeltaVarint));
+  EXPECT_THAT(Values<int64_t>(*values), ElementsAre(-5, 0, 1LL << 40, 7));
+  const Column* weights = columns->Find(3);
+  ASSERT_THAT(weights, Ne(nullptr));
+  EXPECT_THAT(weights->encoding(), Eq(ColumnEncoding::kFixed64));
+  EXPECT_THAT(Values<double>(*weights), ElementsAre(0.5, 0, -2, 0));
+  // Subfields that never occur read as zeros.
+  EXPECT_THAT(Values<int32_t>(*columns->Find(9)), ElementsAre(0, 0, 0, 0));
+  EXPECT_THAT(columns->Find(1), IsNull());
+
+  EXPECT_THAT(Columns::Decode(encoded, 5, nullptr),
+              StatusIs(absl::StatusCode::kNotFound));
+  EXPECT_THAT(Columns::Decode(encoded.substr(0, encoded.size() - 1), 3,
+                              nullptr),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST(ColumnarTest, PacksSortedValues) {
+  TestProto testproto;
+  for (int i = 0; i < 1000; i++) {
+    testproto.add_entries()->set_value(1000000000000 + i * 3);
+  }
+  std::string encoded;
+  ASSERT_THAT(internal::EncodeColumns(testproto.SerializeAsString(),
+                                      {ColumnarField{3, {2}}}, &encoded),
+              IsTrue());
+  // One byte per delta, bar the first value.
+  EXPECT_THAT(encoded.size(), Le(1000 + 20));
+
+  absl::StatusOr<Columns> columns = Columns::Decode(encoded, 3, nullptr);
+  ASSERT_THAT(columns, IsOk());
+  int64_t sum = 0;
+  ASSERT_THAT(columns->Find(2)->ForEach<int64_t>(
+                  [&](int64_t value) { sum += value - 1000000000000; }),
+              IsTrue());
+  EXPECT_THAT(sum, Eq(3 * 999 * 1000 / 2));
+}
+
+}  // namespace
+}  // namespace protostore
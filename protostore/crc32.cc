@@ -40,4 +40,11 @@ uint32_t Crc32::Append(const absl::string_view str) {
   return crc_;
 }
 
+uint32_t Crc32::Concat(const Crc32& other, size_t other_length) {
+  // crc32_combine() only depends on the linearity of the CRC register, so it
+  // also holds for the complemented values kept here.
+  crc_ = crc32_combine(crc_, other.Get(), other_length);
+  return crc_;
+}
+
 }  // namespace protostore
@@ -57,6 +57,11 @@ class Crc32 {
   // Crc32(base_crc).Append(str) is not the same as zlib::crc32(base_crc, str);
   uint32_t Append(absl::string_view str);
 
+  // Update the current checksum as if the `other_length` bytes whose checksum
+  // is `other` had been appended. This lets chunks of data be checksummed
+  // independently, e.g. on different threads, and combined afterwards.
+  uint32_t Concat(const Crc32& other, size_t other_length);
+
  private:
   uint32_t crc_;
 };
@@ -55,5 +55,25 @@ TEST(Crc32Test, Append) {
   EXPECT_THAT(crc32_foo_and_bar.Get(), Eq(crc32_foobar.Get()));
 }
 
+TEST(Crc32Test, Concat) {
+  Crc32 crc32_foobarbaz{};
+  crc32_foobarbaz.Append("foobarbaz");
+
+  Crc32 crc32_foo{};
+  crc32_foo.Append("foo");
+  Crc32 crc32_bar{};
+  crc32_bar.Append("bar");
+  Crc32 crc32_baz{};
+  crc32_baz.Append("baz");
+  crc32_foo.Concat(crc32_bar, 3);
+  crc32_foo.Concat(crc32_baz, 3);
+  EXPECT_THAT(crc32_foo.Get(), Eq(crc32_foobarbaz.Get()));
+
+  // Concatenating an empty chunk changes nothing.
+  Crc32 crc32_empty{};
+  crc32_foo.Concat(crc32_empty, 0);
+  EXPECT_THAT(crc32_foo.Get(), Eq(crc32_foobarbaz.Get()));
+}
+
 }  // namespace
 }  // namespace protostore
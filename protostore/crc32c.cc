@@ -0,0 +1,182 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/crc32c.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "absl/strings/string_view.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define PROTOSTORE_CRC32C_SSE42 1
+#endif
+
+namespace protostore {
+
+namespace {
+
+// CRC-32C polynomial, bit-reversed.
+constexpr uint32_t kPolynomial = 0x82f63b78;
+
+// Tables for slicing-by-8: kTables[k][b] is the CRC of byte `b` followed by
+// `k` zero bytes.
+struct Tables {
+  Tables() {
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; i++) {
+        crc = (crc >> 1) ^ ((crc & 1) ? kPolynomial : 0);
+      }
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+      for (int k = 1; k < 8; k++) {
+        table[k][b] =
+            (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+      }
+    }
+  }
+
+  uint32_t table[8][256];
+};
+
+const Tables& GetTables() {
+  static const Tables* const kTables = new Tables();
+  return *kTables;
+}
+
+// Extends the raw CRC register `crc` with `data`.
+uint32_t ExtendPortable(uint32_t crc, const char* data, size_t n) {
+  const auto& t = GetTables().table;
+  const auto* p = reinterpret_cast<const uint8_t*>(data);
+  while (n >= 8) {
+    uint32_t low;
+    uint32_t high;
+    memcpy(&low, p, 4);
+    memcpy(&high, p + 4, 4);
+    // Assumes a little-endian host, as does the StoreHeader.
+    low ^= crc;
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^
+          t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+          t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^
+          t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+    p += 8;
+    n -= 8;
+  }
+  while (n-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#ifdef PROTOSTORE_CRC32C_SSE42
+__attribute__((target("sse4.2"))) uint32_t ExtendSse42(uint32_t crc,
+                                                       const char* data,
+                                                       size_t n) {
+  uint64_t crc64 = crc;
+  while (n >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    n -= 8;
+  }
+  crc = static_cast<uint32_t>(crc64);
+  while (n-- > 0) {
+    crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data++));
+  }
+  return crc;
+}
+#endif
+
+uint32_t Extend(uint32_t crc, const char* data, size_t n) {
+#ifdef PROTOSTORE_CRC32C_SSE42
+  static const bool kHaveSse42 = __builtin_cpu_supports("sse4.2");
+  if (kHaveSse42) {
+    return ExtendSse42(crc, data, n);
+  }
+#endif
+  return ExtendPortable(crc, data, n);
+}
+
+// Multiplies the 32x32 GF(2) matrix `matrix` by `vector`.
+uint32_t Gf2MatrixTimes(const uint32_t* matrix, uint32_t vector) {
+  uint32_t sum = 0;
+  for (; vector != 0; vector >>= 1, matrix++) {
+    if (vector & 1) {
+      sum ^= *matrix;
+    }
+  }
+  return sum;
+}
+
+void Gf2MatrixSquare(uint32_t* square, const uint32_t* matrix) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = Gf2MatrixTimes(matrix, matrix[n]);
+  }
+}
+
+// Same algorithm as zlib's crc32_combine(), for the CRC-32C polynomial.
+uint32_t Combine(uint32_t crc1, uint32_t crc2, size_t length2) {
+  if (length2 == 0) {
+    return crc1;
+  }
+  uint32_t even[32];
+  uint32_t odd[32];
+  // The operator for one zero bit.
+  odd[0] = kPolynomial;
+  uint32_t row = 1;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  // Operators for two and four zero bits.
+  Gf2MatrixSquare(even, odd);
+  Gf2MatrixSquare(odd, even);
+  // Apply `length2` zero bytes to `crc1`.
+  do {
+    Gf2MatrixSquare(even, odd);
+    if (length2 & 1) {
+      crc1 = Gf2MatrixTimes(even, crc1);
+    }
+    length2 >>= 1;
+    if (length2 == 0) {
+      break;
+    }
+    Gf2MatrixSquare(odd, even);
+    if (length2 & 1) {
+      crc1 = Gf2MatrixTimes(odd, crc1);
+    }
+    length2 >>= 1;
+  } while (length2 != 0);
+  return crc1 ^ crc2;
+}
+
+}  // namespace
+
+uint32_t Crc32c::Append(absl::string_view str) {
+  crc_ = ~Extend(~crc_, str.data(), str.size());
+  return crc_;
+}
+
+uint32_t Crc32c::Concat(const Crc32c& other, size_t other_length) {
+  crc_ = Combine(crc_, other.Get(), other_length);
+  return crc_;
+}
+
+}  // namespace protostore
@@ -0,0 +1,59 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_CRC32C_H_
+#define PROTOSTORE_CRC32C_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/strings/string_view.h"
+
+namespace protostore {
+
+// CRC-32C (Castagnoli) checksum with the same interface as Crc32. Uses the
+// SSE4.2 crc32 instruction where the CPU has it, which makes it several times
+// faster than zlib's CRC-32, and a table-driven implementation elsewhere.
+//
+// Values are those of the standard CRC-32C, e.g. as used by iSCSI and
+// LevelDB, and are not interchangeable with Crc32 ones.
+class Crc32c {
+ public:
+  // Default to the checksum of an empty string, that is "0".
+  Crc32c() : crc_(0) {}
+
+  explicit Crc32c(uint32_t init_crc) : crc_(init_crc) {}
+
+  inline bool operator==(const Crc32c& other) const {
+    return crc_ == other.Get();
+  }
+
+  // Returns the checksum of all the data that has been processed till now.
+  uint32_t Get() const { return crc_; }
+
+  // Updates the checksum as if `str` had been appended to the data.
+  uint32_t Append(absl::string_view str);
+
+  // Updates the checksum as if the `other_length` bytes whose checksum is
+  // `other` had been appended.
+  uint32_t Concat(const Crc32c& other, size_t other_length);
+
+ private:
+  uint32_t crc_;
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_CRC32C_H_
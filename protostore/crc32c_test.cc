@@ -0,0 +1,74 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/crc32c.h"
+
+#include <cstdint>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+
+TEST(Crc32cTest, KnownValues) {
+  EXPECT_THAT(Crc32c().Get(), Eq(0));
+  Crc32c check;
+  check.Append("123456789");
+  EXPECT_THAT(check.Get(), Eq(0xe3069283));
+  Crc32c zeros;
+  zeros.Append(std::string(32, '\0'));
+  EXPECT_THAT(zeros.Get(), Eq(0x8a9136aa));
+}
+
+TEST(Crc32cTest, Append) {
+  std::string data;
+  for (int i = 0; i < 1000; i++) {
+    data.push_back(static_cast<char>(i * 7));
+  }
+  Crc32c whole;
+  whole.Append(data);
+  // Covers both the word-at-a-time loop and the byte tail.
+  for (size_t split : {0, 1, 7, 8, 13, 999, 1000}) {
+    Crc32c parts;
+    parts.Append(absl::string_view(data).substr(0, split));
+    parts.Append(absl::string_view(data).substr(split));
+    EXPECT_THAT(parts.Get(), Eq(whole.Get())) << split;
+  }
+}
+
+TEST(Crc32cTest, Concat) {
+  Crc32c foobarbaz;
+  foobarbaz.Append("foobarbaz");
+
+  Crc32c foo;
+  foo.Append("foo");
+  Crc32c bar;
+  bar.Append("bar");
+  Crc32c baz;
+  baz.Append("baz");
+  foo.Concat(bar, 3);
+  foo.Concat(baz, 3);
+  EXPECT_THAT(foo.Get(), Eq(foobarbaz.Get()));
+
+  foo.Concat(Crc32c(), 0);
+  EXPECT_THAT(foo.Get(), Eq(foobarbaz.Get()));
+}
+
+}  // namespace
+}  // namespace protostore
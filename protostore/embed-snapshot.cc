@@ -0,0 +1,187 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Compiles a serialized proto into a C++ source file, as the contents of a
+// ProtoDataStore file in read-only data, for Options::default_snapshot. The
+// checksum is computed here, at build time.
+//
+// Usage: embed-snapshot --function=ns::DefaultConfig [--checksum=crc32c]
+//            [--include=path/of/header.h] INPUT OUT_HEADER OUT_SOURCE
+//
+// INPUT holds the proto in the binary wire format. The generated header
+// declares `absl::string_view ns::DefaultConfig()`. See proto_snapshot() in
+// snapshot.bzl for the Bazel rule wrapping this tool.
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "protostore/crc32.h"
+#include "protostore/crc32c.h"
+#include "protostore/store-format.h"
+
+ABSL_FLAG(std::string, function, "",
+          "Qualified name of the generated function, e.g. ns::DefaultConfig.");
+ABSL_FLAG(std::string, checksum, "crc32",
+          "Checksum policy of the store: crc32 or crc32c.");
+ABSL_FLAG(std::string, include, "",
+          "Path the generated source includes the header by; OUT_HEADER if "
+          "empty.");
+
+namespace protostore {
+namespace {
+
+// Bytes per line of the generated array.
+constexpr size_t kBytesPerLine = 12;
+
+bool ReadFile(const std::string& path, std::string* contents) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::ostringstream buffer;
+  buffer << in.rdbuf();
+  *contents = buffer.str();
+  return !in.bad();
+}
+
+bool WriteFile(const std::string& path, absl::string_view contents) {
+  std::ofstream out(path, std::ios::binary);
+  out.write(contents.data(), contents.size());
+  out.close();
+  return out.good();
+}
+
+// Returns the include guard of the header included as `include`.
+std::string IncludeGuard(absl::string_view include) {
+  std::string guard;
+  for (char c : include) {
+    guard.push_back(absl::ascii_isalnum(c) ? absl::ascii_toupper(c) : '_');
+  }
+  return absl::StrCat(guard, "_");
+}
+
+std::string OpenNamespaces(const std::vector<std::string>& namespaces) {
+  std::string out;
+  for (const std::string& ns : namespaces) {
+    absl::StrAppend(&out, "namespace ", ns, " {\n");
+  }
+  return out;
+}
+
+std::string CloseNamespaces(const std::vector<std::string>& namespaces) {
+  std::string out;
+  for (auto it = namespaces.rbegin(); it != namespaces.rend(); ++it) {
+    absl::StrAppend(&out, "}  // namespace ", *it, "\n");
+  }
+  return out;
+}
+
+std::string Header(const std::string& include,
+                   const std::vector<std::string>& namespaces,
+                   const std::string& function) {
+  const std::string guard = IncludeGuard(include);
+  return absl::StrCat(
+      "// Generated by embed-snapshot. DO NOT EDIT.\n\n",  //
+      "#ifndef ", guard, "\n#define ", guard, "\n\n",
+      "#include \"absl/strings/string_view.h\"\n\n",
+      OpenNamespaces(namespaces), "\n",
+      "// Contents of a ProtoDataStore file, for "
+      "Options::default_snapshot.\n",
+      "absl::string_view ", function, "();\n\n",
+      CloseNamespaces(namespaces), "\n#endif  // ", guard, "\n");
+}
+
+std::string Source(const std::string& include,
+                   const std::vector<std::string>& namespaces,
+                   const std::string& function, absl::string_view contents) {
+  std::string out = absl::StrCat(
+      "// Generated by embed-snapshot. DO NOT EDIT.\n\n",  //
+      "#include \"", include, "\"\n\n", OpenNamespaces(namespaces),
+      "namespace {\n\n", "alignas(8) constexpr char kContents[] = {\n");
+  for (size_t i = 0; i < contents.size(); i += kBytesPerLine) {
+    absl::StrAppend(&out, "   ");
+    for (char c : contents.substr(i, kBytesPerLine)) {
+      absl::StrAppendFormat(&out, " '\\x%02x',",
+                            static_cast<unsigned char>(c));
+    }
+    absl::StrAppend(&out, "\n");
+  }
+  absl::StrAppend(&out, "};\n\n}  // namespace\n\n",  //
+                  "absl::string_view ", function, "() {\n",
+                  "  return absl::string_view(kContents, sizeof(kContents));\n",
+                  "}\n\n", CloseNamespaces(namespaces));
+  return out;
+}
+
+int Main(int argc, char** argv) {
+  std::vector<char*> args = absl::ParseCommandLine(argc, argv);
+  const std::string qualified_function = absl::GetFlag(FLAGS_function);
+  const std::string checksum = absl::GetFlag(FLAGS_checksum);
+  if (args.size() != 4 || qualified_function.empty() ||
+      (checksum != "crc32" && checksum != "crc32c")) {
+    fprintf(stderr,
+            "Usage: %s --function=NAME [--checksum=crc32|crc32c] "
+            "INPUT OUT_HEADER OUT_SOURCE\n",
+            argv[0]);
+    return 2;
+  }
+  const std::string input = args[1];
+  const std::string header_path = args[2];
+  const std::string source_path = args[3];
+  std::string include = absl::GetFlag(FLAGS_include);
+  if (include.empty()) {
+    include = header_path;
+  }
+
+  std::vector<std::string> namespaces =
+      absl::StrSplit(qualified_function, "::");
+  const std::string function = namespaces.back();
+  namespaces.pop_back();
+
+  std::string proto_str;
+  if (!ReadFile(input, &proto_str)) {
+    fprintf(stderr, "Cannot read %s\n", input.c_str());
+    return 1;
+  }
+  const std::string contents = checksum == "crc32"
+                                   ? EncodeStoreContents<Crc32>(proto_str)
+                                   : EncodeStoreContents<Crc32c>(proto_str);
+
+  if (!WriteFile(header_path, Header(include, namespaces, function))) {
+    fprintf(stderr, "Cannot write %s\n", header_path.c_str());
+    return 1;
+  }
+  if (!WriteFile(source_path,
+                 Source(include, namespaces, function, contents))) {
+    fprintf(stderr, "Cannot write %s\n", source_path.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace protostore
+
+int main(int argc, char** argv) { return protostore::Main(argc, argv); }
@@ -0,0 +1,73 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROTOSTORE_EXECUTOR_H_
+#define PROTOSTORE_EXECUTOR_H_
+
+#include <functional>
+#include <thread>
+#include <utility>
+
+namespace protostore {
+
+/// \brief Runs closures on behalf of the store, e.g. to deliver change
+/// notifications away from the caller's thread.
+class Executor {
+ public:
+  virtual ~Executor() = default;
+
+  /// \brief Arranges for `closure` to be run at some point in the future.
+  ///
+  /// Must be safe for concurrent use by multiple threads.
+  virtual void Schedule(std::function<void()> closure) = 0;
+
+  /// \brief Whether the calling thread is one that runs the closures of this
+  /// executor. Work the caller would wait for is then run inline, as it
+  /// could otherwise queue behind the caller itself.
+  virtual bool RunsOnCurrentThread() const { return false; }
+};
+
+/// \brief Runs each closure immediately on the scheduling thread.
+class InlineExecutor final : public Executor {
+ public:
+  /// Returns a process-wide instance.
+  static InlineExecutor* Default() {
+    static InlineExecutor* const kExecutor = new InlineExecutor();
+    return kExecutor;
+  }
+
+  void Schedule(std::function<void()> closure) override {
+    std::move(closure)();
+  }
+};
+
+/// \brief Runs each closure on a new thread of its own, detached. Meant
+/// for occasional work only; see ThreadPool otherwise.
+class DetachedThreadExecutor final : public Executor {
+ public:
+  /// Returns a process-wide instance.
+  static DetachedThreadExecutor* Default() {
+    static DetachedThreadExecutor* const kExecutor =
+        new DetachedThreadExecutor();
+    return kExecutor;
+  }
+
+  void Schedule(std::function<void()> closure) override {
+    std::thread(std::move(closure)).detach();
+  }
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_EXECUTOR_H_
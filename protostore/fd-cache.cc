@@ -0,0 +1,108 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/fd-cache.h"
+
+#include <unistd.h>
+
+#include <utility>
+#include <vector>
+
+namespace protostore {
+
+SharedFd::~SharedFd() { close(fd_); }
+
+std::shared_ptr<const SharedFd> FdCache::Lookup(const std::string& path,
+                                                uint64_t device,
+                                                uint64_t inode) {
+  std::shared_ptr<const SharedFd> stale;
+  absl::MutexLock lock(&mutex_);
+  auto it = index_.find(path);
+  if (it == index_.end()) {
+    stats_.misses++;
+    return nullptr;
+  }
+  if (it->second->device != device || it->second->inode != inode) {
+    stats_.misses++;
+    stats_.stale++;
+    EraseLocked(path, &stale);
+    return nullptr;
+  }
+  stats_.hits++;
+  TouchLocked(it->second);
+  return lru_.front().fd;
+}
+
+void FdCache::Insert(const std::string& path, uint64_t device,
+                     uint64_t inode, std::shared_ptr<const SharedFd> fd) {
+  std::vector<std::shared_ptr<const SharedFd>> dropped(1);
+  absl::MutexLock lock(&mutex_);
+  EraseLocked(path, &dropped[0]);
+  if (options_.max_open_files == 0) {
+    return;
+  }
+  while (lru_.size() >= options_.max_open_files) {
+    dropped.emplace_back();
+    EraseLocked(lru_.back().path, &dropped.back());
+    stats_.evictions++;
+  }
+  lru_.push_front(Entry{path, device, inode, std::move(fd)});
+  index_[path] = lru_.begin();
+  stats_.open_files = lru_.size();
+}
+
+void FdCache::Rename(const std::string& from, const std::string& to) {
+  std::shared_ptr<const SharedFd> replaced;
+  absl::MutexLock lock(&mutex_);
+  EraseLocked(to, &replaced);
+  auto it = index_.find(from);
+  if (it == index_.end()) {
+    return;
+  }
+  EntryList::iterator entry = it->second;
+  index_.erase(it);
+  entry->path = to;
+  index_[to] = entry;
+  TouchLocked(entry);
+}
+
+void FdCache::Erase(const std::string& path) {
+  std::shared_ptr<const SharedFd> dropped;
+  absl::MutexLock lock(&mutex_);
+  EraseLocked(path, &dropped);
+}
+
+FdCache::Stats FdCache::stats() const {
+  absl::MutexLock lock(&mutex_);
+  return stats_;
+}
+
+void FdCache::TouchLocked(EntryList::iterator it) {
+  lru_.splice(lru_.begin(), lru_, it);
+}
+
+void FdCache::EraseLocked(const std::string& path,
+                          std::shared_ptr<const SharedFd>* dropped) {
+  auto it = index_.find(path);
+  if (it == index_.end()) {
+    return;
+  }
+  *dropped = std::move(it->second->fd);
+  lru_.erase(it->second);
+  index_.erase(it);
+  stats_.open_files = lru_.size();
+}
+
+}  // namespace protostore
@@ -0,0 +1,131 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_FD_CACHE_H_
+#define PROTOSTORE_FD_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+
+namespace protostore {
+
+/// \brief An open file descriptor, closed when the last reference to it is
+/// dropped. Only meant for positional IO, which does not move the shared
+/// file offset, so that it can be used from several streams at once.
+class SharedFd {
+ public:
+  /// Takes ownership of `fd`.
+  explicit SharedFd(int fd) : fd_(fd) {}
+  SharedFd(const SharedFd&) = delete;
+  SharedFd& operator=(const SharedFd&) = delete;
+  ~SharedFd();
+
+  int get() const { return fd_; }
+
+ private:
+  const int fd_;
+};
+
+/// \brief Keeps the descriptors of recently used files open, keyed by path,
+/// so that FileStorage can skip opening hot files again.
+///
+/// Each entry remembers the device and inode it was opened on; a lookup
+/// for a file that has since been replaced, e.g. by a rename, drops the
+/// stale entry. Beyond Options::max_open_files, the least recently used
+/// entry is dropped. Descriptors still in use by streams stay open until
+/// those are done with them. Thread-safe; one cache can back any number of
+/// FileStorage instances.
+class FdCache {
+ public:
+  struct Options {
+    // Upper bound of the descriptors held open by the cache.
+    size_t max_open_files = 256;
+  };
+
+  struct Stats {
+    // Lookups served by a cached descriptor.
+    uint64_t hits = 0;
+    // Lookups finding no descriptor, or a stale one.
+    uint64_t misses = 0;
+    // Entries dropped because the file had been replaced.
+    uint64_t stale = 0;
+    // Entries dropped to honor Options::max_open_files.
+    uint64_t evictions = 0;
+    uint64_t open_files = 0;
+  };
+
+  FdCache() : FdCache(Options()) {}
+  explicit FdCache(Options options) : options_(options) {}
+  FdCache(const FdCache&) = delete;
+  FdCache& operator=(const FdCache&) = delete;
+
+  /// Returns the descriptor cached for `path` if it refers to the file
+  /// with `device` and `inode`, as returned by stat(), or nullptr.
+  std::shared_ptr<const SharedFd> Lookup(const std::string& path,
+                                         uint64_t device, uint64_t inode)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  /// Caches `fd`, open on the file with `device` and `inode` at `path`.
+  void Insert(const std::string& path, uint64_t device, uint64_t inode,
+              std::shared_ptr<const SharedFd> fd) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  /// Moves the entry of `from`, if any, to `to`, following a rename.
+  void Rename(const std::string& from, const std::string& to)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  /// Drops the entry of `path`, if any.
+  void Erase(const std::string& path) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  Stats stats() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+ private:
+  struct Entry {
+    std::string path;
+    uint64_t device;
+    uint64_t inode;
+    std::shared_ptr<const SharedFd> fd;
+  };
+  using EntryList = std::list<Entry>;
+
+  // Makes `it` the most recently used entry.
+  void TouchLocked(EntryList::iterator it)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Removes the entry of `path`, if any, handing its descriptor to
+  // `*dropped` so that it is closed outside the lock.
+  void EraseLocked(const std::string& path,
+                   std::shared_ptr<const SharedFd>* dropped)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const Options options_;
+
+  mutable absl::Mutex mutex_;
+  // Most recently used first.
+  EntryList lru_ ABSL_GUARDED_BY(mutex_);
+  absl::flat_hash_map<std::string, EntryList::iterator> index_
+      ABSL_GUARDED_BY(mutex_);
+  Stats stats_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_FD_CACHE_H_
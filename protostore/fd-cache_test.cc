@@ -0,0 +1,86 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/fd-cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+using ::testing::IsNull;
+using ::testing::Ne;
+
+std::shared_ptr<const SharedFd> OpenDevNull() {
+  return std::make_shared<const SharedFd>(
+      open("/dev/null", O_RDONLY | O_CLOEXEC));
+}
+
+TEST(FdCacheTest, ChecksTheInode) {
+  FdCache cache;
+  std::shared_ptr<const SharedFd> fd = OpenDevNull();
+  cache.Insert("a", 1, 2, fd);
+  EXPECT_THAT(cache.Lookup("a", 1, 2), Eq(fd));
+  EXPECT_THAT(cache.Lookup("b", 1, 2), IsNull());
+  // The file was replaced; the stale entry is dropped.
+  EXPECT_THAT(cache.Lookup("a", 1, 3), IsNull());
+  EXPECT_THAT(cache.Lookup("a", 1, 2), IsNull());
+
+  FdCache::Stats stats = cache.stats();
+  EXPECT_THAT(stats.hits, Eq(1));
+  EXPECT_THAT(stats.misses, Eq(3));
+  EXPECT_THAT(stats.stale, Eq(1));
+  EXPECT_THAT(stats.open_files, Eq(0));
+  // Still open for its other users.
+  EXPECT_THAT(fcntl(fd->get(), F_GETFD), Ne(-1));
+}
+
+TEST(FdCacheTest, EvictsLeastRecentlyUsed) {
+  FdCache cache(FdCache::Options{.max_open_files = 2});
+  cache.Insert("a", 1, 1, OpenDevNull());
+  cache.Insert("b", 1, 2, OpenDevNull());
+  ASSERT_THAT(cache.Lookup("a", 1, 1), Ne(nullptr));
+  cache.Insert("c", 1, 3, OpenDevNull());
+
+  EXPECT_THAT(cache.Lookup("a", 1, 1), Ne(nullptr));
+  EXPECT_THAT(cache.Lookup("b", 1, 2), IsNull());
+  EXPECT_THAT(cache.Lookup("c", 1, 3), Ne(nullptr));
+  EXPECT_THAT(cache.stats().evictions, Eq(1));
+  EXPECT_THAT(cache.stats().open_files, Eq(2));
+}
+
+TEST(FdCacheTest, FollowsRenames) {
+  FdCache cache;
+  std::shared_ptr<const SharedFd> fd = OpenDevNull();
+  cache.Insert("a.tmp", 1, 1, fd);
+  cache.Insert("a", 1, 2, OpenDevNull());
+  cache.Rename("a.tmp", "a");
+  EXPECT_THAT(cache.Lookup("a.tmp", 1, 1), IsNull());
+  EXPECT_THAT(cache.Lookup("a", 1, 1), Eq(fd));
+
+  cache.Erase("a");
+  EXPECT_THAT(cache.Lookup("a", 1, 1), IsNull());
+  EXPECT_THAT(cache.stats().open_files, Eq(0));
+}
+
+}  // namespace
+}  // namespace protostore
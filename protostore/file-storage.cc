@@ -14,11 +14,25 @@
 
 #include "protostore/file-storage.h"
 
+#include <algorithm>
+#include <climits>
 #include <cstdint>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 
 namespace protostore {
 namespace {
@@ -178,30 +192,101 @@ absl::Status IncrementReadBuffer(absl::string_view filename,
   }
   return absl::OkStatus();
 }
+// Largest transfer of one sendfile() or splice() call.
+constexpr uint64_t kMaxTransfer = 1 << 30;
+
+// Size requested for the pipe through which ReceiveFile() splices.
+constexpr int kSplicePipeSize = 1 << 20;
+
+// Waits for `events` on `fd`, after a non-blocking call returned EAGAIN.
+void WaitForFd(int fd, short events) {
+  struct pollfd pfd = {fd, events, 0};
+  while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+  }
+}
+
+FileId FileIdOf(const struct stat& sbuf) {
+  FileId id;
+  id.device = sbuf.st_dev;
+  id.inode = sbuf.st_ino;
+  id.size = sbuf.st_size;
+  id.mtime_nsec = static_cast<uint64_t>(sbuf.st_mtim.tv_sec) * 1000000000 +
+                  sbuf.st_mtim.tv_nsec;
+  return id;
+}
+
+// Splits `filename` into its directory, with a trailing slash, and basename.
+void SplitPath(const std::string& filename, std::string* directory,
+               std::string* basename) {
+  const size_t slash = filename.rfind('/');
+  *directory = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+  *basename =
+      slash == std::string::npos ? filename : filename.substr(slash + 1);
+}
+
 }  // namespace
 
-InputStream::InputStream(absl::string_view filename, FILE* file)
-  : filename_(filename), file_(file) {}
+InputStream::InputStream(absl::string_view filename, int fd)
+  : filename_(filename), fd_(fd) {}
+
+InputStream::InputStream(absl::string_view filename,
+                         std::shared_ptr<const SharedFd> fd)
+  : filename_(filename), fd_(fd->get()), shared_fd_(std::move(fd)) {}
 
 InputStream::~InputStream() {
-  if (file_ != nullptr) {
-    fclose(file_);
-    file_ = nullptr;
+  if (shared_fd_ == nullptr && fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
   }
 }
 
 absl::Status InputStream::Read(size_t n, absl::string_view* result,
     char* scratch) {
+  absl::Status s = ReadAt(offset_, n, result, scratch);
+  offset_ += result->size();
+  return s;
+}
+
+absl::Status InputStream::ReadAt(uint64_t offset, size_t n,
+    absl::string_view* result, char* scratch) const {
   absl::Status s;
   char* dst = scratch;
   while (n > 0 && s.ok()) {
-    ssize_t bytes_read = fread(dst, 1, n, file_);
+    ssize_t bytes_read = pread(fd_, dst, n, offset + (dst - scratch));
     s = IncrementReadBuffer(filename_, bytes_read, &dst, &n);
   }
   *result = absl::string_view(scratch, dst - scratch);
   return s;
 }
 
+absl::Status InputStream::SendTo(uint64_t offset, uint64_t size,
+    int out_fd) const {
+  // sendfile() is given the position, so the descriptor may be shared.
+  off_t position = offset;
+  while (size > 0) {
+    ssize_t sent =
+        sendfile(out_fd, fd_, &position, std::min(size, kMaxTransfer));
+    if (sent > 0) {
+      size -= sent;
+    } else if (sent == 0) {
+      return absl::OutOfRangeError(filename_);
+    } else if (errno == EAGAIN) {
+      WaitForFd(out_fd, POLLOUT);
+    } else if (errno != EINTR) {
+      return IOError(filename_);
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<FileId> InputStream::GetFileId() const {
+  struct stat sbuf;
+  if (fstat(fd_, &sbuf) != 0) {
+    return IOError(filename_);
+  }
+  return FileIdOf(sbuf);
+}
+
 OutputStream::OutputStream(absl::string_view filename, FILE* file)
   : filename_(filename), file_(file) {}
 
@@ -219,6 +304,86 @@ absl::Status OutputStream::Append(absl::string_view data) {
   return absl::OkStatus();
 }
 
+absl::Status OutputStream::AppendCord(const absl::Cord& data) {
+  absl::optional<absl::string_view> flat = data.TryFlat();
+  if (flat.has_value()) {
+    return Append(*flat);
+  }
+
+  // Bypass the FILE buffer, which must be drained first.
+  absl::Status s = Flush();
+  if (!s.ok()) {
+    return s;
+  }
+  const int fd = fileno(file_);
+  std::vector<struct iovec> iov;
+  auto chunk = data.chunk_begin();
+  while (chunk != data.chunk_end() || !iov.empty()) {
+    while (chunk != data.chunk_end() && iov.size() < IOV_MAX) {
+      iov.push_back({const_cast<char*>(chunk->data()), chunk->size()});
+      ++chunk;
+    }
+    ssize_t written = writev(fd, iov.data(), iov.size());
+    if (written < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;  // Retry
+      }
+      return IOError(filename_);
+    }
+    // Drop what was written, keeping any partially written iovec.
+    size_t done = 0;
+    while (done < iov.size() &&
+           static_cast<size_t>(written) >= iov[done].iov_len) {
+      written -= iov[done].iov_len;
+      done++;
+    }
+    iov.erase(iov.begin(), iov.begin() + done);
+    if (!iov.empty()) {
+      iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + written;
+      iov[0].iov_len -= written;
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status OutputStream::WriteAt(uint64_t offset, absl::string_view data) {
+  absl::Status s = Flush();
+  if (!s.ok()) {
+    return s;
+  }
+  const int fd = fileno(file_);
+  while (!data.empty()) {
+    ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+    if (written < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;  // Retry
+      }
+      return IOError(filename_);
+    }
+    data.remove_prefix(written);
+    offset += written;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status OutputStream::Flush() {
+  if (fflush(file_) != 0) {
+    return IOError(filename_);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status OutputStream::Sync() {
+  absl::Status s = Flush();
+  if (!s.ok()) {
+    return s;
+  }
+  if (fdatasync(fileno(file_)) != 0) {
+    return IOError(filename_);
+  }
+  return absl::OkStatus();
+}
+
 absl::Status OutputStream::Close() {
   absl::Status result;
   if (fflush(file_) != 0) {
@@ -231,6 +396,134 @@ absl::Status OutputStream::Close() {
   return result;
 }
 
+MappedFile::MappedFile(absl::string_view filename, void* data, size_t size,
+                       FileId id)
+  : filename_(filename), data_(data), size_(size), id_(id) {}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+    data_ = nullptr;
+  }
+}
+
+namespace internal {
+
+// One inotify instance shared by the CreationWatches of a FileStorage, with
+// one inotify watch per directory.
+class Inotify {
+ public:
+  // Takes ownership of the inotify descriptor `fd`.
+  explicit Inotify(int fd) : fd_(fd) {}
+  Inotify(const Inotify&) = delete;
+  Inotify& operator=(const Inotify&) = delete;
+  ~Inotify() { close(fd_); }
+
+  // Watches `directory` on behalf of `watch`.
+  absl::Status Add(const std::string& directory, CreationWatch* watch) {
+    absl::MutexLock lock(&mutex_);
+    // Returns the existing watch descriptor if the directory is watched.
+    const int wd = inotify_add_watch(
+        fd_, directory.c_str(),
+        IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd < 0) {
+      return IOError(directory);
+    }
+    watch->wd_ = wd;
+    watches_[wd].push_back(watch);
+    return absl::OkStatus();
+  }
+
+  // Stops watching on behalf of `watch`, removing the inotify watch of its
+  // directory once no other CreationWatch uses it.
+  void Remove(CreationWatch* watch) {
+    absl::MutexLock lock(&mutex_);
+    auto it = watches_.find(watch->wd_);
+    if (it == watches_.end()) {
+      return;
+    }
+    std::vector<CreationWatch*>& watches = it->second;
+    watches.erase(std::remove(watches.begin(), watches.end(), watch),
+                  watches.end());
+    if (watches.empty()) {
+      inotify_rm_watch(fd_, it->first);
+      watches_.erase(it);
+    }
+  }
+
+  bool MaybeCreated(CreationWatch* watch) {
+    absl::MutexLock lock(&mutex_);
+    if (!watch->created_) {
+      ReadEventsLocked();
+    }
+    return watch->created_;
+  }
+
+ private:
+  // Consumes the pending events, flagging the watches they concern.
+  void ReadEventsLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    alignas(struct inotify_event) char buffer[4096];
+    while (true) {
+      ssize_t bytes_read = read(fd_, buffer, sizeof(buffer));
+      if (bytes_read < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes_read < 0 && errno == EAGAIN) {
+        return;
+      }
+      if (bytes_read <= 0) {
+        // The instance is broken; assume the worst.
+        FlagAllLocked();
+        return;
+      }
+      for (char* p = buffer; p < buffer + bytes_read;) {
+        const auto* event = reinterpret_cast<const struct inotify_event*>(p);
+        p += sizeof(struct inotify_event) + event->len;
+        if ((event->mask & IN_Q_OVERFLOW) != 0) {
+          FlagAllLocked();
+          continue;
+        }
+        auto it = watches_.find(event->wd);
+        if (it == watches_.end()) {
+          continue;
+        }
+        const bool directory_gone =
+            (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) != 0;
+        for (CreationWatch* watch : it->second) {
+          if (directory_gone ||
+              (event->len > 0 && watch->basename_ == event->name)) {
+            watch->created_ = true;
+          }
+        }
+        if ((event->mask & IN_IGNORED) != 0) {
+          // The kernel dropped the inotify watch.
+          watches_.erase(it);
+        }
+      }
+    }
+  }
+
+  void FlagAllLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    for (auto& entry : watches_) {
+      for (CreationWatch* watch : entry.second) {
+        watch->created_ = true;
+      }
+    }
+  }
+
+  const int fd_;
+  absl::Mutex mutex_;
+  // The CreationWatches of each inotify watch descriptor.
+  absl::flat_hash_map<int, std::vector<CreationWatch*>> watches_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace internal
+
+CreationWatch::~CreationWatch() { inotify_->Remove(this); }
+
+bool CreationWatch::MaybeCreated() { return inotify_->MaybeCreated(this); }
+
 absl::StatusOr<uint64_t> FileStorage::GetFileSize(
     const std::string& filename) const {
   struct stat sbuf;
@@ -240,17 +533,61 @@ absl::StatusOr<uint64_t> FileStorage::GetFileSize(
   return sbuf.st_size;
 }
 
+absl::StatusOr<FileId> FileStorage::GetFileId(
+    const std::string& filename) const {
+  struct stat sbuf;
+  if (stat(filename.c_str(), &sbuf) != 0) {
+    return IOError(filename);
+  }
+  return FileIdOf(sbuf);
+}
+
 absl::StatusOr<std::unique_ptr<InputStream>> FileStorage::OpenForRead(
   const std::string& filename) const {
-  FILE* file = fopen(filename.c_str(), "r");
-  if (file == nullptr) {
+  if (fd_cache_ != nullptr) {
+    FileId id;
+    absl::StatusOr<std::shared_ptr<const SharedFd>> fd =
+        OpenShared(filename, &id);
+    if (!fd.ok()) {
+      return fd.status();
+    }
+    return absl::make_unique<InputStream>(filename, *std::move(fd));
+  }
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     return IOError(filename);
   }
-  return absl::make_unique<InputStream>(filename, file);
+  return absl::make_unique<InputStream>(filename, fd);
 }
 
 absl::StatusOr<std::unique_ptr<OutputStream>> FileStorage::OpenForWrite(
   const std::string& filename) const {
+  if (fd_cache_ != nullptr) {
+    // Opened for reading too, so that the descriptor can be cached.
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    if (fd < 0) {
+      return IOError(filename);
+    }
+    auto shared_fd = std::make_shared<const SharedFd>(fd);
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) != 0) {
+      return IOError(filename);
+    }
+    // The stream closes its own duplicate.
+    int stream_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    FILE* file = stream_fd < 0 ? nullptr : fdopen(stream_fd, "w");
+    if (file == nullptr) {
+      absl::Status status = IOError(filename);
+      if (stream_fd >= 0) {
+        close(stream_fd);
+      }
+      return status;
+    }
+    fd_cache_->Insert(filename, sbuf.st_dev, sbuf.st_ino,
+                      std::move(shared_fd));
+    return absl::make_unique<OutputStream>(filename, file);
+  }
   FILE* file = fopen(filename.c_str(), "w");
   if (file == nullptr) {
     return IOError(filename);
@@ -258,4 +595,230 @@ absl::StatusOr<std::unique_ptr<OutputStream>> FileStorage::OpenForWrite(
   return absl::make_unique<OutputStream>(filename, file);
 }
 
+absl::StatusOr<std::unique_ptr<OutputStream>> FileStorage::OpenForAppend(
+  const std::string& filename) const {
+  FILE* file = fopen(filename.c_str(), "a");
+  if (file == nullptr) {
+    return IOError(filename);
+  }
+  return absl::make_unique<OutputStream>(filename, file);
+}
+
+absl::StatusOr<std::unique_ptr<MappedFile>> FileStorage::MapForRead(
+  const std::string& filename) const {
+  FileId id;
+  absl::StatusOr<std::shared_ptr<const SharedFd>> fd =
+      OpenShared(filename, &id);
+  if (!fd.ok()) {
+    return fd.status();
+  }
+  // mmap() rejects empty mappings, so represent empty files without one.
+  void* data = nullptr;
+  if (id.size > 0) {
+    data = mmap(nullptr, id.size, PROT_READ, MAP_SHARED, (*fd)->get(), 0);
+    if (data == MAP_FAILED) {
+      return IOError(filename);
+    }
+  }
+  // The mapping stays valid after the descriptor is closed.
+  return absl::make_unique<MappedFile>(filename, data, id.size, id);
+}
+
+absl::StatusOr<std::shared_ptr<const SharedFd>> FileStorage::OpenShared(
+    const std::string& filename, FileId* id) const {
+  struct stat sbuf;
+  if (fd_cache_ != nullptr) {
+    // Checking that the path still leads to the cached file is one stat()
+    // rather than an open() and close().
+    if (stat(filename.c_str(), &sbuf) != 0) {
+      absl::Status status = IOError(filename);
+      fd_cache_->Erase(filename);
+      return status;
+    }
+    std::shared_ptr<const SharedFd> fd =
+        fd_cache_->Lookup(filename, sbuf.st_dev, sbuf.st_ino);
+    if (fd != nullptr) {
+      *id = FileIdOf(sbuf);
+      return fd;
+    }
+  }
+  int raw_fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (raw_fd < 0) {
+    return IOError(filename);
+  }
+  auto fd = std::make_shared<const SharedFd>(raw_fd);
+  if (fstat(raw_fd, &sbuf) != 0) {
+    return IOError(filename);
+  }
+  if (fd_cache_ != nullptr) {
+    fd_cache_->Insert(filename, sbuf.st_dev, sbuf.st_ino, fd);
+  }
+  *id = FileIdOf(sbuf);
+  return fd;
+}
+
+absl::Status FileStorage::Truncate(const std::string& filename,
+                                   uint64_t size) const {
+  if (truncate(filename.c_str(), size) != 0) {
+    return IOError(filename);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status FileStorage::WriteAt(const std::string& filename,
+                                  uint64_t offset,
+                                  absl::string_view data) const {
+  int fd = open(filename.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return IOError(filename);
+  }
+  absl::Status status;
+  while (!data.empty()) {
+    ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+    if (written < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;  // Retry
+      }
+      status = IOError(filename);
+      break;
+    }
+    data.remove_prefix(written);
+    offset += written;
+  }
+  close(fd);
+  return status;
+}
+
+absl::Status FileStorage::ReceiveFile(int in_fd, const std::string& filename,
+                                      uint64_t offset, uint64_t size) const {
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0666);
+  if (fd < 0) {
+    return IOError(filename);
+  }
+  int pipe_fds[2];
+  if (ftruncate(fd, offset + size) != 0 || pipe2(pipe_fds, O_CLOEXEC) != 0) {
+    absl::Status status = IOError(filename);
+    close(fd);
+    return status;
+  }
+  // A larger pipe means fewer calls; the default size works too.
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, kSplicePipeSize);
+
+  // splice() needs a pipe on one end, so the bytes go through one.
+  absl::Status status;
+  loff_t position = offset;
+  while (size > 0 && status.ok()) {
+    ssize_t in = splice(in_fd, nullptr, pipe_fds[1], nullptr,
+                        std::min(size, kMaxTransfer), SPLICE_F_MOVE);
+    if (in == 0) {
+      status = absl::OutOfRangeError(filename);
+      break;
+    }
+    if (in < 0) {
+      if (errno == EAGAIN) {
+        WaitForFd(in_fd, POLLIN);
+      } else if (errno != EINTR) {
+        status = IOError(filename);
+      }
+      continue;
+    }
+    size -= in;
+    while (in > 0) {
+      ssize_t out = splice(pipe_fds[0], nullptr, fd, &position, in,
+                           SPLICE_F_MOVE);
+      if (out > 0) {
+        in -= out;
+      } else if (out == 0) {
+        // Retrying would spin: the bytes left in the pipe cannot be moved.
+        status = absl::InternalError(
+            absl::StrCat("splice() made no progress writing: ", filename));
+        break;
+      } else if (errno != EINTR) {
+        status = IOError(filename);
+        break;
+      }
+    }
+  }
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  close(fd);
+  return status;
+}
+
+absl::Status FileStorage::Rename(const std::string& from,
+                                 const std::string& to) const {
+  if (rename(from.c_str(), to.c_str()) != 0) {
+    return IOError(from);
+  }
+  if (fd_cache_ != nullptr) {
+    fd_cache_->Rename(from, to);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status FileStorage::Delete(const std::string& filename) const {
+  if (fd_cache_ != nullptr) {
+    fd_cache_->Erase(filename);
+  }
+  if (unlink(filename.c_str()) != 0) {
+    return IOError(filename);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status FileStorage::SyncDirectory(const std::string& filename) const {
+  std::string directory;
+  std::string basename;
+  SplitPath(filename, &directory, &basename);
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return IOError(directory);
+  }
+  absl::Status status;
+  if (fsync(fd) != 0) {
+    status = IOError(directory);
+  }
+  close(fd);
+  return status;
+}
+
+absl::Status FileStorage::SyncFilesystem(const std::string& filename) const {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return IOError(filename);
+  }
+  absl::Status status;
+  if (syncfs(fd) != 0) {
+    status = IOError(filename);
+  }
+  close(fd);
+  return status;
+}
+
+absl::StatusOr<std::unique_ptr<CreationWatch>> FileStorage::WatchForCreation(
+  const std::string& filename) const {
+  std::string directory;
+  std::string basename;
+  SplitPath(filename, &directory, &basename);
+  std::shared_ptr<internal::Inotify> inotify;
+  {
+    absl::MutexLock lock(&inotify_mutex_);
+    if (inotify_ == nullptr) {
+      int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (fd < 0) {
+        return IOError(filename);
+      }
+      inotify_ = std::make_shared<internal::Inotify>(fd);
+    }
+    inotify = inotify_;
+  }
+  std::unique_ptr<CreationWatch> watch(new CreationWatch(inotify, basename));
+  absl::Status status = inotify->Add(directory, watch.get());
+  if (!status.ok()) {
+    return status;
+  }
+  return watch;
+}
+
 }  // namespace protostore
@@ -16,17 +16,42 @@
 #define PROTOSTORE_FILE_STORAGE_H_
 
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/cord.h"
 #include "absl/strings/string_view.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "protostore/fd-cache.h"
 
 namespace protostore {
 
-/// \brief Supports sequential reading from a file.
+/// \brief Identifies a version of a file: replacing the file by a rename, or
+/// modifying it, changes its id.
+struct FileId {
+  uint64_t device = 0;
+  uint64_t inode = 0;
+  uint64_t size = 0;
+  uint64_t mtime_nsec = 0;
+
+  bool operator==(const FileId& other) const {
+    return device == other.device && inode == other.inode &&
+           size == other.size && mtime_nsec == other.mtime_nsec;
+  }
+  bool operator!=(const FileId& other) const { return !(*this == other); }
+};
+
+/// \brief Supports sequential and positional reading from a file.
 class InputStream {
  public:
-  InputStream(absl::string_view filename, FILE* file);
+  /// \brief Takes ownership of the open file descriptor `fd`.
+  InputStream(absl::string_view filename, int fd);
+  /// \brief Reads through `fd`, which may be shared with other streams.
+  InputStream(absl::string_view filename, std::shared_ptr<const SharedFd> fd);
   InputStream(const InputStream&) = delete;
   InputStream& operator=(const InputStream&) = delete;
   ~InputStream();
@@ -46,12 +71,38 @@ class InputStream {
   /// On other non-OK returned status: `[0..n]` bytes have been stored in
   /// `*result`.
   ///
-  /// Safe for concurrent use by multiple threads.
+  /// Not safe for concurrent use, as it advances the current offset; use
+  /// ReadAt() to read from multiple threads.
   absl::Status Read(size_t n, absl::string_view* result, char* scratch);
 
+  /// \brief Reads up to `n` bytes from the file starting at `offset`.
+  ///
+  /// Same contract as Read(), but neither uses nor moves the current offset.
+  ///
+  /// Safe for concurrent use by multiple threads, which may read disjoint
+  /// parts of the file in parallel.
+  absl::Status ReadAt(uint64_t offset, size_t n, absl::string_view* result,
+                      char* scratch) const;
+
+  /// \brief Sends `size` bytes starting at `offset` to `out_fd`, e.g. a
+  /// socket or a pipe, with sendfile(), without copying them through user
+  /// space. Waits for `out_fd` to drain if it is non-blocking.
+  ///
+  /// Returns OUT_OF_RANGE if the file ends before `offset + size`.
+  ///
+  /// Safe for concurrent use, like ReadAt().
+  absl::Status SendTo(uint64_t offset, uint64_t size, int out_fd) const;
+
+  /// \brief Returns the id of the file this stream has open, which stays
+  /// the same if another file is renamed over its name.
+  absl::StatusOr<FileId> GetFileId() const;
+
  private:
   std::string filename_;
-  FILE* file_;
+  int fd_;
+  // Owns `fd_` if it is shared; otherwise this stream closes it.
+  std::shared_ptr<const SharedFd> shared_fd_;
+  uint64_t offset_ = 0;
 };
 
 /// \brief Supports sequential writing to a file.
@@ -66,6 +117,20 @@ class OutputStream {
   /// \brief Append 'data' to the file.
   absl::Status Append(absl::string_view data);
 
+  /// \brief Append the chunks of 'data' to the file with vectored writes.
+  absl::Status AppendCord(const absl::Cord& data);
+
+  /// \brief Flush() and overwrite the bytes at `offset` with `data`, e.g. to
+  /// fill in a header once the rest of the file is known. Appends continue
+  /// where they left off.
+  absl::Status WriteAt(uint64_t offset, absl::string_view data);
+
+  /// \brief Flush buffered data to the operating system.
+  absl::Status Flush();
+
+  /// \brief Flush() and wait for the data to reach stable storage.
+  absl::Status Sync();
+
   /// \brief Close the file.
   ///
   /// Flush() and de-allocate resources associated with this file
@@ -79,11 +144,78 @@ class OutputStream {
   FILE* file_;
 };
 
+/// \brief A read-only memory mapping of a whole file.
+class MappedFile {
+ public:
+  MappedFile(absl::string_view filename, void* data, size_t size,
+             FileId id = FileId());
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  /// \brief Unmaps the file.
+  ~MappedFile();
+
+  /// \brief The contents of the file, valid for the lifetime of this object.
+  absl::string_view data() const {
+    return absl::string_view(static_cast<const char*>(data_), size_);
+  }
+
+  const std::string& filename() const { return filename_; }
+
+  /// \brief The id of the mapped file as of mapping it, or zeros if the
+  /// mapping is not of a file.
+  const FileId& id() const { return id_; }
+
+ private:
+  std::string filename_;
+  void* data_;
+  size_t size_;
+  FileId id_;
+};
+
+namespace internal {
+class Inotify;
+}  // namespace internal
+
+/// \brief Notices a file being created, see FileStorage::WatchForCreation().
+class CreationWatch {
+ public:
+  CreationWatch(const CreationWatch&) = delete;
+  CreationWatch& operator=(const CreationWatch&) = delete;
+  ~CreationWatch();
+
+  /// \brief Returns true once the file may have been created since the watch
+  /// was set up. Never blocks; false positives are possible, e.g. when the
+  /// kernel's event queue overflowed or the directory went away.
+  ///
+  /// Not safe for concurrent use.
+  bool MaybeCreated();
+
+ private:
+  friend class FileStorage;
+  friend class internal::Inotify;
+
+  CreationWatch(std::shared_ptr<internal::Inotify> inotify,
+                absl::string_view basename)
+      : inotify_(std::move(inotify)), basename_(basename) {}
+
+  const std::shared_ptr<internal::Inotify> inotify_;
+  const std::string basename_;
+  // Guarded by the mutex of `inotify_`.
+  int wd_ = -1;
+  bool created_ = false;
+};
+
 /// \brief An lightweight interface to access the filesystem based on MobStore
 /// File C++.
 class FileStorage {
  public:
   FileStorage() = default;
+  /// Keeps the descriptors of files read, mapped or written open in
+  /// `fd_cache`, which must outlive this storage, so that reopening them is
+  /// skipped while they have not been replaced. Files written are opened
+  /// for reading as well, and their descriptor follows them through
+  /// Rename().
+  explicit FileStorage(FdCache* fd_cache) : fd_cache_(fd_cache) {}
   FileStorage(const FileStorage&) = delete;
   FileStorage& operator=(const FileStorage&) = delete;
   ~FileStorage() = default;
@@ -91,6 +223,9 @@ class FileStorage {
   /// Returns the file size or error.
   absl::StatusOr<uint64_t> GetFileSize(const std::string& filename) const;
 
+  /// Returns the id of the current version of the file, or error.
+  absl::StatusOr<FileId> GetFileId(const std::string& filename) const;
+
   /// Returns the file opened for sequential read, or error. The file is
   /// closed when the input stream goes out of scope.
   absl::StatusOr<std::unique_ptr<InputStream>> OpenForRead(
@@ -100,6 +235,64 @@ class FileStorage {
   /// closed when the output stream goes out of scope (or Close() is called).
   absl::StatusOr<std::unique_ptr<OutputStream>> OpenForWrite(
       const std::string& filename) const;
+
+  /// Returns the file opened for appending, creating it if needed, or error.
+  absl::StatusOr<std::unique_ptr<OutputStream>> OpenForAppend(
+      const std::string& filename) const;
+
+  /// Returns the whole file mapped into memory for reading, or error.
+  absl::StatusOr<std::unique_ptr<MappedFile>> MapForRead(
+      const std::string& filename) const;
+
+  /// Overwrites the bytes of an existing file at `offset` with `data`.
+  absl::Status WriteAt(const std::string& filename, uint64_t offset,
+                       absl::string_view data) const;
+
+  /// Creates or truncates the file to `offset + size` bytes and moves `size`
+  /// bytes read from `in_fd`, e.g. a socket or a pipe, into it at `offset`
+  /// with splice(), without copying them through user space. The bytes
+  /// before `offset` are left zero. Waits for `in_fd` if it is non-blocking.
+  ///
+  /// Returns OUT_OF_RANGE if `in_fd` ends before `size` bytes.
+  absl::Status ReceiveFile(int in_fd, const std::string& filename,
+                           uint64_t offset, uint64_t size) const;
+
+  /// Shrinks or extends the file to exactly `size` bytes.
+  absl::Status Truncate(const std::string& filename, uint64_t size) const;
+
+  /// Atomically replaces `to` with `from`.
+  absl::Status Rename(const std::string& from, const std::string& to) const;
+
+  /// Removes the file.
+  absl::Status Delete(const std::string& filename) const;
+
+  /// Makes the entries of the directory holding the file, e.g. those
+  /// created or renamed, durable.
+  absl::Status SyncDirectory(const std::string& filename) const;
+
+  /// Writes out everything cached by the operating system for the file
+  /// system holding the file, with one syncfs() call.
+  absl::Status SyncFilesystem(const std::string& filename) const;
+
+  /// Returns a watch on the directory of the file, noticing the file being
+  /// created or renamed into place, or error. The watches of a FileStorage
+  /// share one inotify instance, and one inotify watch per directory, as
+  /// instances are limited per user (fs.inotify.max_user_instances).
+  absl::StatusOr<std::unique_ptr<CreationWatch>> WatchForCreation(
+      const std::string& filename) const;
+
+ private:
+  // Returns a descriptor open for reading on the current version of the
+  // file, from `fd_cache_` if possible, and sets `*id` to its id.
+  absl::StatusOr<std::shared_ptr<const SharedFd>> OpenShared(
+      const std::string& filename, FileId* id) const;
+
+  FdCache* const fd_cache_ = nullptr;
+
+  // Created by the first WatchForCreation().
+  mutable absl::Mutex inotify_mutex_;
+  mutable std::shared_ptr<internal::Inotify> inotify_
+      ABSL_GUARDED_BY(inotify_mutex_);
 };
 
 }  // namespace protostore
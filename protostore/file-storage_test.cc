@@ -14,7 +14,12 @@
 
 #include "protostore/file-storage.h"
 
+#include <unistd.h>
+
 #include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "absl/strings/str_cat.h"
 #include "gmock/gmock.h"
@@ -26,8 +31,12 @@ namespace protostore {
 namespace {
 
 using ::testing::Eq;
+using ::testing::IsFalse;
+using ::testing::IsTrue;
+using ::testing::Ne;
 using ::testing::StartsWith;
 using testing::IsOk;
+using testing::IsOkAndHolds;
 using testing::StatusIs;
 
 class FileStorageTest : public testing::TestFileFixture {};
@@ -48,6 +57,68 @@ TEST_F(FileStorageTest, SmallWriteRead) {
   EXPECT_THAT(result, Eq("small"));
 }
 
+TEST_F(FileStorageTest, WriteAtFillsInEarlierBytes) {
+  FileStorage storage;
+  std::string testfile = TestFile("WriteAtFillsInEarlierBytes");
+  auto out = storage.OpenForWrite(testfile);
+  ASSERT_THAT(out, IsOk());
+  ASSERT_OK((*out)->Append("????"));
+  ASSERT_OK((*out)->Append("body"));
+  ASSERT_OK((*out)->WriteAt(0, "head"));
+  // Appends continue at the end.
+  ASSERT_OK((*out)->Append("tail"));
+  ASSERT_OK((*out)->Close());
+
+  auto mapped = storage.MapForRead(testfile);
+  ASSERT_THAT(mapped, IsOk());
+  EXPECT_THAT((*mapped)->data(), Eq("headbodytail"));
+}
+
+TEST_F(FileStorageTest, CachesDescriptorsUntilReplaced) {
+  FdCache cache;
+  FileStorage storage(&cache);
+  FileStorage uncached;
+  std::string testfile = TestFile("CachesDescriptorsUntilReplaced");
+  std::string tmpfile = testfile + ".tmp";
+  auto write = [&](const FileStorage& storage, absl::string_view contents) {
+    auto out = storage.OpenForWrite(tmpfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append(contents));
+    ASSERT_OK((*out)->Close());
+    ASSERT_OK(storage.Rename(tmpfile, testfile));
+  };
+  auto read = [&]() {
+    auto in = storage.OpenForRead(testfile);
+    EXPECT_THAT(in, IsOk());
+    char buffer[16];
+    absl::string_view result;
+    (*in)->ReadAt(0, 5, &result, buffer).IgnoreError();
+    return std::string(result);
+  };
+
+  // The descriptor the file was written through follows the rename.
+  write(storage, "first");
+  EXPECT_THAT(read(), Eq("first"));
+  EXPECT_THAT(read(), Eq("first"));
+  auto mapped = storage.MapForRead(testfile);
+  ASSERT_THAT(mapped, IsOk());
+  EXPECT_THAT((*mapped)->data(), Eq("first"));
+  EXPECT_THAT(cache.stats().hits, Eq(3));
+  EXPECT_THAT(cache.stats().misses, Eq(0));
+
+  // A replacement through another storage is noticed.
+  write(uncached, "other");
+  EXPECT_THAT(read(), Eq("other"));
+  EXPECT_THAT(read(), Eq("other"));
+  EXPECT_THAT(cache.stats().stale, Eq(1));
+  EXPECT_THAT(cache.stats().hits, Eq(4));
+
+  ASSERT_OK(storage.Delete(testfile));
+  EXPECT_THAT(storage.OpenForRead(testfile),
+              StatusIs(absl::StatusCode::kNotFound));
+  EXPECT_THAT(cache.stats().open_files, Eq(0));
+}
+
 TEST_F(FileStorageTest, ReadALittleAtATime) {
   FileStorage storage;
   std::string testfile = TestFile("ReadALittleAtATime");
@@ -174,5 +245,218 @@ TEST_F(FileStorageTest, GetFileSize) {
   ASSERT_THAT(*size, Eq(10));
 }
 
+TEST_F(FileStorageTest, GetFileIdChangesOnReplace) {
+  FileStorage storage;
+  std::string testfile = TestFile("GetFileIdChangesOnReplace");
+  std::string tmpfile = TestFile("GetFileIdChangesOnReplace.tmp");
+  for (const std::string& filename : {testfile, tmpfile}) {
+    auto out = storage.OpenForWrite(filename);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("0123456789"));
+  }
+
+  auto id = storage.GetFileId(testfile);
+  ASSERT_THAT(id, IsOk());
+  EXPECT_THAT(storage.GetFileId(testfile), IsOkAndHolds(Eq(*id)));
+  ASSERT_OK(storage.Rename(tmpfile, testfile));
+  EXPECT_THAT(storage.GetFileId(testfile), IsOkAndHolds(Ne(*id)));
+}
+
+TEST_F(FileStorageTest, AppendKeepsExistingData) {
+  FileStorage storage;
+  std::string testfile = TestFile("AppendKeepsExistingData");
+  for (absl::string_view data : {"first", "second"}) {
+    auto out = storage.OpenForAppend(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append(data));
+    ASSERT_OK((*out)->Flush());
+  }
+
+  auto in = storage.OpenForRead(testfile);
+  ASSERT_THAT(in, IsOk());
+  char buffer[1024];
+  absl::string_view result;
+  ASSERT_OK((*in)->Read(11, &result, buffer));
+  EXPECT_THAT(result, Eq("firstsecond"));
+}
+
+TEST_F(FileStorageTest, MapForRead) {
+  FileStorage storage;
+  std::string testfile = TestFile("MapForRead");
+  {
+    auto out = storage.OpenForWrite(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("mapped contents"));
+  }
+
+  auto mapped = storage.MapForRead(testfile);
+  ASSERT_THAT(mapped, IsOk());
+  EXPECT_THAT((*mapped)->data(), Eq("mapped contents"));
+
+  ASSERT_OK(storage.Truncate(testfile, 0));
+  auto empty = storage.MapForRead(testfile);
+  ASSERT_THAT(empty, IsOk());
+  EXPECT_THAT((*empty)->data(), Eq(""));
+
+  EXPECT_THAT(storage.MapForRead(TestFile("missing")),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+TEST_F(FileStorageTest, Truncate) {
+  FileStorage storage;
+  std::string testfile = TestFile("Truncate");
+  {
+    auto out = storage.OpenForWrite(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("0123456789"));
+  }
+
+  ASSERT_OK(storage.Truncate(testfile, 4));
+  auto size = storage.GetFileSize(testfile);
+  ASSERT_THAT(size, IsOk());
+  EXPECT_THAT(*size, Eq(4));
+}
+
+TEST_F(FileStorageTest, WatchForCreation) {
+  FileStorage storage;
+  std::string testfile = TestFile("WatchForCreation");
+  auto watch = storage.WatchForCreation(testfile);
+  ASSERT_THAT(watch, IsOk());
+  EXPECT_THAT((*watch)->MaybeCreated(), IsFalse());
+
+  ASSERT_THAT(storage.OpenForWrite(TestFile("other")), IsOk());
+  EXPECT_THAT((*watch)->MaybeCreated(), IsFalse());
+
+  ASSERT_THAT(storage.OpenForWrite(testfile), IsOk());
+  EXPECT_THAT((*watch)->MaybeCreated(), IsTrue());
+  EXPECT_THAT((*watch)->MaybeCreated(), IsTrue());
+
+  EXPECT_THAT(storage.WatchForCreation(TestFile("missing/file")),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+TEST_F(FileStorageTest, WatchesShareOneInotifyInstance) {
+  FileStorage storage;
+  // More watches than the default fs.inotify.max_user_instances.
+  std::vector<std::unique_ptr<CreationWatch>> watches;
+  for (int i = 0; i < 200; i++) {
+    auto watch = storage.WatchForCreation(TestFile(absl::StrCat("file", i)));
+    ASSERT_THAT(watch, IsOk());
+    watches.push_back(std::move(*watch));
+  }
+
+  ASSERT_THAT(storage.OpenForWrite(TestFile("file7")), IsOk());
+  EXPECT_THAT(watches[7]->MaybeCreated(), IsTrue());
+  EXPECT_THAT(watches[8]->MaybeCreated(), IsFalse());
+
+  // Dropping watches leaves the others on the directory working.
+  watches.erase(watches.begin(), watches.begin() + 100);
+  ASSERT_THAT(storage.OpenForWrite(TestFile("file150")), IsOk());
+  EXPECT_THAT(watches[50]->MaybeCreated(), IsTrue());
+  EXPECT_THAT(watches[51]->MaybeCreated(), IsFalse());
+}
+
+TEST_F(FileStorageTest, CordWriteRead) {
+  FileStorage storage;
+  std::string testfile = TestFile("CordWriteRead");
+  absl::Cord data;
+  for (int i = 0; i < 3000; i++) {
+    // Each append becomes a separate chunk.
+    std::string chunk(1000, 'a' + i % 26);
+    data.Append(absl::MakeCordFromExternal(chunk, [](absl::string_view) {}));
+    data.Append(std::string(1000, 'a' + i % 26));
+  }
+  std::string expected(data);
+  {
+    auto out = storage.OpenForWrite(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("head"));
+    ASSERT_OK((*out)->AppendCord(data));
+    ASSERT_OK((*out)->Append("tail"));
+  }
+
+  auto in = storage.OpenForRead(testfile);
+  ASSERT_THAT(in, IsOk());
+  char buffer[4];
+  absl::string_view result;
+  ASSERT_OK((*in)->Read(4, &result, buffer));
+  EXPECT_THAT(result, Eq("head"));
+  std::string read(expected.size(), '\0');
+  ASSERT_OK((*in)->Read(read.size(), &result, &read[0]));
+  EXPECT_THAT(result == expected, Eq(true));
+  ASSERT_OK((*in)->Read(4, &result, buffer));
+  EXPECT_THAT(result, Eq("tail"));
+  EXPECT_THAT((*in)->Read(1, &result, buffer),
+              StatusIs(absl::StatusCode::kOutOfRange));
+}
+
+TEST_F(FileStorageTest, ReadAtFromManyThreads) {
+  FileStorage storage;
+  std::string testfile = TestFile("ReadAtFromManyThreads");
+  {
+    auto out = storage.OpenForWrite(testfile);
+    ASSERT_THAT(out, IsOk());
+    for (int i = 0; i < 100; i++) {
+      ASSERT_OK((*out)->Append(std::string(1000, 'a' + i % 26)));
+    }
+  }
+
+  auto in = storage.OpenForRead(testfile);
+  ASSERT_THAT(in, IsOk());
+  const InputStream& input = **in;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&input, t]() {
+      char buffer[1000];
+      absl::string_view result;
+      for (int i = t; i < 100; i += 4) {
+        EXPECT_OK(input.ReadAt(i * 1000, 1000, &result, buffer));
+        EXPECT_THAT(result, Eq(std::string(1000, 'a' + i % 26)));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  // Positional reads leave the sequential offset alone.
+  char buffer[5];
+  absl::string_view result;
+  ASSERT_OK((*in)->Read(5, &result, buffer));
+  EXPECT_THAT(result, Eq("aaaaa"));
+  EXPECT_THAT((*in)->ReadAt(99999, 5, &result, buffer),
+              StatusIs(absl::StatusCode::kOutOfRange));
+  EXPECT_THAT(result, Eq("v"));
+}
+
+TEST_F(FileStorageTest, SendAndReceiveThroughPipe) {
+  FileStorage storage;
+  std::string source = TestFile("source");
+  std::string destination = TestFile("destination");
+  {
+    auto out = storage.OpenForWrite(source);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("hello world"));
+  }
+
+  auto in = storage.OpenForRead(source);
+  ASSERT_THAT(in, IsOk());
+  int fds[2];
+  ASSERT_THAT(pipe(fds), Eq(0));
+  ASSERT_OK((*in)->SendTo(6, 5, fds[1]));
+  ASSERT_OK(storage.ReceiveFile(fds[0], destination, 3, 5));
+  ASSERT_OK(storage.WriteAt(destination, 0, "abc"));
+  auto mapped = storage.MapForRead(destination);
+  ASSERT_THAT(mapped, IsOk());
+  EXPECT_THAT((*mapped)->data(), Eq("abcworld"));
+
+  EXPECT_THAT((*in)->SendTo(6, 6, fds[1]),
+              StatusIs(absl::StatusCode::kOutOfRange));
+  close(fds[1]);
+  EXPECT_THAT(storage.ReceiveFile(fds[0], destination, 0, 6),
+              StatusIs(absl::StatusCode::kOutOfRange));
+  close(fds[0]);
+}
+
 }  // namespace
 }  // namespace protostore
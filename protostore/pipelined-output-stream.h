@@ -0,0 +1,259 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_PIPELINED_OUTPUT_STREAM_H_
+#define PROTOSTORE_PIPELINED_OUTPUT_STREAM_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "google/protobuf/message_lite.h"
+#include "protostore/buffer-pool.h"
+#include "protostore/executor.h"
+#include "protostore/file-storage.h"
+#include "protostore/store-extensions.h"
+
+namespace protostore {
+namespace internal {
+
+// Streams serialized output to an OutputStream while it is being produced:
+// each block of `block_size` bytes, once filled by the caller, is
+// checksummed on `executor`, blocks in parallel, and appended to `output`
+// in order by whichever task finds it next in line. Serializing,
+// checksumming and IO thus overlap, and a large write takes about as long
+// as the slowest of them. At most `max_blocks_in_flight` blocks are
+// outstanding; Next() waits for the IO beyond that.
+template <typename ChecksumT>
+class PipelinedOutputStream final
+    : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  PipelinedOutputStream(OutputStream* output, size_t block_size,
+                        Executor* executor,
+                        BufferPool* buffer_pool = BufferPool::Default(),
+                        size_t max_blocks_in_flight = 8)
+      : block_size_(block_size),
+        executor_(executor),
+        buffer_pool_(buffer_pool),
+        max_blocks_in_flight_(max_blocks_in_flight),
+        state_(std::make_shared<State>()) {
+    state_->output = output;
+  }
+
+  PipelinedOutputStream(const PipelinedOutputStream&) = delete;
+  PipelinedOutputStream& operator=(const PipelinedOutputStream&) = delete;
+
+  // Waits for the blocks handed over to be written.
+  ~PipelinedOutputStream() override { WaitForBlocks(0); }
+
+  // Returns false once appending to the output has failed.
+  bool Next(void** data, int* size) override;
+  void BackUp(int count) override;
+  int64_t ByteCount() const override { return byte_count_; }
+
+  // Hands over the last block and waits for all of them to be written.
+  // Sets `*checksum` to the checksum of everything written. Returns the
+  // first error of the output.
+  absl::Status Finish(ChecksumT* checksum);
+
+ private:
+  struct Block {
+    uint64_t index;
+    BufferPool::Buffer buffer;
+    size_t size;
+    ChecksumT crc;
+  };
+
+  // Shared with the tasks, which may still be releasing the mutex when
+  // the stream is destroyed.
+  struct State {
+    OutputStream* output;
+    absl::Mutex mutex;
+    // Blocks handed over and not yet written.
+    size_t in_flight ABSL_GUARDED_BY(mutex) = 0;
+    // Checksummed blocks waiting for those before them to be written.
+    std::map<uint64_t, Block> ready ABSL_GUARDED_BY(mutex);
+    uint64_t next_to_write ABSL_GUARDED_BY(mutex) = 0;
+    // Whether a task is appending the blocks of `ready`.
+    bool writing ABSL_GUARDED_BY(mutex) = false;
+    ChecksumT crc ABSL_GUARDED_BY(mutex);
+    absl::Status status ABSL_GUARDED_BY(mutex);
+  };
+
+  // Hands the current block, if any, over to the executor.
+  void Submit();
+
+  // Checksums `block`, then appends the blocks that are next in line
+  // unless another task is already doing so.
+  static void Process(State* state, Block block)
+      ABSL_NO_THREAD_SAFETY_ANALYSIS;
+
+  // Waits until at most `count` blocks are outstanding.
+  void WaitForBlocks(size_t count);
+
+  const size_t block_size_;
+  Executor* const executor_;
+  BufferPool* const buffer_pool_;
+  const size_t max_blocks_in_flight_;
+  const std::shared_ptr<State> state_;
+
+  // Only used by the caller.
+  BufferPool::Buffer block_;
+  size_t used_ = 0;
+  int64_t byte_count_ = 0;
+  uint64_t next_index_ = 0;
+};
+
+template <typename ChecksumT>
+bool PipelinedOutputStream<ChecksumT>::Next(void** data, int* size) {
+  Submit();
+  WaitForBlocks(max_blocks_in_flight_ - 1);
+  {
+    absl::MutexLock lock(&state_->mutex);
+    if (!state_->status.ok()) {
+      return false;
+    }
+  }
+  // Left uninitialized; the caller overwrites it.
+  block_ = buffer_pool_->Acquire(block_size_);
+  used_ = block_size_;
+  *data = block_.data();
+  *size = block_size_;
+  byte_count_ += block_size_;
+  return true;
+}
+
+template <typename ChecksumT>
+void PipelinedOutputStream<ChecksumT>::BackUp(int count) {
+  used_ -= count;
+  byte_count_ -= count;
+}
+
+template <typename ChecksumT>
+absl::Status PipelinedOutputStream<ChecksumT>::Finish(ChecksumT* checksum) {
+  Submit();
+  WaitForBlocks(0);
+  absl::MutexLock lock(&state_->mutex);
+  *checksum = state_->crc;
+  return state_->status;
+}
+
+template <typename ChecksumT>
+void PipelinedOutputStream<ChecksumT>::Submit() {
+  if (used_ == 0) {
+    block_.Reset();
+    return;
+  }
+  // std::function needs a copyable closure.
+  auto block = std::make_shared<Block>(
+      Block{next_index_++, std::move(block_), used_, ChecksumT()});
+  used_ = 0;
+  {
+    absl::MutexLock lock(&state_->mutex);
+    state_->in_flight++;
+  }
+  executor_->Schedule(
+      [state = state_, block]() { Process(state.get(), std::move(*block)); });
+}
+
+template <typename ChecksumT>
+void PipelinedOutputStream<ChecksumT>::Process(State* state, Block block) {
+  block.crc.Append(absl::string_view(block.buffer.data(), block.size));
+  absl::MutexLock lock(&state->mutex);
+  state->ready.emplace(block.index, std::move(block));
+  if (state->writing) {
+    // The writing task picks it up when its turn comes.
+    return;
+  }
+  state->writing = true;
+  auto it = state->ready.find(state->next_to_write);
+  while (it != state->ready.end()) {
+    Block next = std::move(it->second);
+    state->ready.erase(it);
+    if (state->status.ok()) {
+      state->mutex.Unlock();
+      absl::Status status = state->output->Append(
+          absl::string_view(next.buffer.data(), next.size));
+      next.buffer.Reset();
+      state->mutex.Lock();
+      state->status.Update(status);
+    }
+    state->crc.Concat(next.crc, next.size);
+    state->next_to_write++;
+    state->in_flight--;
+    it = state->ready.find(state->next_to_write);
+  }
+  state->writing = false;
+}
+
+template <typename ChecksumT>
+void PipelinedOutputStream<ChecksumT>::WaitForBlocks(size_t count) {
+  absl::MutexLock lock(&state_->mutex);
+  State* state = state_.get();
+  auto done = [state, count]() ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    return state->in_flight <= count;
+  };
+  state->mutex.Await(absl::Condition(&done));
+}
+
+}  // namespace internal
+
+/// \brief Serializes protos through an internal::PipelinedOutputStream, for
+/// ProtoDataStore::Options::stream_serializer: blocks of a large proto are
+/// checksummed and written while the rest of it is still being serialized.
+template <typename ChecksumT>
+class PipelinedSerializer final : public StreamSerializer<ChecksumT> {
+ public:
+  /// Checksums and writes blocks of `block_size` bytes on `executor`, which
+  /// must outlive this, or inline when called on one of its threads (see
+  /// Executor::RunsOnCurrentThread()).
+  PipelinedSerializer(size_t block_size, Executor* executor,
+                      BufferPool* buffer_pool = BufferPool::Default())
+      : block_size_(block_size),
+        executor_(executor),
+        buffer_pool_(buffer_pool) {}
+
+  absl::Status Serialize(const google::protobuf::MessageLite& proto,
+                         OutputStream* output,
+                         ChecksumT* checksum) const override {
+    // The caller waits for the blocks, which could otherwise queue behind it.
+    Executor* executor = executor_->RunsOnCurrentThread()
+                             ? InlineExecutor::Default()
+                             : executor_;
+    internal::PipelinedOutputStream<ChecksumT> pipeline(
+        output, block_size_, executor, buffer_pool_);
+    {
+      google::protobuf::io::CodedOutputStream coded(&pipeline);
+      proto.SerializeWithCachedSizes(&coded);
+    }
+    return pipeline.Finish(checksum);
+  }
+
+ private:
+  const size_t block_size_;
+  Executor* const executor_;
+  BufferPool* const buffer_pool_;
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_PIPELINED_OUTPUT_STREAM_H_
@@ -0,0 +1,114 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/pipelined-output-stream.h"
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "gtest/gtest.h"
+#include "protostore/buffer-pool.h"
+#include "protostore/crc32.h"
+#include "protostore/file-storage.h"
+#include "protostore/testing-matchers.h"
+#include "protostore/testfile-fixture.h"
+#include "protostore/thread-pool.h"
+
+namespace protostore {
+namespace internal {
+namespace {
+
+using ::testing::Eq;
+using ::testing::IsFalse;
+using ::testing::IsTrue;
+using ::testing::Not;
+using testing::IsOk;
+using testing::IsOkAndHolds;
+
+class PipelinedOutputStreamTest : public testing::TestFileFixture {};
+
+std::string MakeData(size_t size) {
+  std::string data(size, '\0');
+  for (size_t i = 0; i < size; i++) {
+    data[i] = static_cast<char>(i * 7 + i / 4096);
+  }
+  return data;
+}
+
+TEST_F(PipelinedOutputStreamTest, WritesBlocksInOrder) {
+  FileStorage storage;
+  std::string testfile = TestFile("WritesBlocksInOrder");
+  const std::string data = MakeData(1000000);
+  ThreadPool pool(4);
+  auto out = storage.OpenForWrite(testfile);
+  ASSERT_THAT(out, IsOk());
+  Crc32 crc;
+  {
+    PipelinedOutputStream<Crc32> stream(out->get(), 4096, &pool,
+                                        BufferPool::Default(),
+                                        /*max_blocks_in_flight=*/3);
+    {
+      google::protobuf::io::CodedOutputStream coded(&stream);
+      // Written piecewise so that blocks end part way through calls.
+      for (size_t offset = 0; offset < data.size(); offset += 1000) {
+        coded.WriteRaw(data.data() + offset, 1000);
+      }
+    }
+    EXPECT_THAT(stream.ByteCount(), Eq(data.size()));
+    ASSERT_OK(stream.Finish(&crc));
+  }
+  ASSERT_OK((*out)->Close());
+
+  Crc32 expected;
+  expected.Append(data);
+  EXPECT_THAT(crc.Get(), Eq(expected.Get()));
+  auto mapped = storage.MapForRead(testfile);
+  ASSERT_THAT(mapped, IsOk());
+  EXPECT_THAT((*mapped)->data() == data, IsTrue());
+}
+
+TEST_F(PipelinedOutputStreamTest, EmptyStream) {
+  FileStorage storage;
+  std::string testfile = TestFile("EmptyStream");
+  auto out = storage.OpenForWrite(testfile);
+  ASSERT_THAT(out, IsOk());
+  PipelinedOutputStream<Crc32> stream(out->get(), 4096,
+                                      InlineExecutor::Default());
+  Crc32 crc(1);
+  ASSERT_OK(stream.Finish(&crc));
+  EXPECT_THAT(crc.Get(), Eq(Crc32().Get()));
+  ASSERT_OK((*out)->Close());
+  EXPECT_THAT(storage.GetFileSize(testfile), IsOkAndHolds(Eq(0)));
+}
+
+TEST_F(PipelinedOutputStreamTest, StopsAfterWriteError) {
+  FileStorage storage;
+  auto out = storage.OpenForWrite("/dev/full");
+  ASSERT_THAT(out, IsOk());
+  PipelinedOutputStream<Crc32> stream(out->get(), 1 << 20,
+                                      InlineExecutor::Default());
+  void* data;
+  int size;
+  ASSERT_THAT(stream.Next(&data, &size), IsTrue());
+  // Handing over the full block fails to write it.
+  EXPECT_THAT(stream.Next(&data, &size), IsFalse());
+  Crc32 crc;
+  EXPECT_THAT(stream.Finish(&crc), Not(IsOk()));
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace protostore
@@ -0,0 +1,114 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Exercises the store with a LITE_RUNTIME proto, which only links against
+// protobuf_lite.
+
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protostore/file-storage.h"
+#include "protostore/proto-data-store.h"
+#include "protostore/testing-matchers.h"
+#include "protostore/testfile-fixture.h"
+#include "protostore/thread-pool.h"
+#include "protostore/test_lite.pb.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Pointee;
+
+using testing::EqualsProto;
+using testing::IsOk;
+using testing::IsOkAndHolds;
+
+class ProtoDataStoreLiteTest : public testing::TestFileFixture {};
+
+TestLiteProto MakeProto(int entries) {
+  TestLiteProto proto;
+  proto.set_string_value("lite");
+  proto.set_int_value(42);
+  proto.set_blob(std::string(100000, 'b'));
+  for (int i = 0; i < entries; i++) {
+    TestLiteProto::Entry* entry = proto.add_entries();
+    entry->set_key(absl::StrCat("key", i));
+    entry->set_value(i);
+  }
+  return proto;
+}
+
+TEST_F(ProtoDataStoreLiteTest, ReadWrite) {
+  FileStorage storage;
+  std::string testfile = TestFile("ReadWrite");
+  TestLiteProto testproto = MakeProto(10);
+  {
+    ProtoDataStore<TestLiteProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestLiteProto>(testproto)));
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+  ProtoDataStore<TestLiteProto> pds(storage, testfile);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreLiteTest, MappedRead) {
+  FileStorage storage;
+  std::string testfile = TestFile("MappedRead");
+  TestLiteProto testproto = MakeProto(10);
+  {
+    ProtoDataStore<TestLiteProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestLiteProto>(testproto)));
+  }
+
+  ProtoDataStore<TestLiteProto>::Options options;
+  options.read_mode = ProtoDataStore<TestLiteProto>::ReadMode::kMapped;
+  options.mapped_only_fields = {TestLiteProto::kBlobFieldNumber};
+  ProtoDataStore<TestLiteProto> pds(storage, testfile, options);
+
+  TestLiteProto without_blob = testproto;
+  without_blob.clear_blob();
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(without_blob))));
+  auto blob = pds.ReadBytesField({TestLiteProto::kBlobFieldNumber});
+  ASSERT_THAT(blob, IsOk());
+  EXPECT_THAT(std::string(*blob), Eq(testproto.blob()));
+}
+
+TEST_F(ProtoDataStoreLiteTest, ChunkedParallelParse) {
+  FileStorage storage;
+  std::string testfile = TestFile("ChunkedParallelParse");
+  TestLiteProto testproto = MakeProto(10000);
+
+  ThreadPool pool(4);
+  ProtoDataStore<TestLiteProto>::Options options;
+  options.chunk_size = 4096;
+  options.read_executor = &pool;
+  options.parallel_parse.field_number = TestLiteProto::kEntriesFieldNumber;
+  options.parallel_parse.move_elements =
+      MoveRepeatedField(&TestLiteProto::mutable_entries);
+  options.parallel_parse.executor = &pool;
+  options.parallel_parse.part_size = 1000;
+  {
+    ProtoDataStore<TestLiteProto> pds(storage, testfile, options);
+    ASSERT_OK(pds.Write(absl::make_unique<TestLiteProto>(testproto)));
+  }
+  ProtoDataStore<TestLiteProto> pds(storage, testfile, options);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+}  // namespace
+}  // namespace protostore
@@ -15,52 +15,268 @@
 #ifndef PDS_PROTO_DATA_STORE_H_
 #define PDS_PROTO_DATA_STORE_H_
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/cord.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
 #include "absl/synchronization/mutex.h"
-#include "google/protobuf/stubs/status_macros.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/optional.h"
+#include "absl/types/span.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/repeated_field.h"
+#include "protostore/buffer-pool.h"
 #include "protostore/crc32.h"
+#include "protostore/executor.h"
 #include "protostore/file-storage.h"
 #include "protostore/status-macros.h"
+#include "protostore/store-extensions.h"
+#include "protostore/store-format.h"
+#include "protostore/store-policies.h"
+#include "protostore/wire-format.h"
 
 namespace protostore {
 
+class WriteBatch;
+
+namespace internal {
+
+// Returns true for one in `period` calls across the process.
+inline bool SampleVerification(uint32_t period) {
+  static std::atomic<uint64_t> calls{0};
+  return period <= 1 ||
+         calls.fetch_add(1, std::memory_order_relaxed) % period == 0;
+}
+
+}  // namespace internal
+
+// Returns a function moving all elements of a repeated message field from
+// one proto to the end of the same field of another, for
+// ProtoDataStore::Options::ParallelParse, e.g.
+// MoveRepeatedField(&MyProto::mutable_items).
+template <typename ProtoT, typename ElementT>
+std::function<void(ProtoT* from, ProtoT* to)> MoveRepeatedField(
+    google::protobuf::RepeatedPtrField<ElementT>* (ProtoT::*mutable_field)()) {
+  return [mutable_field](ProtoT* from, ProtoT* to) {
+    google::protobuf::RepeatedPtrField<ElementT>* source =
+        (from->*mutable_field)();
+    google::protobuf::RepeatedPtrField<ElementT>* destination =
+        (to->*mutable_field)();
+    if (destination->empty()) {
+      destination->Swap(source);
+      return;
+    }
+    std::vector<ElementT*> elements(source->size());
+    source->ExtractSubrange(0, source->size(), elements.data());
+    destination->Reserve(destination->size() + elements.size());
+    for (ElementT* element : elements) {
+      destination->AddAllocated(element);
+    }
+  };
+}
+
 /// \brief A simple file-backed proto with an in-memory cache.
 /// WARNING: Only use this for small protos. Files storing larger protos can
 /// benefit from more sophisticated strategies like chunked reads/writes,
 /// using mmap and ideally, not even using protos.
 ///
+/// The lock, checksum and storage policies (see store-policies.h) are fixed
+/// at compile time; the defaults make the class thread-safe, checksum with
+/// zlib's CRC-32 and use FileStorage.
+///
 /// This class is go/thread-compatible
-template <typename ProtoT>
+template <typename ProtoT, typename LockT = MutexLockPolicy,
+          typename ChecksumT = Crc32, typename StorageT = FileStorage>
 class ProtoDataStore final {
  public:
   // Header stored at the beginning of the file before the proto.
-  struct Header {
-    static constexpr int32_t kMagic = 0x726f746f;
+  using Header = StoreHeader;
+
+  // Invoked with every new version of the proto. `version` increases
+  // monotonically over the lifetime of the ProtoDataStore, so listeners
+  // running on a multi-threaded executor can discard stale deliveries.
+  using Listener = std::function<void(std::shared_ptr<const ProtoT> proto,
+                                      uint64_t version)>;
 
-    // Holds the magic as a quick sanity check against file corruption.
-    int32_t magic;
+  // Default upper bound of file-size that is supported.
+  static constexpr uint64_t kDefaultMaxFileSize = 1 * 1024 * 1024;  // 1 MiB.
 
-    // Checksum of the serialized proto, for a more thorough check against file
-    // corruption.
-    uint32_t proto_checksum;
+  // How a version of the proto is read from the file.
+  enum class ReadMode {
+    // Read into a temporary buffer which is discarded after parsing.
+    kCopy,
+    // Parse straight from a read-only mapping of the file. The mapping is
+    // kept alive with the cached version so that ReadBytesField() can serve
+    // fields from it without copying.
+    kMapped,
+  };
+
+  // Whether Read() remembers that the file does not exist.
+  enum class NotFoundCaching {
+    // Every Read() looks for the file again.
+    kNone,
+    // NOT_FOUND is returned without touching the file system until the next
+    // Write(). Only suitable if no other process creates the file.
+    kUntilWrite,
+    // Like kUntilWrite, but the directory of the file is also watched with
+    // inotify, so that a creation by another process is noticed by the next
+    // Read(). Falls back to kNone if the directory cannot be watched.
+    kWatch,
+  };
+
+  // How the checksum of the file is verified when a version is loaded.
+  enum class Verification {
+    // Before parsing, on the thread calling Read().
+    kAlways,
+    // After parsing, on Options::verification_executor, so that Read() does
+    // not wait for it. If the check fails, the loaded version is dropped,
+    // Options::on_verification_failure is called and the next Read()
+    // reloads the file, verifying it before parsing; pointers to the dropped
+    // version stay valid until the next write. Meant for storage that
+    // checksums data itself, e.g. btrfs or ZFS.
+    kDeferred,
+    // Like kAlways for one in Options::verification_sample_period loads
+    // across the process; the other loads are not verified.
+    kSampled,
+  };
+
+  struct Options {
+    // Upper bound of file-size that is supported.
+    uint64_t max_file_size = kDefaultMaxFileSize;
+
+    ReadMode read_mode = ReadMode::kCopy;
+
+    // With ReadMode::kMapped, numbers of top-level length-delimited fields
+    // (typically large `bytes` blobs) that are left out of the cached proto
+    // and only served by ReadBytesField(), so that they are never copied out
+    // of the mapping. Protos installed by Write() are cached as given.
+    std::vector<int> mapped_only_fields;
+
+    // If non-null, encodes columns of the proto that are stored ahead of it
+    // in the file, for ReadEncodedColumns(), e.g. a ColumnarFieldEncoder.
+    // The columns count towards max_file_size. Write() then needs the
+    // serialized proto in one piece, copying it if it has a chunk_size,
+    // and does not use the stream_serializer. Readers should set an encoder
+    // too, so that Read() skips the columns rather than keeping them as
+    // unknown fields. Must outlive the store.
+    const ColumnEncoder* column_encoder = nullptr;
+
+    // Top-level field number under which the columns are stored; ProtoT
+    // must not use it.
+    int columns_field_number = kDefaultColumnsFieldNumber;
+
+    // If non-zero, Write() serializes into an absl::Cord of blocks of this
+    // many bytes and writes them with vectored IO, and ReadMode::kCopy reads
+    // into blocks of this size, so that large protos never need one large
+    // contiguous allocation.
+    size_t chunk_size = 0;
+
+    // With a chunk_size, reads the chunks of the file on this executor with
+    // positional IO, checksumming each chunk on the thread that read it.
+    // Must outlive the ProtoDataStore.
+    Executor* read_executor = nullptr;
+
+    // If non-null and there is no column_encoder, Write() serializes the
+    // proto straight into the file with this, filling in the header last,
+    // e.g. with a PipelinedSerializer, so that large writes take about as
+    // long as the slower of serialization and IO rather than their sum.
+    // Writes of a proto equal to the cached one are then no longer skipped,
+    // as that needs the whole serialization up front. Must outlive the
+    // ProtoDataStore.
+    const StreamSerializer<ChecksumT>* stream_serializer = nullptr;
+
+    // Parses the elements of one large top-level repeated message field in
+    // parallel: a scan of the wire format splits them into parts, each part
+    // is parsed into a separate proto on `executor`, and the elements are
+    // moved into the result in order. The result is the same as that of a
+    // sequential parse. Enabled by a non-zero `field_number`; applies to
+    // ReadMode::kMapped, and to ReadMode::kCopy without a chunk_size.
+    struct ParallelParse {
+      int field_number = 0;
+      // Moves the elements of the field, see MoveRepeatedField().
+      std::function<void(ProtoT* from, ProtoT* to)> move_elements;
+      // Must outlive the ProtoDataStore. Parses inline if null.
+      Executor* executor = nullptr;
+      // Serialized bytes of elements parsed by each task.
+      size_t part_size = 1024 * 1024;
+    };
+    ParallelParse parallel_parse;
+
+    NotFoundCaching not_found_caching = NotFoundCaching::kNone;
+
+    Verification verification = Verification::kAlways;
+
+    // With Verification::kDeferred, runs the checks; inline if null. Must
+    // outlive the checks scheduled on it, which may outlive the store.
+    Executor* verification_executor = nullptr;
+
+    // With Verification::kDeferred, called on the executor with the error
+    // of a failed check.
+    std::function<void(const absl::Status& status)> on_verification_failure;
+
+    // With Verification::kSampled, verifies one in this many loads.
+    uint32_t verification_sample_period = 16;
+
+    // Recycles the buffers that files are read into and protos serialized
+    // into. Must outlive the store and the checks it schedules.
+    BufferPool* buffer_pool = BufferPool::Default();
+
+    // If non-null, loads go through this cache, e.g. a SharedMemoryCache,
+    // so that of the processes of a host loading the same version of the
+    // file only one reads and verifies it; the others parse it from shared
+    // memory. With ReadMode::kMapped, ReadBytesField() then aliases the
+    // cached contents. Contents are verified before they are cached,
+    // whatever the verification; chunk_size does not apply to such loads.
+    // Called with internal locks held. Must outlive the store, and only be
+    // used by it.
+    ContentsCache* contents_cache = nullptr;
+
+    // Contents of a store file, e.g. compiled into the binary by the
+    // proto_snapshot() rule of snapshot.bzl, that Read() serves while the
+    // file does not exist, until the first Write(). Validated and parsed
+    // once, like a file, with the same verification; the file is still
+    // looked up once so that one written earlier takes precedence.
+    // ReadBytesField(), ReadEncodedColumns(), ReadSerialized() and
+    // ExportTo() only see the file. Must outlive the store.
+    absl::string_view default_snapshot;
+
+    // Runs the Read() and Write() calls given a deadline that cannot
+    // complete right away, so that their callers can stop waiting at the
+    // deadline. Must outlive the store. Uses DetachedThreadExecutor::Default()
+    // if null.
+    //
+    // May be the same as the executors above: reads and writes run the
+    // stages they wait for inline when called on a thread of the executor
+    // meant for those stages (see Executor::RunsOnCurrentThread()).
+    Executor* background_executor = nullptr;
   };
 
   // Used the specified file to read older version of the proto and store
   // newer versions of the proto.
   //
-  ProtoDataStore(const FileStorage& file_storage, absl::string_view filename);
+  ProtoDataStore(const StorageT& file_storage, absl::string_view filename);
+  ProtoDataStore(const StorageT& file_storage, absl::string_view filename,
+                 Options options);
 
-  ~ProtoDataStore() = default;
+  // Waits for the calls given a deadline that still run in the background.
+  ~ProtoDataStore();
 
   // Returns a reference to the proto read from the file. It
   // internally caches the read proto so that future calls are fast.
@@ -69,139 +285,1565 @@ class ProtoDataStore final {
   // the returned object is only valid till a new version of the proto is
   // written to the file.
   //
-  // Returns NOT_FOUND if the file was empty or never written to.
+  // Returns NOT_FOUND if the file was empty or never written to. This may be
+  // cached, see Options::not_found_caching.
   // Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+  // Returns FAILED_PRECONDITION if the file was written with another
+  // checksum policy, see CheckStoreChecksumPolicy().
   absl::StatusOr<const ProtoT*> Read() const ABSL_LOCKS_EXCLUDED(mutex_);
 
+  // Like Read(), but stops waiting at `deadline`. The cached proto is
+  // returned under the reader lock, which loads from disk are not holding
+  // while it is set; otherwise the call runs on
+  // Options::background_executor.
+  //
+  // Returns DEADLINE_EXCEEDED if the call has not completed by `deadline`.
+  // A load still completes in the background and is cached for later calls.
+  absl::StatusOr<const ProtoT*> Read(absl::Time deadline) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
   // Writes the new version of the proto provided through to disk.
   // Successful Write() invalidates any previously read version of the proto.
   //
   // Returns INTERNAL_ERROR if any IO error is encountered and will NOT
   // invalidate any previously read versions of the proto.
   //
-  // TODO(b/132637068): The implementation today loses old data if Write()
-  //  fails. We should write to a tmp file first and rename the file to fix
-  //  this.
+  // The new version is written and synced to a temporary file which then
+  // replaces the old one, so that a failed Write() or a crash leaves either
+  // the old or the new data intact. After a crash, the old data may come
+  // back, since the directory is not synced. Use a WriteBatch to update
+  // several stores atomically and durably.
+  //
+  // Writes land in the order of the calls: a write is dropped, returning OK,
+  // if one called later has already landed. Readers of the cached proto
+  // never wait for the IO of a write.
   absl::Status Write(std::unique_ptr<ProtoT> proto) ABSL_LOCKS_EXCLUDED(mutex_);
 
+  // Like Write(), but runs on Options::background_executor and stops
+  // waiting for other writes and for the IO at `deadline`. If `deadline`
+  // has passed, nothing is written.
+  //
+  // Returns DEADLINE_EXCEEDED if the write has not completed by `deadline`.
+  // It then completes in the background, replacing the stored proto at once
+  // or not at all; listeners are notified of it as of any other write.
+  absl::Status Write(std::unique_ptr<ProtoT> proto, absl::Time deadline)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the length-delimited field at `field_path` (field numbers,
+  // outermost first) of the stored proto, e.g. a `bytes` blob. The returned
+  // Cord aliases the mapping of the file and keeps it alive; nothing is
+  // copied. If the field occurs several times, the last occurrence is used.
+  // The checksum of the file is verified before its fields are served, even
+  // if the verification of loads is deferred or sampled.
+  //
+  // Returns FAILED_PRECONDITION unless the read mode is ReadMode::kMapped.
+  // Returns NOT_FOUND if the file or the field does not exist.
+  // Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+  absl::StatusOr<absl::Cord> ReadBytesField(
+      absl::Span<const int> field_path) const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the columns stored ahead of the proto by
+  // Options::column_encoder, as encoded, without parsing the proto; see
+  // ReadColumns() of columnar.h for decoding them. The returned Cord aliases
+  // the mapping of the file and keeps it alive. Works in any read mode; the
+  // checksum of the file is verified once per version, whatever the
+  // verification of loads.
+  //
+  // Returns NOT_FOUND if the file does not exist or holds no columns, e.g.
+  // if it was written without a column encoder.
+  // Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+  absl::StatusOr<absl::Cord> ReadEncodedColumns() const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Like Write(), but takes the proto serialized, e.g. as received from a
+  // peer, and writes it without parsing it. The next Read() parses it,
+  // returning INTERNAL_ERROR if it is not a valid ProtoT, and notifies
+  // listeners. If `validate`, it is parsed right away instead.
+  //
+  // Returns INVALID_ARGUMENT if `serialized` is too large, or if `validate`
+  // and it does not parse.
+  // Returns INTERNAL_ERROR if any IO error is encountered.
+  absl::Status WriteSerialized(absl::Cord serialized, bool validate = false)
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns the serialized proto stored in the file, with its checksum
+  // verified, without parsing it. The returned Cord aliases the mapping of
+  // the file, or the Cord given to WriteSerialized(), and keeps it alive;
+  // nothing is copied.
+  //
+  // Returns NOT_FOUND if the file does not exist.
+  // Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+  absl::StatusOr<absl::Cord> ReadSerialized() const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Sends the serialized proto stored in the file to `fd`, e.g. a socket or
+  // a pipe, straight from the page cache with sendfile(). The checksum is
+  // verified first, unless it was for this version of the file by an
+  // earlier call. Writes do not wait for the transfer, which sends the
+  // verified version even if a write replaces the file meanwhile.
+  //
+  // Returns the number of bytes sent.
+  // Returns NOT_FOUND if the file does not exist.
+  // Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+  absl::StatusOr<uint64_t> ExportTo(int fd) const
+      ABSL_LOCKS_EXCLUDED(mutex_, write_mutex_);
+
+  // Like WriteSerialized(), but moves the `size` bytes of the serialized
+  // proto from `fd`, e.g. a socket or a pipe, into the file with splice(),
+  // without copying them through user space. The bytes are received before
+  // waiting for other writes; the checksum is computed from the page cache.
+  //
+  // Returns INVALID_ARGUMENT if `size` is too large, without reading `fd`.
+  // Returns OUT_OF_RANGE if `fd` ends before `size` bytes.
+  // Returns INTERNAL_ERROR if any IO error is encountered.
+  absl::Status ImportFrom(int fd, uint64_t size)
+      ABSL_LOCKS_EXCLUDED(mutex_, write_mutex_);
+
+  // Registers `listener` to be run on `executor` after each successful Write()
+  // that changes the proto, and after a version is (re)loaded from disk.
+  // Writes that store an identical proto do not notify.
+  //
+  // Listeners are never run while internal locks are held, so they may call
+  // back into the ProtoDataStore. `executor` must outlive the subscription.
+  //
+  // Returns an id that can be passed to Unsubscribe().
+  uint64_t Subscribe(Listener listener,
+                     Executor* executor = InlineExecutor::Default())
+      ABSL_LOCKS_EXCLUDED(listeners_mutex_);
+
+  // Stops deliveries to the listener registered with `id`, including those
+  // already handed to an executor, and waits for the ones in progress; once
+  // it returns, the listener no longer runs. A listener may unsubscribe
+  // itself, in which case only its other deliveries are waited for.
+  void Unsubscribe(uint64_t id) ABSL_LOCKS_EXCLUDED(listeners_mutex_);
+
+  // Like Read(), but shares ownership of the proto, which then stays valid
+  // for as long as it is held, even across later writes, e.g. for deriving
+  // a ProtoIndex from it. Unless null, `*version` is set to its version, as
+  // given to listeners.
+  absl::StatusOr<std::shared_ptr<const ProtoT>> ReadShared(
+      uint64_t* version = nullptr) const ABSL_LOCKS_EXCLUDED(mutex_);
+
   // Disallow copy and assign.
   ProtoDataStore(const ProtoDataStore&) = delete;
   ProtoDataStore& operator=(const ProtoDataStore&) = delete;
 
  private:
-  // Upper bound of file-size that is supported.
-  static constexpr uint64_t kMaxFileSize = 1 * 1024 * 1024;  // 1 MiB.
+  friend class WriteBatch;
+
+  // Reads, verifies and parses the proto stored in the file. If
+  // `deferred_check` is non-null, the checksum is not verified; instead,
+  // `*deferred_check` is set to a function verifying it later, which
+  // returns false on a mismatch.
+  absl::StatusOr<std::unique_ptr<ProtoT>> ReadFromDisk(
+      std::function<bool()>* deferred_check) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Validates and parses Options::default_snapshot. `deferred_check` is as
+  // for ReadFromDisk().
+  absl::StatusOr<std::unique_ptr<ProtoT>> ReadSnapshot(
+      std::function<bool()>* deferred_check) const;
+
+  // Whether the cached version has failed its deferred verification.
+  bool FailedVerificationLocked() const ABSL_SHARED_LOCKS_REQUIRED(mutex_) {
+    return verification_failed_ != nullptr &&
+           verification_failed_->load(std::memory_order_acquire);
+  }
+
+  // Serializes `proto`, honoring Options::chunk_size.
+  absl::Cord Serialize(const ProtoT& proto) const;
+
+  // Serializes `proto` for writing, checking Options::max_file_size.
+  absl::StatusOr<absl::Cord> SerializeForWrite(const ProtoT& proto) const;
+
+  // Returns the contents of the file storing the serialized `proto_str`,
+  // with the columns of Options::column_encoder ahead of it.
+  //
+  // Returns INVALID_ARGUMENT if the columns cannot be extracted or the file
+  // would exceed Options::max_file_size.
+  absl::StatusOr<absl::Cord> EncodeFile(const absl::Cord& proto_str) const;
+
+  // Removes the columns stored ahead of the proto, if any, from `*ranges`.
+  // Returns false if the data is malformed.
+  bool DropColumns(std::vector<absl::string_view>* ranges) const {
+    return options_.column_encoder == nullptr ||
+           internal::DropLeadingField(options_.columns_field_number, ranges);
+  }
+
+  // Replaces the file with `contents` through a temporary file.
+  absl::Status WriteFile(const absl::Cord& contents) const;
+
+  // Replaces the file with the temporary file written by `write`. The
+  // temporary file is synced before the rename, and deleted on error.
+  absl::Status ReplaceFile(
+      const std::function<absl::Status(OutputStream*)>& write) const;
+
+  // Replaces the file with `proto` through a temporary file, serializing it
+  // straight into the file with Options::stream_serializer.
+  absl::Status WriteStreamed(const ProtoT& proto) const;
+
+  // Installs `proto`, which was just written to the file, and returns its
+  // version number. If `proto` is null, the cached version is dropped for
+  // the next Read() to parse `serialized_`, and 0 is returned.
+  uint64_t InstallWrittenLocked(std::shared_ptr<const ProtoT> proto) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // For WriteBatch, which holds the locks of several stores at once: the
+  // write lock from staging a version to installing it, and `mutex_` while
+  // installing it.
+  void LockWritesForBatch() const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    write_mutex_.Lock();
+  }
+  void UnlockWritesForBatch() const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    write_mutex_.Unlock();
+  }
+  void LockForBatch() const ABSL_NO_THREAD_SAFETY_ANALYSIS { mutex_.Lock(); }
+  void UnlockForBatch() const ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    mutex_.Unlock();
+  }
+  uint64_t InstallForBatch(std::shared_ptr<const ProtoT> proto) const
+      ABSL_NO_THREAD_SAFETY_ANALYSIS {
+    // Supersedes the writes called before.
+    written_ticket_ = next_write_ticket_.fetch_add(1);
+    return InstallWrittenLocked(std::move(proto));
+  }
+
+  // Receives `size` bytes from `fd` into `tmp_filename` as a store file for
+  // ImportFrom(). Returns the serialized proto, aliasing its mapping.
+  absl::StatusOr<absl::Cord> ReceiveFile(
+      int fd, uint64_t size, const std::string& tmp_filename) const;
+
+  // Writes `proto`, unless a write with a later `ticket` has landed.
+  absl::Status WriteTicket(std::unique_ptr<ProtoT> proto, uint64_t ticket)
+      ABSL_LOCKS_EXCLUDED(mutex_, write_mutex_);
+
+  // Returns `executor` for running stages of a read or write that the
+  // caller waits for, or InlineExecutor::Default() if `executor` is null or
+  // runs the calling thread.
+  static Executor* StageExecutor(Executor* executor);
+
+  // Runs `call` on Options::background_executor, waiting for its result
+  // until `deadline`.
+  template <typename ResultT>
+  ResultT RunUntil(std::function<ResultT()> call, absl::Time deadline) const;
+
+  // Reads `size` bytes of `input_stream` starting at `offset` into `*cord`,
+  // as chunks of Options::chunk_size bytes, and unless `crc` is null, their
+  // checksum into `*crc`.
+  absl::Status ReadChunks(const InputStream& input_stream, uint64_t offset,
+                          uint64_t size, absl::Cord* cord,
+                          ChecksumT* crc) const;
+
+  // Parses the concatenation of `ranges`.
+  absl::StatusOr<std::unique_ptr<ProtoT>> ParseRanges(
+      std::vector<absl::string_view> ranges) const;
+
+  // Parses the concatenation of `ranges` without checking that required
+  // fields are set. Returns nullptr on failure.
+  static std::unique_ptr<ProtoT> ParsePartialRanges(
+      std::vector<absl::string_view> ranges);
+
+  // Parses `data`, except the top-level fields in `excluded_fields`, if
+  // Options::parallel_parse applies, or sequentially otherwise.
+  absl::StatusOr<std::unique_ptr<ProtoT>> Parse(
+      absl::string_view data, absl::Span<const int> excluded_fields) const;
+
+  // Remembers the NOT_FOUND `status` of a read, as per
+  // Options::not_found_caching.
+  void CacheNotFoundLocked(absl::Status status) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Loads the proto through Options::contents_cache.
+  absl::StatusOr<std::unique_ptr<ProtoT>> ReadThroughCache() const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Maps and verifies the file, keeping the mapping in `mapped_file_`.
+  // `deferred_check` is as for ReadFromDisk().
+  absl::StatusOr<absl::string_view> MapLocked(
+      std::function<bool()>* deferred_check) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Maps the file into `*mapped_file` and returns the serialized proto in
+  // it. `deferred_check` is as for ReadFromDisk().
+  absl::StatusOr<absl::string_view> MapFile(
+      std::shared_ptr<const MappedFile>* mapped_file,
+      std::function<bool()>* deferred_check) const;
+
+  // Returns the serialized proto in the mapping of the file, which is set
+  // in `*mapped_file`: `mapped_file_` if its checksum has been verified
+  // already, or else a new mapping, verified without holding `mutex_`.
+  absl::StatusOr<absl::string_view> VerifiedMapping(
+      std::shared_ptr<const MappedFile>* mapped_file) const
+      ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // A registered listener, shared with the deliveries to it.
+  class Subscription {
+   public:
+    Subscription(uint64_t id, Listener listener, Executor* executor)
+        : id_(id), listener_(std::move(listener)), executor_(executor) {}
+
+    uint64_t id() const { return id_; }
+    Executor* executor() const { return executor_; }
+
+    // Runs the listener unless cancelled.
+    void Deliver(std::shared_ptr<const ProtoT> proto, uint64_t version)
+        ABSL_LOCKS_EXCLUDED(mutex_);
+
+    // Stops later deliveries and waits for those in progress on other
+    // threads.
+    void Cancel() ABSL_LOCKS_EXCLUDED(mutex_);
+
+   private:
+    bool DoneElsewhere() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+      return delivering_.size() <= delivering_on_canceller_;
+    }
+
+    const uint64_t id_;
+    const Listener listener_;
+    Executor* const executor_;
+
+    absl::Mutex mutex_;
+    bool cancelled_ ABSL_GUARDED_BY(mutex_) = false;
+    // The thread of each delivery in progress.
+    std::vector<std::thread::id> delivering_ ABSL_GUARDED_BY(mutex_);
+    // Deliveries on the thread of Cancel(), i.e. of a listener unsubscribing
+    // itself, which cannot finish before Cancel() returns.
+    size_t delivering_on_canceller_ ABSL_GUARDED_BY(mutex_) = 0;
+  };
+
+  // Installs `proto` as the cached version and returns its version number.
+  uint64_t InstallLocked(std::shared_ptr<const ProtoT> proto) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Hands `proto` to every subscribed listener.
+  void Notify(std::shared_ptr<const ProtoT> proto, uint64_t version) const
+      ABSL_LOCKS_EXCLUDED(mutex_, listeners_mutex_);
 
   // Used to provide reader and writer locks
-  mutable absl::Mutex mutex_;
+  mutable LockT mutex_;
+
+  // Serializes writes, which only take `mutex_` to install their proto.
+  // Taken before `mutex_`.
+  mutable LockT write_mutex_;
+  // Orders the Write() calls; the ticket of the last one that landed.
+  mutable std::atomic<uint64_t> next_write_ticket_{1};
+  mutable uint64_t written_ticket_ ABSL_GUARDED_BY(write_mutex_) = 0;
 
-  const FileStorage& file_storage_;
+  // The calls given a deadline still running in the background, which the
+  // destructor awaits. Shared with them, as they end after decrementing it.
+  struct BackgroundCalls {
+    absl::Mutex mutex;
+    int pending ABSL_GUARDED_BY(mutex) = 0;
+  };
+  const std::shared_ptr<BackgroundCalls> background_calls_ =
+      std::make_shared<BackgroundCalls>();
+
+  const StorageT& file_storage_;
   const std::string filename_;
+  const Options options_;
+
+  mutable std::shared_ptr<const ProtoT> cached_proto_ ABSL_GUARDED_BY(mutex_);
+  // Whether `cached_proto_` is set, for Read(absl::Time) to take the reader
+  // lock only when it will not wait for a load.
+  mutable std::atomic<bool> has_cached_proto_{false};
+  mutable uint64_t version_ ABSL_GUARDED_BY(mutex_) = 0;
+  // Counts the versions installed, including those left for the next
+  // Read() to parse, so that IO done without `mutex_` can tell whether its
+  // result still matches the file.
+  mutable uint64_t installs_ ABSL_GUARDED_BY(mutex_) = 0;
+  // Whether `cached_proto_` is Options::default_snapshot rather than the
+  // contents of the file.
+  mutable bool cached_from_snapshot_ ABSL_GUARDED_BY(mutex_) = false;
+
+  // With ReadMode::kMapped, the mapping of the file holding `cached_proto_`,
+  // if it has been mapped.
+  mutable std::shared_ptr<const MappedFile> mapped_file_
+      ABSL_GUARDED_BY(mutex_);
+  // Whether the checksum of `mapped_file_` was verified when it was mapped,
+  // rather than deferred.
+  mutable bool mapped_file_verified_ ABSL_GUARDED_BY(mutex_) = false;
+
+  // The serialized proto of the current version, if known: given to
+  // WriteSerialized(), or as verified by ReadSerialized().
+  mutable absl::optional<absl::Cord> serialized_ ABSL_GUARDED_BY(mutex_);
 
-  mutable std::unique_ptr<ProtoT> cached_proto_ ABSL_GUARDED_BY(mutex_);
+  // The version of the file whose checksum ExportTo() last verified.
+  mutable absl::optional<FileId> exported_file_id_ ABSL_GUARDED_BY(mutex_);
+
+  // The cached result of reading a missing file, or OK if there is none,
+  // and with NotFoundCaching::kWatch, the watch for its creation.
+  mutable absl::Status not_found_ ABSL_GUARDED_BY(mutex_);
+  mutable std::unique_ptr<CreationWatch> creation_watch_
+      ABSL_GUARDED_BY(mutex_);
+
+  // With Verification::kDeferred, set by the check of the cached version if
+  // it fails. Null if the cached version has no pending check.
+  mutable std::shared_ptr<std::atomic<bool>> verification_failed_
+      ABSL_GUARDED_BY(mutex_);
+  // Whether the next load must be verified before parsing.
+  mutable bool verify_next_load_ ABSL_GUARDED_BY(mutex_) = false;
+  // The version dropped by a failed deferred verification, which pointers
+  // returned by Read() may refer to until the next write.
+  mutable std::shared_ptr<const ProtoT> retired_proto_ ABSL_GUARDED_BY(mutex_);
+
+  // Guards the subscriptions; never held together with `mutex_`.
+  mutable LockT listeners_mutex_;
+  std::vector<std::shared_ptr<Subscription>> subscriptions_
+      ABSL_GUARDED_BY(listeners_mutex_);
+  uint64_t next_subscription_id_ ABSL_GUARDED_BY(listeners_mutex_) = 1;
 };
 
-template <typename ProtoT>
-constexpr uint64_t ProtoDataStore<ProtoT>::kMaxFileSize;
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+constexpr uint64_t
+    ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::kDefaultMaxFileSize;
 
-template <typename ProtoT>
-ProtoDataStore<ProtoT>::ProtoDataStore(
-    const FileStorage& file_storage, absl::string_view filename)
-    : file_storage_(file_storage), filename_(filename) {}
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ProtoDataStore(
+    const StorageT& file_storage, absl::string_view filename)
+    : ProtoDataStore(file_storage, filename, Options()) {}
 
-template <typename ProtoT>
-absl::StatusOr<const ProtoT*> ProtoDataStore<ProtoT>::Read() const {
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ProtoDataStore(
+    const StorageT& file_storage, absl::string_view filename, Options options)
+    : file_storage_(file_storage),
+      filename_(filename),
+      options_(std::move(options)) {}
 
-  absl::WriterMutexLock lock(&mutex_);
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::~ProtoDataStore() {
+  absl::MutexLock lock(&background_calls_->mutex);
+  background_calls_->mutex.Await(absl::Condition(
+      +[](int* pending) { return *pending == 0; },
+      &background_calls_->pending));
+}
 
-  // Return cached proto if we've already read from disk.
-  if (cached_proto_ != nullptr) {
-    return cached_proto_.get();
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<const ProtoT*>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Read() const {
+  {
+    internal::ReaderLock<LockT> lock(&mutex_);
+
+    // Return cached proto if we've already read from disk.
+    if (cached_proto_ != nullptr && !FailedVerificationLocked()) {
+      return cached_proto_.get();
+    }
+    if (!not_found_.ok() && creation_watch_ == nullptr) {
+      return not_found_;
+    }
   }
 
-  PDS_ASSIGN_OR_RETURN(uint64_t file_size, file_storage_.GetFileSize(filename_));
-  if (file_size > kMaxFileSize) {
-    return absl::InternalError(absl::StrCat(
-        "File larger than expected, couldn't read: ", filename_));
+  std::shared_ptr<const ProtoT> loaded;
+  uint64_t version;
+  std::function<bool()> deferred_check;
+  std::shared_ptr<std::atomic<bool>> failed;
+  {
+    internal::WriterLock<LockT> lock(&mutex_);
+
+    // Another thread may have loaded it meanwhile.
+    if (cached_proto_ != nullptr) {
+      if (!FailedVerificationLocked()) {
+        return cached_proto_.get();
+      }
+      // Read() may have returned it, so it is kept until the next write.
+      retired_proto_ = std::move(cached_proto_);
+      has_cached_proto_.store(false, std::memory_order_release);
+      mapped_file_.reset();
+      verification_failed_.reset();
+      verify_next_load_ = true;
+    }
+
+    if (!not_found_.ok()) {
+      if (creation_watch_ == nullptr || !creation_watch_->MaybeCreated()) {
+        return not_found_;
+      }
+      not_found_ = absl::OkStatus();
+      creation_watch_.reset();
+    }
+
+    bool verify = true;
+    switch (options_.verification) {
+      case Verification::kAlways:
+        break;
+      case Verification::kDeferred:
+        verify = verify_next_load_;
+        break;
+      case Verification::kSampled:
+        verify = internal::SampleVerification(
+            options_.verification_sample_period);
+        break;
+    }
+    absl::StatusOr<std::unique_ptr<ProtoT>> proto =
+        ReadFromDisk(verify ? nullptr : &deferred_check);
+    bool from_snapshot = false;
+    if (absl::IsNotFound(proto.status())) {
+      if (options_.default_snapshot.empty()) {
+        CacheNotFoundLocked(proto.status());
+      } else {
+        proto = ReadSnapshot(verify ? nullptr : &deferred_check);
+        from_snapshot = true;
+      }
+    }
+    PDS_RETURN_IF_ERROR(proto.status());
+    loaded = std::move(*proto);
+    version = InstallLocked(loaded);
+    cached_from_snapshot_ = from_snapshot;
+    verify_next_load_ = false;
+    if (options_.verification == Verification::kDeferred && !verify) {
+      verification_failed_ = std::make_shared<std::atomic<bool>>(false);
+      failed = verification_failed_;
+    }
+  }
+  if (failed != nullptr) {
+    // Captures nothing of the store, which may be gone when the check runs.
+    Executor* executor = options_.verification_executor != nullptr
+                             ? options_.verification_executor
+                             : InlineExecutor::Default();
+    executor->Schedule([check = std::move(deferred_check), failed,
+                        on_failure = options_.on_verification_failure,
+                        filename = filename_]() {
+      if (check()) {
+        return;
+      }
+      failed->store(true, std::memory_order_release);
+      if (on_failure) {
+        on_failure(absl::InternalError(
+            absl::StrCat("Checksum of file does not match: ", filename)));
+      }
+    });
+  }
+  Notify(loaded, version);
+  return loaded.get();
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<const ProtoT*>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Read(
+    absl::Time deadline) const {
+  static_assert(!std::is_same<LockT, NoLockPolicy>::value,
+                "Calls given a deadline run concurrently with others");
+  if (has_cached_proto_.load(std::memory_order_acquire)) {
+    internal::ReaderLock<LockT> lock(&mutex_);
+    if (cached_proto_ != nullptr && !FailedVerificationLocked()) {
+      return cached_proto_.get();
+    }
+  }
+  return RunUntil<absl::StatusOr<const ProtoT*>>([this]() { return Read(); },
+                                                 deadline);
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<std::unique_ptr<ProtoT>>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadFromDisk(
+    std::function<bool()>* deferred_check) const {
+  if (serialized_.has_value()) {
+    if (deferred_check != nullptr) {
+      *deferred_check = []() { return true; };
+    }
+    // Parsing was deferred by WriteSerialized().
+    return ParseRanges(std::vector<absl::string_view>(
+        serialized_->chunk_begin(), serialized_->chunk_end()));
+  }
+
+  if (options_.contents_cache != nullptr) {
+    if (deferred_check != nullptr) {
+      // Cached contents have been verified by whoever loaded them.
+      *deferred_check = []() { return true; };
+    }
+    return ReadThroughCache();
+  }
+
+  if (options_.read_mode == ReadMode::kMapped) {
+    PDS_ASSIGN_OR_RETURN(absl::string_view proto_str,
+                         MapLocked(deferred_check));
+    return Parse(proto_str, options_.mapped_only_fields);
   }
 
   PDS_ASSIGN_OR_RETURN(std::unique_ptr<InputStream> input_stream,
                    file_storage_.OpenForRead(filename_));
+  // The size of the file opened, even if a write replaced it meanwhile.
+  PDS_ASSIGN_OR_RETURN(const FileId file_id, input_stream->GetFileId());
+  const uint64_t file_size = file_id.size;
+  if (file_size > options_.max_file_size) {
+    return absl::InternalError(absl::StrCat(
+        "File larger than expected, couldn't read: ", filename_));
+  }
 
   // Used to hold the memory address and length of the read data.
   absl::string_view read;
 
+  char header_bytes[sizeof(Header)];
+  PDS_RETURN_IF_ERROR(input_stream->Read(sizeof(Header), &read, header_bytes));
   Header header;
-  PDS_RETURN_IF_ERROR(input_stream->Read(sizeof(Header), &read,
-                                     reinterpret_cast<char*>(&header)));
-
-  if (header.magic != Header::kMagic) {
-    return absl::InternalError(
-        absl::StrCat("Invalid header kMagic for: ", filename_));
-  }
+  PDS_RETURN_IF_ERROR(
+      ParseStoreHeader<ChecksumT>(filename_, read, &header).status());
 
   const uint64_t proto_size = file_size - sizeof(Header);
 
-  // Used to hold the proto read from file.
-  auto scratch = absl::make_unique<char[]>(proto_size);
+  if (options_.chunk_size > 0) {
+    absl::Cord proto_cord;
+    ChecksumT crc;
+    PDS_RETURN_IF_ERROR(ReadChunks(*input_stream, sizeof(Header), proto_size,
+                                   &proto_cord,
+                                   deferred_check == nullptr ? &crc : nullptr));
+    if (deferred_check != nullptr) {
+      *deferred_check = [proto_cord, checksum = header.proto_checksum]() {
+        ChecksumT crc;
+        for (absl::string_view chunk : proto_cord.Chunks()) {
+          crc.Append(chunk);
+        }
+        return StoreChecksumMatches(checksum, crc);
+      };
+    } else if (!StoreChecksumMatches(header.proto_checksum, crc)) {
+      return absl::InternalError(
+          absl::StrCat("Checksum of file does not match: ", filename_));
+    }
+    return ParseRanges(std::vector<absl::string_view>(proto_cord.chunk_begin(),
+                                                      proto_cord.chunk_end()));
+  }
+
+  // Used to hold the proto read from file, and to verify it later.
+  auto scratch = std::make_shared<BufferPool::Buffer>(
+      options_.buffer_pool->Acquire(proto_size));
 
   // Now, |read.data()| points to the beginning of ProtoT.
-  PDS_RETURN_IF_ERROR(input_stream->Read(proto_size, &read, scratch.get()));
+  PDS_RETURN_IF_ERROR(input_stream->Read(proto_size, &read, scratch->data()));
 
   absl::string_view proto_str(read.data(), proto_size);
 
-  Crc32 crc;
+  if (deferred_check != nullptr) {
+    *deferred_check = [scratch, proto_str,
+                       checksum = header.proto_checksum]() {
+      ChecksumT crc;
+      crc.Append(proto_str);
+      return StoreChecksumMatches(checksum, crc);
+    };
+    return Parse(proto_str, {});
+  }
+
+  ChecksumT crc;
   crc.Append(proto_str);
-  if (header.proto_checksum != crc.Get()) {
+  if (!StoreChecksumMatches(header.proto_checksum, crc)) {
     return absl::InternalError(
         absl::StrCat("Checksum of file does not match: ", filename_));
   }
 
-  auto proto = absl::make_unique<ProtoT>();
-  if (!proto->ParseFromArray(read.data(), proto_size)) {
-    return absl::InternalError(
-        absl::StrCat("Proto parse failed. File corrupted: ", filename_));
+  return Parse(proto_str, {});
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Write(
+    std::unique_ptr<ProtoT> new_proto) {
+  return WriteTicket(std::move(new_proto), next_write_ticket_.fetch_add(1));
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Write(
+    std::unique_ptr<ProtoT> new_proto, absl::Time deadline) {
+  static_assert(!std::is_same<LockT, NoLockPolicy>::value,
+                "Calls given a deadline run concurrently with others");
+  const uint64_t ticket = next_write_ticket_.fetch_add(1);
+  auto proto = std::make_shared<std::unique_ptr<ProtoT>>(std::move(new_proto));
+  return RunUntil<absl::Status>(
+      [this, proto, ticket]() {
+        return WriteTicket(std::move(*proto), ticket);
+      },
+      deadline);
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::WriteSerialized(
+    absl::Cord serialized, bool validate) {
+  if (serialized.size() >= options_.max_file_size) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("New proto too large. size: %lu; limit: %lu.",
+                        serialized.size(), options_.max_file_size));
+  }
+  std::shared_ptr<const ProtoT> parsed;
+  if (validate) {
+    std::vector<absl::string_view> ranges(serialized.chunk_begin(),
+                                          serialized.chunk_end());
+    if (DropColumns(&ranges)) {
+      parsed = ParsePartialRanges(std::move(ranges));
+    }
+    if (parsed == nullptr || !parsed->IsInitialized()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Serialized proto does not parse, not writing: ",
+                       filename_));
+    }
   }
 
-  cached_proto_ = std::move(proto);
-  return cached_proto_.get();
+  const uint64_t ticket = next_write_ticket_.fetch_add(1);
+  uint64_t version = 0;
+  {
+    internal::WriterLock<LockT> write_lock(&write_mutex_);
+    if (ticket < written_ticket_) {
+      return absl::OkStatus();
+    }
+    PDS_ASSIGN_OR_RETURN(const absl::Cord contents, EncodeFile(serialized));
+    PDS_RETURN_IF_ERROR(WriteFile(contents));
+    written_ticket_ = ticket;
+
+    internal::WriterLock<LockT> lock(&mutex_);
+    version = InstallWrittenLocked(parsed);
+    serialized_ = std::move(serialized);
+  }
+  if (parsed != nullptr) {
+    Notify(std::move(parsed), version);
+  }
+  return absl::OkStatus();
 }
 
-template <typename ProtoT>
-absl::Status ProtoDataStore<ProtoT>::Write(std::unique_ptr<ProtoT> new_proto) {
-  absl::WriterMutexLock lock(&mutex_);
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::WriteTicket(
+    std::unique_ptr<ProtoT> new_proto, uint64_t ticket) {
+  std::shared_ptr<const ProtoT> written;
+  uint64_t version;
+  {
+    internal::WriterLock<LockT> write_lock(&write_mutex_);
+    if (ticket < written_ticket_) {
+      // It would only undo the later write.
+      return absl::OkStatus();
+    }
+
+    if (options_.stream_serializer != nullptr &&
+        options_.column_encoder == nullptr) {
+      PDS_RETURN_IF_ERROR(WriteStreamed(*new_proto));
+    } else {
+      PDS_ASSIGN_OR_RETURN(const absl::Cord new_proto_str,
+                           SerializeForWrite(*new_proto));
+
+      std::shared_ptr<const ProtoT> cached;
+      {
+        internal::ReaderLock<LockT> lock(&mutex_);
+        // The default snapshot has no file yet to keep.
+        if (!cached_from_snapshot_) {
+          cached = cached_proto_;
+        }
+      }
+      if (cached != nullptr && Serialize(*cached) == new_proto_str) {
+        written_ticket_ = ticket;
+        return absl::OkStatus();
+      }
 
-  const std::string new_proto_str = new_proto->SerializeAsString();
-  if (new_proto_str.size() >= kMaxFileSize) {
+      PDS_ASSIGN_OR_RETURN(const absl::Cord contents,
+                           EncodeFile(new_proto_str));
+      PDS_RETURN_IF_ERROR(WriteFile(contents));
+    }
+    written_ticket_ = ticket;
+
+    written = std::move(new_proto);
+    internal::WriterLock<LockT> lock(&mutex_);
+    version = InstallWrittenLocked(written);
+  }
+  Notify(std::move(written), version);
+  return absl::OkStatus();
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+Executor* ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::StageExecutor(
+    Executor* executor) {
+  if (executor == nullptr || executor->RunsOnCurrentThread()) {
+    return InlineExecutor::Default();
+  }
+  return executor;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+template <typename ResultT>
+ResultT ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::RunUntil(
+    std::function<ResultT()> call, absl::Time deadline) const {
+  const absl::Status exceeded = absl::DeadlineExceededError(
+      absl::StrCat("Deadline exceeded, completing in the background: ",
+                   filename_));
+  if (absl::Now() >= deadline) {
+    return exceeded;
+  }
+  struct Call {
+    absl::Notification done;
+    ResultT result;
+  };
+  auto state = std::make_shared<Call>();
+  {
+    absl::MutexLock lock(&background_calls_->mutex);
+    background_calls_->pending++;
+  }
+  Executor* executor = options_.background_executor != nullptr
+                           ? options_.background_executor
+                           : DetachedThreadExecutor::Default();
+  executor->Schedule(
+      [call = std::move(call), state, calls = background_calls_]() {
+        state->result = call();
+        state->done.Notify();
+        absl::MutexLock lock(&calls->mutex);
+        calls->pending--;
+      });
+  if (!state->done.WaitForNotificationWithDeadline(deadline)) {
+    return exceeded;
+  }
+  return state->result;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::Cord>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::SerializeForWrite(
+    const ProtoT& proto) const {
+  absl::Cord proto_str = Serialize(proto);
+  if (proto_str.size() >= options_.max_file_size) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("New proto too large. size: %lu; limit: %lu.",
+                        proto_str.size(), options_.max_file_size));
+  }
+  return proto_str;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::Cord>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::EncodeFile(
+    const absl::Cord& proto_str) const {
+  absl::Cord payload = proto_str;
+  if (options_.column_encoder != nullptr) {
+    std::string flat_copy;
+    absl::string_view flat;
+    if (absl::optional<absl::string_view> chunk = proto_str.TryFlat()) {
+      flat = *chunk;
+    } else {
+      flat_copy = std::string(proto_str);
+      flat = flat_copy;
+    }
+    // A proto read back by ReadSerialized() comes with its old columns.
+    std::vector<absl::string_view> ranges = {flat};
+    std::string columns;
+    if (!DropColumns(&ranges) ||
+        !options_.column_encoder->Encode(
+            ranges.empty() ? absl::string_view() : ranges[0], &columns)) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Malformed proto, cannot extract its columns: ", filename_));
+    }
+    const size_t proto_size = ranges.empty() ? 0 : ranges[0].size();
+    std::string field_header;
+    internal::AppendVarint(
+        static_cast<uint64_t>(options_.columns_field_number) << 3 |
+            internal::kLengthDelimited,
+        &field_header);
+    internal::AppendVarint(columns.size(), &field_header);
+    payload = absl::Cord(std::move(field_header));
+    payload.Append(std::move(columns));
+    payload.Append(
+        proto_str.Subcord(proto_str.size() - proto_size, proto_size));
+  }
+  if (payload.size() >= options_.max_file_size) {
     return absl::InvalidArgumentError(
         absl::StrFormat("New proto too large. size: %lu; limit: %lu.",
-                        new_proto_str.size(), kMaxFileSize));
+                        payload.size(), options_.max_file_size));
   }
 
-  if (cached_proto_ != nullptr &&
-      cached_proto_->SerializeAsString() == new_proto_str) {
-    return absl::OkStatus();
+  ChecksumT crc;
+  for (absl::string_view chunk : payload.Chunks()) {
+    crc.Append(chunk);
   }
+  const Header header = MakeStoreHeader(crc);
+  absl::Cord contents(absl::string_view(
+      reinterpret_cast<const char*>(&header), sizeof(Header)));
+  contents.Append(payload);
+  return contents;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::WriteFile(
+    const absl::Cord& contents) const {
+  return ReplaceFile([&contents](OutputStream* output_stream) {
+    return output_stream->AppendCord(contents);
+  });
+}
 
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReplaceFile(
+    const std::function<absl::Status(OutputStream*)>& write) const {
+  const std::string tmp_filename = absl::StrCat(filename_, ".tmp");
   PDS_ASSIGN_OR_RETURN(std::unique_ptr<OutputStream> output_stream,
-                   file_storage_.OpenForWrite(filename_));
+                       file_storage_.OpenForWrite(tmp_filename));
+  absl::Status status = write(output_stream.get());
+  // Otherwise a crash could leave the rename durable but not the data.
+  if (status.ok()) {
+    status = output_stream->Sync();
+  }
+  if (status.ok()) {
+    status = output_stream->Close();
+  }
+  // Readers see either the old or the new file, never a partial one.
+  if (status.ok()) {
+    status = file_storage_.Rename(tmp_filename, filename_);
+  }
+  if (!status.ok()) {
+    output_stream.reset();
+    file_storage_.Delete(tmp_filename).IgnoreError();
+  }
+  return status;
+}
 
-  Crc32 crc;
-  crc.Append(new_proto_str);
-  const Header header{.magic = Header::kMagic, .proto_checksum = crc.Get()};
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::WriteStreamed(
+    const ProtoT& proto) const {
+  const size_t size = proto.ByteSizeLong();
+  if (size >= options_.max_file_size) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("New proto too large. size: %lu; limit: %lu.", size,
+                        options_.max_file_size));
+  }
+  return ReplaceFile([this, &proto](OutputStream* output_stream) {
+    // Reserve room for the header, written once the checksum is known.
+    Header header{};
+    const absl::string_view header_bytes(
+        reinterpret_cast<const char*>(&header), sizeof(Header));
+    PDS_RETURN_IF_ERROR(output_stream->Append(header_bytes));
+    ChecksumT crc;
+    // Reuses the sizes cached by ByteSizeLong() above.
+    PDS_RETURN_IF_ERROR(
+        options_.stream_serializer->Serialize(proto, output_stream, &crc));
+    header = MakeStoreHeader(crc);
+    return output_stream->WriteAt(0, header_bytes);
+  });
+}
 
-  // Write the header to output stream.
-  PDS_RETURN_IF_ERROR(output_stream->Append(absl::string_view(
-      reinterpret_cast<const char*>(&header), sizeof(Header))));
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+uint64_t
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::InstallWrittenLocked(
+    std::shared_ptr<const ProtoT> proto) const {
+  not_found_ = absl::OkStatus();
+  creation_watch_.reset();
+  verification_failed_.reset();
+  retired_proto_.reset();
+  // The old mapping no longer matches the file; remap on demand.
+  mapped_file_.reset();
+  serialized_.reset();
+  cached_from_snapshot_ = false;
+  ++installs_;
+  if (proto == nullptr) {
+    cached_proto_.reset();
+    has_cached_proto_.store(false, std::memory_order_release);
+    return 0;
+  }
+  return InstallLocked(std::move(proto));
+}
 
-  // Write the new proto to output stream.
-  PDS_RETURN_IF_ERROR(output_stream->Append(new_proto_str));
-  PDS_RETURN_IF_ERROR(output_stream->Close());
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Cord ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Serialize(
+    const ProtoT& proto) const {
+  if (options_.chunk_size == 0) {
+    const size_t size = proto.ByteSizeLong();
+    BufferPool::Buffer buffer = options_.buffer_pool->Acquire(size);
+    proto.SerializeWithCachedSizesToArray(
+        reinterpret_cast<uint8_t*>(buffer.data()));
+    return BufferPool::MakeCord(std::move(buffer), size);
+  }
+  internal::CordOutputStream output(options_.chunk_size, options_.buffer_pool);
+  proto.SerializeToZeroCopyStream(&output);
+  return output.Consume();
+}
 
-  cached_proto_ = std::move(new_proto);
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadChunks(
+    const InputStream& input_stream, uint64_t offset, uint64_t size,
+    absl::Cord* cord, ChecksumT* crc) const {
+  struct Chunk {
+    BufferPool::Buffer data;
+    absl::string_view read;
+    ChecksumT crc;
+    absl::Status status;
+  };
+  const uint64_t chunk_size = options_.chunk_size;
+  std::vector<Chunk> chunks((size + chunk_size - 1) / chunk_size);
+  Executor* executor = StageExecutor(options_.read_executor);
+  absl::BlockingCounter pending(chunks.size());
+  for (size_t i = 0; i < chunks.size(); i++) {
+    executor->Schedule([&, i]() {
+      Chunk& chunk = chunks[i];
+      const uint64_t chunk_offset = i * chunk_size;
+      const uint64_t length = std::min(chunk_size, size - chunk_offset);
+      chunk.data = options_.buffer_pool->Acquire(length);
+      chunk.status = input_stream.ReadAt(offset + chunk_offset, length,
+                                         &chunk.read, chunk.data.data());
+      if (chunk.status.ok() && crc != nullptr) {
+        chunk.crc.Append(chunk.read);
+      }
+      pending.DecrementCount();
+    });
+  }
+  pending.Wait();
+
+  for (Chunk& chunk : chunks) {
+    PDS_RETURN_IF_ERROR(chunk.status);
+    if (crc != nullptr) {
+      crc->Concat(chunk.crc, chunk.read.size());
+    }
+    cord->Append(
+        BufferPool::MakeCord(std::move(chunk.data), chunk.read.size()));
+  }
   return absl::OkStatus();
 }
 
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<std::unique_ptr<ProtoT>>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ParseRanges(
+    std::vector<absl::string_view> ranges) const {
+  std::unique_ptr<ProtoT> proto;
+  if (DropColumns(&ranges)) {
+    proto = ParsePartialRanges(std::move(ranges));
+  }
+  if (proto == nullptr || !proto->IsInitialized()) {
+    return absl::InternalError(
+        absl::StrCat("Proto parse failed. File corrupted: ", filename_));
+  }
+  return proto;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+std::unique_ptr<ProtoT>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ParsePartialRanges(
+    std::vector<absl::string_view> ranges) {
+  internal::RangesInputStream input(std::move(ranges));
+  google::protobuf::io::CodedInputStream coded_input(&input);
+  auto proto = absl::make_unique<ProtoT>();
+  if (!proto->ParsePartialFromCodedStream(&coded_input)) {
+    return nullptr;
+  }
+  return proto;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<std::unique_ptr<ProtoT>>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Parse(
+    absl::string_view data, absl::Span<const int> excluded_fields) const {
+  const absl::Status corrupted = absl::InternalError(
+      absl::StrCat("Proto parse failed. File corrupted: ", filename_));
+  const typename Options::ParallelParse& parallel = options_.parallel_parse;
+  if (options_.column_encoder != nullptr) {
+    std::vector<absl::string_view> ranges = {data};
+    if (!DropColumns(&ranges)) {
+      return corrupted;
+    }
+    data = ranges.empty() ? absl::string_view() : ranges[0];
+  }
+  if (parallel.field_number == 0) {
+    std::vector<absl::string_view> ranges = {data};
+    if (!excluded_fields.empty() &&
+        !internal::RangesExcludingFields(data, excluded_fields, &ranges)) {
+      return corrupted;
+    }
+    return ParseRanges(std::move(ranges));
+  }
+
+  std::vector<absl::string_view> rest;
+  std::vector<std::vector<absl::string_view>> parts;
+  if (!internal::SplitRepeatedField(data, parallel.field_number,
+                                    excluded_fields, parallel.part_size,
+                                    &rest, &parts)) {
+    return corrupted;
+  }
+
+  // Parse the parts on the executor and everything else on this thread.
+  Executor* executor = StageExecutor(parallel.executor);
+  std::vector<std::unique_ptr<ProtoT>> parsed_parts(parts.size());
+  absl::BlockingCounter pending(parts.size());
+  for (size_t i = 0; i < parts.size(); i++) {
+    executor->Schedule([&, i]() {
+      parsed_parts[i] = ParsePartialRanges(std::move(parts[i]));
+      pending.DecrementCount();
+    });
+  }
+  std::unique_ptr<ProtoT> proto = ParsePartialRanges(std::move(rest));
+  pending.Wait();
+
+  if (proto == nullptr) {
+    return corrupted;
+  }
+  for (std::unique_ptr<ProtoT>& part : parsed_parts) {
+    if (part == nullptr) {
+      return corrupted;
+    }
+    parallel.move_elements(part.get(), proto.get());
+  }
+  if (!proto->IsInitialized()) {
+    return corrupted;
+  }
+  return proto;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+void ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::CacheNotFoundLocked(
+    absl::Status status) const {
+  switch (options_.not_found_caching) {
+    case NotFoundCaching::kNone:
+      return;
+    case NotFoundCaching::kUntilWrite:
+      not_found_ = std::move(status);
+      return;
+    case NotFoundCaching::kWatch: {
+      absl::StatusOr<std::unique_ptr<CreationWatch>> watch =
+          file_storage_.WatchForCreation(filename_);
+      if (!watch.ok()) {
+        return;
+      }
+      // The file may have been created before the watch was set up.
+      if (!absl::IsNotFound(file_storage_.GetFileSize(filename_).status())) {
+        return;
+      }
+      not_found_ = std::move(status);
+      creation_watch_ = std::move(*watch);
+      return;
+    }
+  }
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<std::unique_ptr<ProtoT>>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadThroughCache() const {
+  std::shared_ptr<const MappedFile> contents;
+  bool replaced;
+  do {
+    PDS_ASSIGN_OR_RETURN(const FileId id, file_storage_.GetFileId(filename_));
+    if (id.size > options_.max_file_size) {
+      return absl::InternalError(absl::StrCat(
+          "File larger than expected, couldn't read: ", filename_));
+    }
+    replaced = false;
+    absl::StatusOr<std::shared_ptr<const MappedFile>> looked_up =
+        options_.contents_cache->LookupOrLoad(
+            id,
+            [this, &id, &replaced]()
+                -> absl::StatusOr<std::shared_ptr<const MappedFile>> {
+              PDS_ASSIGN_OR_RETURN(
+                  std::shared_ptr<const MappedFile> mapped_file,
+                  file_storage_.MapForRead(filename_));
+              // Only contents of the file `id` may be published as such.
+              if (mapped_file->id() != id) {
+                replaced = true;
+                return absl::AbortedError(
+                    absl::StrCat("File replaced while loading: ", filename_));
+              }
+              PDS_RETURN_IF_ERROR(ValidateStoreContents<ChecksumT>(
+                                      filename_, mapped_file->data())
+                                      .status());
+              return mapped_file;
+            });
+    if (!replaced) {
+      PDS_ASSIGN_OR_RETURN(contents, std::move(looked_up));
+    }
+    // Otherwise a write renamed a new file into place; look that one up.
+  } while (replaced);
+  const absl::string_view proto_str = contents->data().substr(sizeof(Header));
+  if (options_.read_mode == ReadMode::kMapped) {
+    mapped_file_ = std::move(contents);
+    mapped_file_verified_ = true;
+    return Parse(proto_str, options_.mapped_only_fields);
+  }
+  return Parse(proto_str, {});
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<std::unique_ptr<ProtoT>>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadSnapshot(
+    std::function<bool()>* deferred_check) const {
+  const absl::string_view snapshot = options_.default_snapshot;
+  const std::string name = absl::StrCat("default snapshot of ", filename_);
+  absl::string_view proto_str;
+  if (deferred_check == nullptr) {
+    PDS_ASSIGN_OR_RETURN(proto_str,
+                         ValidateStoreContents<ChecksumT>(name, snapshot));
+  } else {
+    Header header;
+    PDS_ASSIGN_OR_RETURN(proto_str,
+                         ParseStoreHeader<ChecksumT>(name, snapshot, &header));
+    *deferred_check = [proto_str, checksum = header.proto_checksum]() {
+      ChecksumT crc;
+      crc.Append(proto_str);
+      return StoreChecksumMatches(checksum, crc);
+    };
+  }
+  return Parse(proto_str, {});
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::string_view>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::MapLocked(
+    std::function<bool()>* deferred_check) const {
+  std::shared_ptr<const MappedFile> mapped_file;
+  PDS_ASSIGN_OR_RETURN(const absl::string_view proto_str,
+                       MapFile(&mapped_file, deferred_check));
+  mapped_file_ = std::move(mapped_file);
+  mapped_file_verified_ = deferred_check == nullptr;
+  return proto_str;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::string_view>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::MapFile(
+    std::shared_ptr<const MappedFile>* mapped_file,
+    std::function<bool()>* deferred_check) const {
+  PDS_ASSIGN_OR_RETURN(*mapped_file, file_storage_.MapForRead(filename_));
+  const absl::string_view contents = (*mapped_file)->data();
+  if (contents.size() > options_.max_file_size) {
+    return absl::InternalError(absl::StrCat(
+        "File larger than expected, couldn't read: ", filename_));
+  }
+  if (deferred_check == nullptr) {
+    return ValidateStoreContents<ChecksumT>(filename_, contents);
+  }
+  Header header;
+  PDS_ASSIGN_OR_RETURN(
+      const absl::string_view proto_str,
+      ParseStoreHeader<ChecksumT>(filename_, contents, &header));
+  *deferred_check = [mapped_file = *mapped_file, proto_str,
+                     checksum = header.proto_checksum]() {
+    ChecksumT crc;
+    crc.Append(proto_str);
+    return StoreChecksumMatches(checksum, crc);
+  };
+  return proto_str;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::string_view>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::VerifiedMapping(
+    std::shared_ptr<const MappedFile>* mapped_file) const {
+  uint64_t installs;
+  {
+    internal::ReaderLock<LockT> lock(&mutex_);
+    // The bytes are handed out as is, so a deferred check still pending or
+    // a failed one does not do.
+    if (mapped_file_ != nullptr && mapped_file_verified_ &&
+        !FailedVerificationLocked()) {
+      *mapped_file = mapped_file_;
+      return mapped_file_->data().substr(sizeof(Header));
+    }
+    installs = installs_;
+  }
+  // Cached reads take `mutex_`, so the IO happens without it.
+  PDS_ASSIGN_OR_RETURN(const absl::string_view proto_str,
+                       MapFile(mapped_file, nullptr));
+  internal::WriterLock<LockT> lock(&mutex_);
+  // Unless a new version was installed meanwhile, which it may not match.
+  if (installs_ == installs) {
+    mapped_file_ = *mapped_file;
+    mapped_file_verified_ = true;
+  }
+  return proto_str;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::Cord>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadBytesField(
+    absl::Span<const int> field_path) const {
+  if (options_.read_mode != ReadMode::kMapped) {
+    return absl::FailedPreconditionError(
+        "ReadBytesField() requires ReadMode::kMapped");
+  }
+  PDS_RETURN_IF_ERROR(Read().status());
+
+  std::shared_ptr<const MappedFile> mapped_file;
+  PDS_ASSIGN_OR_RETURN(const absl::string_view proto_str,
+                       VerifiedMapping(&mapped_file));
+
+  absl::string_view value;
+  if (!internal::FindLengthDelimitedField(proto_str, field_path, &value)) {
+    return absl::NotFoundError(
+        absl::StrCat("Field not found in: ", filename_));
+  }
+  // The Cord keeps the mapping alive for as long as it references it.
+  return absl::MakeCordFromExternal(
+      value, [mapped_file](absl::string_view) {});
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::Cord>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadEncodedColumns()
+    const {
+  std::shared_ptr<const MappedFile> mapped_file;
+  PDS_ASSIGN_OR_RETURN(const absl::string_view proto_str,
+                       VerifiedMapping(&mapped_file));
+
+  // The columns are the first field, if they were written at all.
+  internal::WireFieldScanner scanner(proto_str);
+  internal::WireField field;
+  if (!scanner.Next(&field) ||
+      field.number != options_.columns_field_number ||
+      field.wire_type != internal::kLengthDelimited) {
+    return absl::NotFoundError(
+        absl::StrCat("No columns stored in: ", filename_));
+  }
+  // The Cord keeps the mapping alive for as long as it references it.
+  return absl::MakeCordFromExternal(
+      field.value, [mapped_file](absl::string_view) {});
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::Cord>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadSerialized() const {
+  uint64_t installs;
+  {
+    internal::ReaderLock<LockT> lock(&mutex_);
+    if (serialized_.has_value()) {
+      return *serialized_;
+    }
+    installs = installs_;
+  }
+  // Verifies the checksum, whatever the verification of loads.
+  std::shared_ptr<const MappedFile> mapped_file;
+  PDS_ASSIGN_OR_RETURN(const absl::string_view proto_str,
+                       VerifiedMapping(&mapped_file));
+  absl::Cord serialized = absl::MakeCordFromExternal(
+      proto_str, [mapped_file](absl::string_view) {});
+  internal::WriterLock<LockT> lock(&mutex_);
+  if (installs_ == installs) {
+    serialized_ = serialized;
+  }
+  return serialized;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<uint64_t>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ExportTo(int fd) const {
+  std::unique_ptr<InputStream> input_stream;
+  uint64_t size;
+  {
+    // Keeps writes from replacing the file between the check and opening
+    // it.
+    internal::ReaderLock<LockT> write_lock(&write_mutex_);
+    PDS_ASSIGN_OR_RETURN(const FileId file_id,
+                         file_storage_.GetFileId(filename_));
+    bool verified;
+    {
+      internal::ReaderLock<LockT> lock(&mutex_);
+      verified = exported_file_id_ == file_id;
+    }
+    if (!verified) {
+      if (file_id.size > options_.max_file_size) {
+        return absl::InternalError(absl::StrCat(
+            "File larger than expected, couldn't read: ", filename_));
+      }
+      PDS_ASSIGN_OR_RETURN(std::unique_ptr<MappedFile> mapped_file,
+                           file_storage_.MapForRead(filename_));
+      PDS_RETURN_IF_ERROR(ValidateStoreContents<ChecksumT>(
+                              filename_, mapped_file->data())
+                              .status());
+      internal::WriterLock<LockT> lock(&mutex_);
+      exported_file_id_ = file_id;
+    }
+    PDS_ASSIGN_OR_RETURN(input_stream, file_storage_.OpenForRead(filename_));
+    size = file_id.size - sizeof(Header);
+  }
+  // Writes replace the file rather than modify it, so the open descriptor
+  // still refers to the verified version while the lock is released.
+  PDS_RETURN_IF_ERROR(input_stream->SendTo(sizeof(Header), size, fd));
+  return size;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ImportFrom(
+    int fd, uint64_t size) {
+  if (size >= options_.max_file_size) {
+    return absl::InvalidArgumentError(
+        absl::StrFormat("New proto too large. size: %lu; limit: %lu.", size,
+                        options_.max_file_size));
+  }
+  const uint64_t ticket = next_write_ticket_.fetch_add(1);
+  // Concurrent imports receive into files of their own.
+  const std::string tmp_filename =
+      absl::StrCat(filename_, ".import.", ticket);
+  absl::StatusOr<absl::Cord> serialized =
+      ReceiveFile(fd, size, tmp_filename);
+  if (!serialized.ok()) {
+    file_storage_.Delete(tmp_filename).IgnoreError();
+    return serialized.status();
+  }
+
+  internal::WriterLock<LockT> write_lock(&write_mutex_);
+  if (ticket < written_ticket_) {
+    return file_storage_.Delete(tmp_filename);
+  }
+  absl::Status status = file_storage_.Rename(tmp_filename, filename_);
+  if (!status.ok()) {
+    file_storage_.Delete(tmp_filename).IgnoreError();
+    return status;
+  }
+  written_ticket_ = ticket;
+
+  internal::WriterLock<LockT> lock(&mutex_);
+  InstallWrittenLocked(nullptr);
+  serialized_ = std::move(*serialized);
+  return absl::OkStatus();
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<absl::Cord>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReceiveFile(
+    int fd, uint64_t size, const std::string& tmp_filename) const {
+  PDS_RETURN_IF_ERROR(
+      file_storage_.ReceiveFile(fd, tmp_filename, sizeof(Header), size));
+  PDS_ASSIGN_OR_RETURN(std::shared_ptr<const MappedFile> mapped_file,
+                       file_storage_.MapForRead(tmp_filename));
+  if (mapped_file->data().size() != sizeof(Header) + size) {
+    return absl::InternalError(
+        absl::StrCat("Received file has the wrong size: ", tmp_filename));
+  }
+  const absl::string_view proto_str =
+      mapped_file->data().substr(sizeof(Header));
+  ChecksumT crc;
+  crc.Append(proto_str);
+  const Header header = MakeStoreHeader(crc);
+  PDS_RETURN_IF_ERROR(file_storage_.WriteAt(
+      tmp_filename, 0,
+      absl::string_view(reinterpret_cast<const char*>(&header),
+                        sizeof(Header))));
+  return absl::MakeCordFromExternal(
+      proto_str, [mapped_file](absl::string_view) {});
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+uint64_t ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Subscribe(
+    Listener listener, Executor* executor) {
+  internal::WriterLock<LockT> lock(&listeners_mutex_);
+  const uint64_t id = next_subscription_id_++;
+  subscriptions_.push_back(
+      std::make_shared<Subscription>(id, std::move(listener), executor));
+  return id;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+void ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Unsubscribe(
+    uint64_t id) {
+  std::shared_ptr<Subscription> subscription;
+  {
+    internal::WriterLock<LockT> lock(&listeners_mutex_);
+    for (auto it = subscriptions_.begin(); it != subscriptions_.end(); ++it) {
+      if ((*it)->id() == id) {
+        subscription = std::move(*it);
+        subscriptions_.erase(it);
+        break;
+      }
+    }
+  }
+  // Deliveries may call back into the store, so wait without the lock.
+  if (subscription != nullptr) {
+    subscription->Cancel();
+  }
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+void ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Subscription::Deliver(
+    std::shared_ptr<const ProtoT> proto, uint64_t version) {
+  {
+    absl::MutexLock lock(&mutex_);
+    if (cancelled_) {
+      return;
+    }
+    delivering_.push_back(std::this_thread::get_id());
+  }
+  listener_(std::move(proto), version);
+  absl::MutexLock lock(&mutex_);
+  delivering_.erase(std::find(delivering_.begin(), delivering_.end(),
+                              std::this_thread::get_id()));
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+void ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Subscription::
+    Cancel() {
+  absl::MutexLock lock(&mutex_);
+  cancelled_ = true;
+  delivering_on_canceller_ = std::count(
+      delivering_.begin(), delivering_.end(), std::this_thread::get_id());
+  mutex_.Await(absl::Condition(this, &Subscription::DoneElsewhere));
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<std::shared_ptr<const ProtoT>>
+ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadShared(
+    uint64_t* version) const {
+  // A write may drop the proto loaded by Read() before it is taken here;
+  // load the new version then.
+  while (true) {
+    PDS_RETURN_IF_ERROR(Read().status());
+    internal::ReaderLock<LockT> lock(&mutex_);
+    if (cached_proto_ != nullptr && !FailedVerificationLocked()) {
+      if (version != nullptr) {
+        *version = version_;
+      }
+      return cached_proto_;
+    }
+  }
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+uint64_t ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::InstallLocked(
+    std::shared_ptr<const ProtoT> proto) const {
+  cached_proto_ = std::move(proto);
+  has_cached_proto_.store(cached_proto_ != nullptr,
+                          std::memory_order_release);
+  ++installs_;
+  return ++version_;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+void ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Notify(
+    std::shared_ptr<const ProtoT> proto, uint64_t version) const {
+  std::vector<std::shared_ptr<Subscription>> subscriptions;
+  {
+    internal::ReaderLock<LockT> lock(&listeners_mutex_);
+    subscriptions = subscriptions_;
+  }
+  for (std::shared_ptr<Subscription>& subscription : subscriptions) {
+    Executor* executor = subscription->executor();
+    executor->Schedule(
+        [subscription = std::move(subscription), proto, version]() {
+          subscription->Deliver(proto, version);
+        });
+  }
+}
+
 }  // namespace protostore
 
 #endif  // PDS_PROTO_DATA_STORE_H_
@@ -14,26 +14,59 @@
 
 #include "protostore/proto-data-store.h"
 
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
 #include "google/protobuf/message.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "protostore/allocation-counter.h"
+#include "protostore/buffer-pool.h"
+#include "protostore/columnar.h"
+#include "protostore/crc32c.h"
+#include "protostore/executor.h"
+#include "protostore/fd-cache.h"
 #include "protostore/file-storage.h"
+#include "protostore/pipelined-output-stream.h"
+#include "protostore/proto-index.h"
+#include "protostore/shared-memory-cache.h"
+#include "protostore/store-format.h"
+#include "protostore/store-policies.h"
 #include "protostore/testing-matchers.h"
 #include "protostore/testfile-fixture.h"
+#include "protostore/thread-pool.h"
 #include "protostore/test.pb.h"
 
 namespace protostore {
 namespace {
 
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::IsEmpty;
+using ::testing::IsNull;
+using ::testing::IsTrue;
+using ::testing::Le;
 using ::testing::Not;
+using ::testing::NotNull;
 using ::testing::Pointee;
 
 using testing::IsOk;
 using testing::IsOkAndHolds;
 using testing::EqualsProto;
+using testing::StatusIs;
 
 class ProtoDataStoreTest : public testing::TestFileFixture {};
 
@@ -97,6 +130,21 @@ TEST_F(ProtoDataStoreTest, InvalidtestfileTest) {
               Not(IsOk()));
 }
 
+TEST_F(ProtoDataStoreTest, FailedWriteDeletesTemporaryFile) {
+  FileStorage storage;
+  // A file cannot be renamed over a directory.
+  std::string testfile = TestFile("FailedWriteDeletesTemporaryFile");
+  ASSERT_EQ(mkdir(testfile.c_str(), 0700), 0);
+  TestProto testproto;
+  testproto.set_string_value("FailedWriteDeletesTemporaryFile");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  EXPECT_THAT(pds.Write(absl::make_unique<TestProto>(testproto)),
+              Not(IsOk()));
+  EXPECT_THAT(storage.GetFileSize(testfile + ".tmp"),
+              StatusIs(absl::StatusCode::kNotFound));
+  ASSERT_EQ(rmdir(testfile.c_str()), 0);
+}
+
 TEST_F(ProtoDataStoreTest, FileCorruptionTest) {
   FileStorage storage;
   std::string testfile = TestFile("FileCorruptionTest");
@@ -117,5 +165,1324 @@ TEST_F(ProtoDataStoreTest, FileCorruptionTest) {
   }
 }
 
+// Queues closures until the test runs them.
+class ManualExecutor : public Executor {
+ public:
+  void Schedule(std::function<void()> closure) override {
+    closures_.push_back(std::move(closure));
+  }
+
+  void RunAll() {
+    std::vector<std::function<void()>> closures;
+    closures.swap(closures_);
+    for (auto& closure : closures) closure();
+  }
+
+ private:
+  std::vector<std::function<void()>> closures_;
+};
+
+TEST_F(ProtoDataStoreTest, SubscribersSeeEachNewVersion) {
+  FileStorage storage;
+  std::string testfile = TestFile("SubscribersSeeEachNewVersion");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+
+  std::vector<uint64_t> versions;
+  std::vector<int> values;
+  pds.Subscribe([&](std::shared_ptr<const TestProto> proto, uint64_t version) {
+    versions.push_back(version);
+    values.push_back(proto->int_value());
+  });
+
+  TestProto testproto;
+  testproto.set_int_value(1);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  // An identical write does not notify.
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  testproto.set_int_value(2);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  // Cached reads do not notify.
+  ASSERT_OK(pds.Read());
+
+  EXPECT_THAT(versions, ElementsAre(1, 2));
+  EXPECT_THAT(values, ElementsAre(1, 2));
+}
+
+TEST_F(ProtoDataStoreTest, SubscribersSeeLoadFromDisk) {
+  FileStorage storage;
+  std::string testfile = TestFile("SubscribersSeeLoadFromDisk");
+  TestProto testproto;
+  testproto.set_string_value("SubscribersSeeLoadFromDisk");
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  std::vector<std::shared_ptr<const TestProto>> protos;
+  pds.Subscribe([&](std::shared_ptr<const TestProto> proto, uint64_t) {
+    protos.push_back(proto);
+  });
+  ASSERT_OK(pds.Read());
+  ASSERT_THAT(protos.size(), Eq(1));
+  EXPECT_THAT(*protos[0], EqualsProto(testproto));
+}
+
+TEST_F(ProtoDataStoreTest, SubscribersRunOnExecutorAndCanUnsubscribe) {
+  FileStorage storage;
+  std::string testfile = TestFile("SubscribersRunOnExecutorAndCanUnsubscribe");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  ManualExecutor executor;
+
+  std::vector<uint64_t> versions;
+  uint64_t id = pds.Subscribe(
+      [&](std::shared_ptr<const TestProto> proto, uint64_t version) {
+        // Listeners may call back into the store.
+        EXPECT_THAT(pds.Read(), IsOk());
+        versions.push_back(version);
+      },
+      &executor);
+
+  TestProto testproto;
+  testproto.set_int_value(1);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(versions, IsEmpty());
+  executor.RunAll();
+  EXPECT_THAT(versions, ElementsAre(1));
+
+  // Deliveries already handed to the executor are dropped too.
+  testproto.set_int_value(2);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  pds.Unsubscribe(id);
+  testproto.set_int_value(3);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  executor.RunAll();
+  EXPECT_THAT(versions, ElementsAre(1));
+}
+
+TEST_F(ProtoDataStoreTest, UnsubscribeWaitsForDeliveries) {
+  FileStorage storage;
+  std::string testfile = TestFile("UnsubscribeWaitsForDeliveries");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  absl::Notification delivering;
+  absl::Notification release;
+  std::atomic<bool> delivered{false};
+  uint64_t id = pds.Subscribe([&](std::shared_ptr<const TestProto>, uint64_t) {
+    delivering.Notify();
+    release.WaitForNotification();
+    delivered.store(true);
+  });
+
+  std::thread writer([&]() {
+    TestProto testproto;
+    testproto.set_int_value(1);
+    EXPECT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  });
+  delivering.WaitForNotification();
+  std::atomic<bool> unsubscribed{false};
+  std::thread unsubscriber([&]() {
+    pds.Unsubscribe(id);
+    // The listener has returned.
+    EXPECT_TRUE(delivered.load());
+    unsubscribed.store(true);
+  });
+  absl::SleepFor(absl::Milliseconds(50));
+  EXPECT_FALSE(unsubscribed.load());
+  release.Notify();
+  unsubscriber.join();
+  writer.join();
+  EXPECT_TRUE(unsubscribed.load());
+}
+
+TEST_F(ProtoDataStoreTest, ListenersCanUnsubscribeThemselves) {
+  FileStorage storage;
+  std::string testfile = TestFile("ListenersCanUnsubscribeThemselves");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  int deliveries = 0;
+  uint64_t id = 0;
+  id = pds.Subscribe([&](std::shared_ptr<const TestProto>, uint64_t) {
+    ++deliveries;
+    pds.Unsubscribe(id);
+  });
+
+  TestProto testproto;
+  for (int i = 1; i <= 2; i++) {
+    testproto.set_int_value(i);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+  EXPECT_THAT(deliveries, Eq(1));
+}
+
+using EntryIndex = HashIndex<absl::string_view, TestProto::Entry>;
+
+std::unique_ptr<EntryIndex> BuildEntryIndex(const TestProto& proto) {
+  return absl::make_unique<EntryIndex>(
+      proto.entries(),
+      [](const TestProto::Entry& entry) -> absl::string_view {
+        return entry.key();
+      });
+}
+
+TEST_F(ProtoDataStoreTest, IndexIsRebuiltOnlyForNewVersions) {
+  FileStorage storage;
+  std::string testfile = TestFile("IndexIsRebuiltOnlyForNewVersions");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  int builds = 0;
+  ProtoIndex<TestProto, EntryIndex> entry_index(
+      &pds, [&](const TestProto& proto) {
+        ++builds;
+        return BuildEntryIndex(proto);
+      });
+
+  // Nothing to index yet.
+  EXPECT_THAT(entry_index.Get(), Not(IsOk()));
+
+  TestProto testproto;
+  for (int i = 0; i < 100; i++) {
+    TestProto::Entry* entry = testproto.add_entries();
+    entry->set_key(absl::StrCat("key", i));
+    entry->set_value(i);
+  }
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+
+  auto index = entry_index.Get();
+  ASSERT_THAT(index, IsOk());
+  EXPECT_THAT((*index)->size(), Eq(100));
+  ASSERT_THAT((*index)->Find("key42"), NotNull());
+  EXPECT_THAT((*index)->Find("key42")->value(), Eq(42));
+  EXPECT_THAT((*index)->Find("missing"), IsNull());
+  ASSERT_OK(entry_index.Get());
+  EXPECT_THAT(builds, Eq(1));
+
+  testproto.mutable_entries(42)->set_value(-1);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  auto new_index = entry_index.Get();
+  ASSERT_THAT(new_index, IsOk());
+  EXPECT_THAT((*new_index)->Find("key42")->value(), Eq(-1));
+  EXPECT_THAT(builds, Eq(2));
+
+  // The old index still refers to the version it was built from.
+  EXPECT_THAT((*index)->Find("key42")->value(), Eq(42));
+}
+
+TEST_F(ProtoDataStoreTest, IndexIsRebuiltEagerlyOnExecutor) {
+  FileStorage storage;
+  std::string testfile = TestFile("IndexIsRebuiltEagerlyOnExecutor");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  ManualExecutor executor;
+  int builds = 0;
+  ProtoIndex<TestProto, EntryIndex> entry_index(
+      &pds,
+      [&](const TestProto& proto) {
+        ++builds;
+        return BuildEntryIndex(proto);
+      },
+      &executor);
+
+  TestProto testproto;
+  testproto.add_entries()->set_key("key");
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(builds, Eq(0));
+  executor.RunAll();
+  EXPECT_THAT(builds, Eq(1));
+
+  auto index = entry_index.Get();
+  ASSERT_THAT(index, IsOk());
+  EXPECT_THAT((*index)->Find("key"), NotNull());
+  EXPECT_THAT(builds, Eq(1));
+}
+
+TEST_F(ProtoDataStoreTest, IndexSurvivesUnvalidatedWrites) {
+  FileStorage storage;
+  std::string testfile = TestFile("IndexSurvivesUnvalidatedWrites");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  ProtoIndex<TestProto, EntryIndex> entry_index(&pds, BuildEntryIndex);
+
+  TestProto testproto;
+  testproto.add_entries()->set_key("key");
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  ASSERT_OK(entry_index.Get());
+
+  // Unvalidated writes drop the cached proto without parsing a new one.
+  testproto.mutable_entries(0)->set_value(1);
+  ASSERT_OK(pds.WriteSerialized(absl::Cord(testproto.SerializeAsString()),
+                                /*validate=*/false));
+  auto index = entry_index.Get();
+  ASSERT_THAT(index, IsOk());
+  ASSERT_THAT((*index)->Find("key"), NotNull());
+  EXPECT_THAT((*index)->Find("key")->value(), Eq(1));
+
+  // Also when they drop it between Get() loading and indexing it.
+  std::atomic<bool> done{false};
+  std::thread writer([&]() {
+    for (int i = 2; !done.load(); i++) {
+      testproto.mutable_entries(0)->set_value(i);
+      EXPECT_OK(pds.WriteSerialized(
+          absl::Cord(testproto.SerializeAsString()), /*validate=*/false));
+    }
+  });
+  for (int i = 0; i < 1000; i++) {
+    auto index = entry_index.Get();
+    EXPECT_THAT(index, IsOk());
+    if (!index.ok()) break;
+    EXPECT_THAT((*index)->Find("key"), NotNull());
+  }
+  done.store(true);
+  writer.join();
+}
+
+TEST_F(ProtoDataStoreTest, MappedReadServesBytesFieldsWithoutCopies) {
+  FileStorage storage;
+  std::string testfile = TestFile("MappedReadServesBytesFieldsWithoutCopies");
+  TestProto testproto;
+  testproto.set_string_value("MappedReadServesBytesFieldsWithoutCopies");
+  testproto.set_blob(std::string(100000, 'b'));
+  testproto.mutable_entry()->set_key("nested");
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    EXPECT_THAT(pds.ReadBytesField({4}),
+                StatusIs(absl::StatusCode::kFailedPrecondition));
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  ProtoDataStore<TestProto>::Options options;
+  options.read_mode = ProtoDataStore<TestProto>::ReadMode::kMapped;
+  options.mapped_only_fields = {4};
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+
+  TestProto without_blob = testproto;
+  without_blob.clear_blob();
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(without_blob))));
+
+  auto blob = pds.ReadBytesField({4});
+  ASSERT_THAT(blob, IsOk());
+  EXPECT_THAT(std::string(*blob), Eq(testproto.blob()));
+  EXPECT_THAT(pds.ReadBytesField({5, 1}), IsOkAndHolds(Eq("nested")));
+  EXPECT_THAT(pds.ReadBytesField({6}), StatusIs(absl::StatusCode::kNotFound));
+
+  // Fields are served from the new file after a write, while Cords handed
+  // out earlier keep the old mapping alive.
+  testproto.set_blob("new blob");
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(pds.ReadBytesField({4}), IsOkAndHolds(Eq("new blob")));
+  EXPECT_THAT(std::string(*blob), Eq(std::string(100000, 'b')));
+}
+
+TEST_F(ProtoDataStoreTest, MaxFileSizeIsConfigurable) {
+  FileStorage storage;
+  std::string testfile = TestFile("MaxFileSizeIsConfigurable");
+  TestProto testproto;
+  testproto.set_blob(std::string(2 * 1024 * 1024, 'b'));
+
+  ProtoDataStore<TestProto> small(storage, testfile);
+  EXPECT_THAT(small.Write(absl::make_unique<TestProto>(testproto)),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  ProtoDataStore<TestProto>::Options options;
+  options.max_file_size = 4 * 1024 * 1024;
+  {
+    ProtoDataStore<TestProto> large(storage, testfile, options);
+    ASSERT_OK(large.Write(absl::make_unique<TestProto>(testproto)));
+  }
+  ProtoDataStore<TestProto> large(storage, testfile, options);
+  EXPECT_THAT(large.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, ChunkedReadWrite) {
+  FileStorage storage;
+  std::string testfile = TestFile("ChunkedReadWrite");
+  TestProto testproto;
+  testproto.set_blob(std::string(300000, 'b'));
+  for (int i = 0; i < 1000; i++) {
+    testproto.add_entries()->set_key(absl::StrCat("key", i));
+  }
+
+  ProtoDataStore<TestProto>::Options options;
+  options.chunk_size = 4096;
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile, options);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+    // Identical writes are still detected.
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+  {
+    // The file format does not change.
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, ParallelChunkedRead) {
+  FileStorage storage;
+  std::string testfile = TestFile("ParallelChunkedRead");
+  TestProto testproto;
+  for (int i = 0; i < 10000; i++) {
+    testproto.add_entries()->set_key(absl::StrCat("key", i));
+  }
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  ThreadPool pool(4);
+  ProtoDataStore<TestProto>::Options options;
+  options.chunk_size = 1000;
+  options.read_executor = &pool;
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, PipelinedWrite) {
+  FileStorage storage;
+  std::string testfile = TestFile("PipelinedWrite");
+  TestProto testproto;
+  testproto.set_blob(std::string(300000, 'b'));
+  for (int i = 0; i < 10000; i++) {
+    testproto.add_entries()->set_key(absl::StrCat("key", i));
+  }
+
+  ThreadPool pool(4);
+  PipelinedSerializer<Crc32> serializer(4096, &pool);
+  ProtoDataStore<TestProto>::Options options;
+  options.stream_serializer = &serializer;
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile, options);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+
+    TestProto too_large;
+    too_large.set_blob(std::string(options.max_file_size, 'x'));
+    EXPECT_THAT(pds.Write(absl::make_unique<TestProto>(too_large)),
+                StatusIs(absl::StatusCode::kInvalidArgument));
+  }
+  // The file format, header included, does not change.
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, StagesShareTheBackgroundExecutor) {
+  FileStorage storage;
+  std::string testfile = TestFile("StagesShareTheBackgroundExecutor");
+  TestProto testproto;
+  testproto.set_blob(std::string(100000, 'b'));
+
+  // Deadlocks unless the stages waited for on the one thread run inline.
+  ThreadPool pool(1);
+  PipelinedSerializer<Crc32> serializer(4096, &pool);
+  ProtoDataStore<TestProto>::Options options;
+  options.chunk_size = 4096;
+  options.read_executor = &pool;
+  options.stream_serializer = &serializer;
+  options.background_executor = &pool;
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile, options);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto),
+                        absl::InfiniteFuture()));
+  }
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  EXPECT_THAT(pds.Read(absl::InfiniteFuture()),
+              IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, SharesCachedDescriptors) {
+  FdCache cache;
+  FileStorage storage(&cache);
+  std::string testfile = TestFile("SharesCachedDescriptors");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+
+  ProtoDataStore<TestProto> writer(storage, testfile);
+  ASSERT_OK(writer.Write(absl::make_unique<TestProto>(testproto)));
+  // Stores on the same storage read through the descriptor of the write.
+  for (auto read_mode : {ProtoDataStore<TestProto>::ReadMode::kCopy,
+                         ProtoDataStore<TestProto>::ReadMode::kMapped}) {
+    ProtoDataStore<TestProto>::Options options;
+    options.read_mode = read_mode;
+    ProtoDataStore<TestProto> reader(storage, testfile, options);
+    EXPECT_THAT(reader.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+  EXPECT_THAT(cache.stats().hits, Eq(2));
+  EXPECT_THAT(cache.stats().misses, Eq(0));
+}
+
+TEST_F(ProtoDataStoreTest, ColumnarFields) {
+  FileStorage storage;
+  std::string testfile = TestFile("ColumnarFields");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  for (int i = 0; i < 1000; i++) {
+    TestProto::Entry* entry = testproto.add_entries();
+    entry->set_key(absl::StrCat("key", i));
+    entry->set_value(i * 10);
+  }
+  int64_t expected_sum = 0;
+  for (const TestProto::Entry& entry : testproto.entries()) {
+    expected_sum += entry.value();
+  }
+
+  using Store = ProtoDataStore<TestProto>;
+  const ColumnarFieldEncoder encoder({ColumnarField{3, {2}}});
+  for (size_t chunk_size : {0, 4096}) {
+    for (auto read_mode : {Store::ReadMode::kCopy, Store::ReadMode::kMapped}) {
+      Store::Options options;
+      options.column_encoder = &encoder;
+      options.chunk_size = chunk_size;
+      options.read_mode = read_mode;
+      {
+        Store pds(storage, testfile, options);
+        ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+        // Written back as read, the columns are not duplicated.
+        absl::StatusOr<absl::Cord> serialized = pds.ReadSerialized();
+        ASSERT_THAT(serialized, IsOk());
+        ASSERT_OK(pds.WriteSerialized(*serialized, /*validate=*/true));
+      }
+      Store pds(storage, testfile, options);
+      absl::StatusOr<Columns> columns = ReadColumns(pds, 3);
+      ASSERT_THAT(columns, IsOk());
+      EXPECT_THAT(columns->rows(), Eq(1000));
+      int64_t sum = 0;
+      ASSERT_THAT(columns->Find(2)->ForEach<int64_t>(
+                      [&](int64_t value) { sum += value; }),
+                  IsTrue());
+      EXPECT_THAT(sum, Eq(expected_sum));
+      EXPECT_THAT(ReadColumns(pds, 5), StatusIs(absl::StatusCode::kNotFound));
+      // The proto itself does not see the columns.
+      EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+    }
+  }
+
+  // Stores without columns still read the proto.
+  Store pds(storage, testfile);
+  ASSERT_OK(pds.Read());
+  EXPECT_THAT(pds.Read().value()->entries_size(), Eq(1000));
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(ReadColumns(pds, 3), StatusIs(absl::StatusCode::kNotFound));
+}
+
+TEST_F(ProtoDataStoreTest, ReusesPooledBuffers) {
+  FileStorage storage;
+  std::string testfile = TestFile("ReusesPooledBuffers");
+  TestProto testproto;
+  testproto.set_blob(std::string(100000, 'b'));
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  BufferPool pool;
+  ProtoDataStore<TestProto>::Options options;
+  options.buffer_pool = &pool;
+  for (int i = 0; i < 3; i++) {
+    ProtoDataStore<TestProto> pds(storage, testfile, options);
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+  // Only the first load allocates its read buffer.
+  EXPECT_THAT(pool.stats().misses, Eq(1));
+  EXPECT_THAT(pool.stats().hits, Eq(2));
+
+  // So does the serialization of an identical write.
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  ASSERT_OK(pds.Read());
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(pool.stats().misses, Eq(2));
+  EXPECT_THAT(pool.stats().hits, Eq(4));
+}
+
+TEST_F(ProtoDataStoreTest, ParallelParse) {
+  FileStorage storage;
+  std::string testfile = TestFile("ParallelParse");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  for (int i = 0; i < 10000; i++) {
+    TestProto::Entry* entry = testproto.add_entries();
+    entry->set_key(absl::StrCat("key", i));
+    entry->set_value(i);
+  }
+  testproto.set_blob("blob");
+  testproto.mutable_entry()->set_key("entry");
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  ThreadPool pool(4);
+  ProtoDataStore<TestProto>::Options options;
+  options.parallel_parse.field_number = TestProto::kEntriesFieldNumber;
+  options.parallel_parse.move_elements =
+      MoveRepeatedField(&TestProto::mutable_entries);
+  options.parallel_parse.executor = &pool;
+  options.parallel_parse.part_size = 1000;
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile, options);
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+
+  options.read_mode = ProtoDataStore<TestProto>::ReadMode::kMapped;
+  options.mapped_only_fields = {TestProto::kBlobFieldNumber};
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  testproto.clear_blob();
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, NotFoundIsCachedUntilWrite) {
+  FileStorage storage;
+  std::string testfile = TestFile("NotFoundIsCachedUntilWrite");
+  ProtoDataStore<TestProto>::Options options;
+  options.not_found_caching =
+      ProtoDataStore<TestProto>::NotFoundCaching::kUntilWrite;
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kNotFound));
+
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  {
+    ProtoDataStore<TestProto> other(storage, testfile);
+    ASSERT_OK(other.Write(absl::make_unique<TestProto>(testproto)));
+  }
+  // The creation by another writer goes unnoticed.
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kNotFound));
+
+  testproto.set_int_value(1);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, NotFoundIsCachedUntilCreated) {
+  FileStorage storage;
+  std::string testfile = TestFile("NotFoundIsCachedUntilCreated");
+  ProtoDataStore<TestProto>::Options options;
+  options.not_found_caching = ProtoDataStore<TestProto>::NotFoundCaching::kWatch;
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kNotFound));
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kNotFound));
+
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  {
+    ProtoDataStore<TestProto> other(storage, testfile);
+    ASSERT_OK(other.Write(absl::make_unique<TestProto>(testproto)));
+  }
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, DefaultSnapshotServedUntilWrite) {
+  FileStorage storage;
+  std::string testfile = TestFile("DefaultSnapshotServedUntilWrite");
+  TestProto snapshot;
+  snapshot.set_string_value("default");
+  const std::string contents =
+      EncodeStoreContents(snapshot.SerializeAsString());
+  ProtoDataStore<TestProto>::Options options;
+  options.default_snapshot = contents;
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+
+  absl::StatusOr<const TestProto*> first = pds.Read();
+  ASSERT_THAT(first, IsOkAndHolds(Pointee(EqualsProto(snapshot))));
+  // Parsed once and cached.
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Eq(*first)));
+  EXPECT_THAT(storage.GetFileSize(testfile),
+              StatusIs(absl::StatusCode::kNotFound));
+
+  TestProto testproto;
+  testproto.set_string_value("written");
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+
+  // A file written earlier takes precedence.
+  ProtoDataStore<TestProto> reopened(storage, testfile, options);
+  EXPECT_THAT(reopened.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, WritingDefaultSnapshotCreatesFile) {
+  FileStorage storage;
+  std::string testfile = TestFile("WritingDefaultSnapshotCreatesFile");
+  TestProto snapshot;
+  snapshot.set_string_value("default");
+  const std::string contents =
+      EncodeStoreContents(snapshot.SerializeAsString());
+  ProtoDataStore<TestProto>::Options options;
+  options.default_snapshot = contents;
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  ASSERT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(snapshot))));
+
+  // Not skipped as identical to the cached proto, which has no file.
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(snapshot)));
+  ASSERT_OK(storage.GetFileSize(testfile).status());
+  ProtoDataStore<TestProto> reopened(storage, testfile);
+  EXPECT_THAT(reopened.Read(), IsOkAndHolds(Pointee(EqualsProto(snapshot))));
+}
+
+TEST_F(ProtoDataStoreTest, CorruptedDefaultSnapshot) {
+  FileStorage storage;
+  std::string testfile = TestFile("CorruptedDefaultSnapshot");
+  TestProto snapshot;
+  snapshot.set_string_value("default");
+  std::string contents = EncodeStoreContents(snapshot.SerializeAsString());
+  contents.back() ^= 1;
+  ProtoDataStore<TestProto>::Options options;
+  options.default_snapshot = contents;
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kInternal));
+
+  // Checked with the checksum policy of the store.
+  const std::string crc32c_contents =
+      EncodeStoreContents<Crc32c>(snapshot.SerializeAsString());
+  using Crc32cStore = ProtoDataStore<TestProto, MutexLockPolicy, Crc32c>;
+  Crc32cStore::Options crc32c_options;
+  crc32c_options.default_snapshot = crc32c_contents;
+  Crc32cStore crc32c_pds(storage, testfile, crc32c_options);
+  EXPECT_THAT(crc32c_pds.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(snapshot))));
+  options.default_snapshot = crc32c_contents;
+  ProtoDataStore<TestProto> crc32_pds(storage, testfile, options);
+  EXPECT_THAT(crc32_pds.Read(),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+}
+
+// Forwards to FileStorage, counting the calls to OpenForRead() and
+// MapForRead().
+class CountingStorage {
+ public:
+  absl::StatusOr<uint64_t> GetFileSize(const std::string& filename) const {
+    return storage_.GetFileSize(filename);
+  }
+  absl::StatusOr<FileId> GetFileId(const std::string& filename) const {
+    return storage_.GetFileId(filename);
+  }
+  absl::StatusOr<std::unique_ptr<InputStream>> OpenForRead(
+      const std::string& filename) const {
+    open_for_read_calls_++;
+    return storage_.OpenForRead(filename);
+  }
+  absl::StatusOr<std::unique_ptr<OutputStream>> OpenForWrite(
+      const std::string& filename) const {
+    return storage_.OpenForWrite(filename);
+  }
+  absl::StatusOr<std::unique_ptr<MappedFile>> MapForRead(
+      const std::string& filename) const {
+    map_for_read_calls_++;
+    return storage_.MapForRead(filename);
+  }
+  absl::StatusOr<std::unique_ptr<CreationWatch>> WatchForCreation(
+      const std::string& filename) const {
+    return storage_.WatchForCreation(filename);
+  }
+  absl::Status Rename(const std::string& from, const std::string& to) const {
+    return storage_.Rename(from, to);
+  }
+  absl::Status Delete(const std::string& filename) const {
+    return storage_.Delete(filename);
+  }
+
+  int open_for_read_calls() const { return open_for_read_calls_; }
+  int map_for_read_calls() const { return map_for_read_calls_; }
+
+ private:
+  FileStorage storage_;
+  mutable int open_for_read_calls_ = 0;
+  mutable int map_for_read_calls_ = 0;
+};
+
+TEST_F(ProtoDataStoreTest, Policies) {
+  using SingleThreadedStore =
+      ProtoDataStore<TestProto, NoLockPolicy, Crc32c, CountingStorage>;
+  CountingStorage storage;
+  std::string testfile = TestFile("Policies");
+  SingleThreadedStore::Options options;
+  options.not_found_caching = SingleThreadedStore::NotFoundCaching::kUntilWrite;
+  SingleThreadedStore pds(storage, testfile, options);
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kNotFound));
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kNotFound));
+  EXPECT_THAT(storage.open_for_read_calls(), Eq(1));
+
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+
+  options.read_mode = SingleThreadedStore::ReadMode::kMapped;
+  SingleThreadedStore mapped(storage, testfile, options);
+  EXPECT_THAT(mapped.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+
+  // The header tells that the file was written with CRC-32C, not the
+  // default CRC-32.
+  FileStorage file_storage;
+  ProtoDataStore<TestProto> other(file_storage, testfile);
+  EXPECT_THAT(other.Read(), StatusIs(absl::StatusCode::kFailedPrecondition));
+  // Stores without checksums read files of any policy.
+  ProtoDataStore<TestProto, MutexLockPolicy, NoChecksum> unchecked(
+      file_storage, testfile);
+  EXPECT_THAT(unchecked.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ProtoDataStoreTest, SharedLockPolicy) {
+  using SharedStore = ProtoDataStore<TestProto, SharedLockPolicy, NoChecksum>;
+  FileStorage storage;
+  std::string testfile = TestFile("SharedLockPolicy");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  {
+    SharedStore pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  SharedStore pds(storage, testfile);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&pds, &testproto]() {
+      for (int j = 0; j < 100; j++) {
+        EXPECT_THAT(pds.Read(),
+                    IsOkAndHolds(Pointee(EqualsProto(testproto))));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+// Writes `testproto` to `testfile` with its string_value altered after the
+// checksum was computed, so that it still parses.
+void WriteCorrupted(const FileStorage& storage, const std::string& testfile,
+                    const TestProto& testproto) {
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+  auto mapped = storage.MapForRead(testfile);
+  ASSERT_THAT(mapped, IsOk());
+  std::string contents((*mapped)->data());
+  contents.back() ^= 1;
+  auto out = storage.OpenForWrite(testfile);
+  ASSERT_THAT(out, IsOk());
+  ASSERT_OK((*out)->Append(contents));
+}
+
+TEST_F(ProtoDataStoreTest, DeferredVerification) {
+  FileStorage storage;
+  std::string testfile = TestFile("DeferredVerification");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  WriteCorrupted(storage, testfile, testproto);
+
+  ManualExecutor executor;
+  std::vector<absl::Status> failures;
+  ProtoDataStore<TestProto>::Options options;
+  options.verification = ProtoDataStore<TestProto>::Verification::kDeferred;
+  options.verification_executor = &executor;
+  options.on_verification_failure = [&failures](const absl::Status& status) {
+    failures.push_back(status);
+  };
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+
+  // Parsed before the checksum is verified.
+  auto read = pds.Read();
+  ASSERT_THAT(read, IsOk());
+  EXPECT_THAT((*read)->string_value(), Eq("helln"));
+
+  executor.RunAll();
+  ASSERT_THAT(failures.size(), Eq(1));
+  EXPECT_THAT(failures[0], StatusIs(absl::StatusCode::kInternal));
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kInternal));
+  // The dropped version stays valid until the next write.
+  EXPECT_THAT((*read)->string_value(), Eq("helln"));
+
+  // A written version needs no verification.
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  executor.RunAll();
+  EXPECT_THAT(failures.size(), Eq(1));
+}
+
+TEST_F(ProtoDataStoreTest, BytesFieldsAndColumnsAreAlwaysVerified) {
+  FileStorage storage;
+  std::string testfile = TestFile("BytesFieldsAndColumnsAreAlwaysVerified");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  WriteCorrupted(storage, testfile, testproto);
+
+  ManualExecutor executor;
+  ProtoDataStore<TestProto>::Options options;
+  options.read_mode = ProtoDataStore<TestProto>::ReadMode::kMapped;
+  options.verification = ProtoDataStore<TestProto>::Verification::kDeferred;
+  options.verification_executor = &executor;
+  ProtoDataStore<TestProto> pds(storage, testfile, options);
+  ASSERT_OK(pds.Read());
+
+  // The raw bytes are verified even though the check of the load is
+  // pending.
+  EXPECT_THAT(pds.ReadBytesField({1}),
+              StatusIs(absl::StatusCode::kInternal));
+  EXPECT_THAT(ReadColumns(pds, 3), StatusIs(absl::StatusCode::kInternal));
+  executor.RunAll();
+}
+
+TEST_F(ProtoDataStoreTest, DeferredVerificationOfValidFiles) {
+  FileStorage storage;
+  std::string testfile = TestFile("DeferredVerificationOfValidFiles");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  testproto.set_blob("blob");
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  ManualExecutor executor;
+  int failures = 0;
+  for (auto read_mode : {ProtoDataStore<TestProto>::ReadMode::kCopy,
+                         ProtoDataStore<TestProto>::ReadMode::kMapped}) {
+    for (size_t chunk_size : {0, 4}) {
+      ProtoDataStore<TestProto>::Options options;
+      options.read_mode = read_mode;
+      options.chunk_size = chunk_size;
+      options.verification =
+          ProtoDataStore<TestProto>::Verification::kDeferred;
+      options.verification_executor = &executor;
+      options.on_verification_failure = [&failures](const absl::Status&) {
+        failures++;
+      };
+      ProtoDataStore<TestProto> pds(storage, testfile, options);
+      EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+    }
+  }
+  // The checks outlive their stores.
+  executor.RunAll();
+  EXPECT_THAT(failures, Eq(0));
+}
+
+TEST_F(ProtoDataStoreTest, SampledVerification) {
+  FileStorage storage;
+  std::string testfile = TestFile("SampledVerification");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  WriteCorrupted(storage, testfile, testproto);
+
+  ProtoDataStore<TestProto>::Options options;
+  options.verification = ProtoDataStore<TestProto>::Verification::kSampled;
+  options.verification_sample_period = 2;
+  int failed_loads = 0;
+  for (int i = 0; i < 4; i++) {
+    ProtoDataStore<TestProto> pds(storage, testfile, options);
+    if (!pds.Read().ok()) {
+      failed_loads++;
+    }
+  }
+  EXPECT_THAT(failed_loads, Eq(2));
+}
+
+TEST_F(ProtoDataStoreTest, SharedMemoryLoadsOncePerVersion) {
+  using CountingStore = ProtoDataStore<TestProto, MutexLockPolicy, Crc32,
+                                       CountingStorage>;
+  CountingStorage storage;
+  std::string testfile = TestFile("SharedMemoryLoadsOncePerVersion");
+  TestProto testproto;
+  testproto.set_blob("blob");
+  {
+    CountingStore pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  // Each cache and store stands in for those of one process.
+  const std::string name =
+      absl::StrCat("/protostore-test-", getpid(), "-SharedMemory");
+  CountingStore::Options options;
+  options.read_mode = CountingStore::ReadMode::kMapped;
+  for (int i = 0; i < 3; i++) {
+    auto cache = SharedMemoryCache::Open(name);
+    ASSERT_THAT(cache, IsOk());
+    options.contents_cache = cache->get();
+    CountingStore pds(storage, testfile, options);
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+    EXPECT_THAT(pds.ReadBytesField({4}), IsOkAndHolds(Eq("blob")));
+  }
+  EXPECT_THAT(storage.map_for_read_calls(), Eq(1));
+
+  testproto.set_blob("new blob");
+  {
+    CountingStore pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+  for (int i = 0; i < 2; i++) {
+    auto cache = SharedMemoryCache::Open(name);
+    ASSERT_THAT(cache, IsOk());
+    options.contents_cache = cache->get();
+    CountingStore pds(storage, testfile, options);
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+  EXPECT_THAT(storage.map_for_read_calls(), Eq(2));
+  EXPECT_OK(SharedMemoryCache::Remove(name));
+}
+
+// Forwards to FileStorage; while stalled, opening files for writing and
+// mapping them block.
+class StallingStorage {
+ public:
+  absl::StatusOr<uint64_t> GetFileSize(const std::string& filename) const {
+    return storage_.GetFileSize(filename);
+  }
+  absl::StatusOr<FileId> GetFileId(const std::string& filename) const {
+    return storage_.GetFileId(filename);
+  }
+  absl::StatusOr<std::unique_ptr<InputStream>> OpenForRead(
+      const std::string& filename) const {
+    return storage_.OpenForRead(filename);
+  }
+  absl::StatusOr<std::unique_ptr<OutputStream>> OpenForWrite(
+      const std::string& filename) const {
+    absl::MutexLock lock(&mutex_);
+    mutex_.Await(absl::Condition(
+        +[](bool* stalled) { return !*stalled; }, &stalled_));
+    return storage_.OpenForWrite(filename);
+  }
+  absl::StatusOr<std::unique_ptr<MappedFile>> MapForRead(
+      const std::string& filename) const {
+    absl::MutexLock lock(&mutex_);
+    mutex_.Await(absl::Condition(
+        +[](bool* stalled) { return !*stalled; }, &stalled_));
+    return storage_.MapForRead(filename);
+  }
+  absl::StatusOr<std::unique_ptr<CreationWatch>> WatchForCreation(
+      const std::string& filename) const {
+    return storage_.WatchForCreation(filename);
+  }
+  absl::Status Rename(const std::string& from, const std::string& to) const {
+    return storage_.Rename(from, to);
+  }
+  absl::Status Delete(const std::string& filename) const {
+    return storage_.Delete(filename);
+  }
+
+  void Stall(bool stalled) {
+    absl::MutexLock lock(&mutex_);
+    stalled_ = stalled;
+  }
+
+ private:
+  FileStorage storage_;
+  mutable absl::Mutex mutex_;
+  mutable bool stalled_ = false;
+};
+
+TEST_F(ProtoDataStoreTest, StalledMapsDoNotBlockCachedReads) {
+  using StallingStore = ProtoDataStore<TestProto, MutexLockPolicy, Crc32,
+                                       StallingStorage>;
+  StallingStorage storage;
+  std::string testfile = TestFile("StalledMapsDoNotBlockCachedReads");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  StallingStore pds(storage, testfile);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+
+  storage.Stall(true);
+  std::thread reader([&pds]() { EXPECT_OK(pds.ReadSerialized().status()); });
+  // Whether or not the reader has started mapping the file.
+  absl::SleepFor(absl::Milliseconds(10));
+  EXPECT_THAT(pds.Read(absl::Now() + absl::Milliseconds(10)),
+              IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  storage.Stall(false);
+  reader.join();
+}
+
+TEST_F(ProtoDataStoreTest, DeadlinesBoundStalledWrites) {
+  using StallingStore = ProtoDataStore<TestProto, MutexLockPolicy, Crc32,
+                                       StallingStorage>;
+  StallingStorage storage;
+  std::string testfile = TestFile("DeadlinesBoundStalledWrites");
+  TestProto old_proto;
+  old_proto.set_string_value("old");
+  TestProto new_proto;
+  new_proto.set_string_value("new");
+  {
+    StallingStore pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(old_proto)));
+    EXPECT_THAT(pds.Read(absl::InfiniteFuture()),
+                IsOkAndHolds(Pointee(EqualsProto(old_proto))));
+
+    storage.Stall(true);
+    EXPECT_THAT(pds.Write(absl::make_unique<TestProto>(new_proto),
+                          absl::Now() + absl::Milliseconds(10)),
+                StatusIs(absl::StatusCode::kDeadlineExceeded));
+    // Readers do not wait for the stalled write.
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(old_proto))));
+    EXPECT_THAT(pds.Read(absl::Now() + absl::Milliseconds(10)),
+                IsOkAndHolds(Pointee(EqualsProto(old_proto))));
+    // Nor does a write whose deadline has passed.
+    EXPECT_THAT(pds.Write(absl::make_unique<TestProto>(old_proto),
+                          absl::InfinitePast()),
+                StatusIs(absl::StatusCode::kDeadlineExceeded));
+
+    storage.Stall(false);
+    // The destructor waits for the write to complete.
+  }
+  StallingStore pds(storage, testfile);
+  EXPECT_THAT(pds.Read(absl::InfiniteFuture()),
+              IsOkAndHolds(Pointee(EqualsProto(new_proto))));
+}
+
+TEST_F(ProtoDataStoreTest, WritesLandInCallOrder) {
+  using StallingStore = ProtoDataStore<TestProto, MutexLockPolicy, Crc32,
+                                       StallingStorage>;
+  StallingStorage storage;
+  std::string testfile = TestFile("WritesLandInCallOrder");
+  TestProto first;
+  first.set_int_value(1);
+  TestProto second;
+  second.set_int_value(2);
+  {
+    StallingStore pds(storage, testfile);
+    storage.Stall(true);
+    EXPECT_THAT(pds.Write(absl::make_unique<TestProto>(first),
+                          absl::Now() + absl::Milliseconds(10)),
+                StatusIs(absl::StatusCode::kDeadlineExceeded));
+    std::thread writer([&]() {
+      EXPECT_OK(pds.Write(absl::make_unique<TestProto>(second)));
+    });
+    storage.Stall(false);
+    writer.join();
+  }
+  // The first write, if it comes last, is dropped.
+  StallingStore pds(storage, testfile);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(second))));
+}
+
+// Runs closures right away, counting them.
+class CountingExecutor : public Executor {
+ public:
+  void Schedule(std::function<void()> closure) override {
+    calls_++;
+    closure();
+  }
+
+  int calls() const { return calls_; }
+
+ private:
+  std::atomic<int> calls_{0};
+};
+
+TEST_F(ProtoDataStoreTest, CachedReadsWithDeadlineStayOnCaller) {
+  using MutexStore = ProtoDataStore<TestProto, MutexLockPolicy>;
+  FileStorage storage;
+  std::string testfile = TestFile("CachedReadsWithDeadlineStayOnCaller");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  CountingExecutor executor;
+  MutexStore::Options options;
+  options.background_executor = &executor;
+  {
+    MutexStore pds(storage, testfile, options);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  MutexStore pds(storage, testfile, options);
+  // Only the load runs on the executor.
+  EXPECT_THAT(pds.Read(absl::InfiniteFuture()),
+              IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  EXPECT_EQ(executor.calls(), 1);
+
+  // Concurrent cached reads wait for each other rather than the executor.
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; i++) {
+    readers.emplace_back([&pds]() {
+      for (int j = 0; j < 1000; j++) {
+        EXPECT_OK(pds.Read(absl::InfiniteFuture()).status());
+      }
+    });
+  }
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(executor.calls(), 1);
+}
+
+TEST_F(ProtoDataStoreTest, CacheHitsDoNotAllocate) {
+  FileStorage storage;
+  std::string testfile = TestFile("CacheHitsDoNotAllocate");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  ASSERT_OK(pds.Read());
+
+  // Matchers allocate, so results are checked outside the counted scope.
+  AllocationCounter counter;
+  absl::StatusOr<const TestProto*> hit = pds.Read();
+  absl::StatusOr<const TestProto*> deadline_hit =
+      pds.Read(absl::InfiniteFuture());
+  const uint64_t allocations = counter.allocations();
+  EXPECT_THAT(allocations, Eq(0));
+  EXPECT_THAT(hit, IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  EXPECT_THAT(deadline_hit, IsOkAndHolds(Pointee(EqualsProto(testproto))));
+
+  // Neither do cached errors.
+  ProtoDataStore<TestProto>::Options options;
+  options.not_found_caching =
+      ProtoDataStore<TestProto>::NotFoundCaching::kUntilWrite;
+  ProtoDataStore<TestProto> missing(storage, TestFile("missing"), options);
+  ASSERT_THAT(missing.Read(), StatusIs(absl::StatusCode::kNotFound));
+  counter.Reset();
+  absl::StatusOr<const TestProto*> not_found = missing.Read();
+  EXPECT_THAT(counter.allocations(), Eq(0));
+  EXPECT_THAT(not_found, StatusIs(absl::StatusCode::kNotFound));
+}
+
+TEST_F(ProtoDataStoreTest, WriteAllocationsAreBounded) {
+  FileStorage storage;
+  std::string testfile = TestFile("WriteAllocationsAreBounded");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  for (int i = 0; i < 5; i++) {
+    TestProto testproto;
+    testproto.set_blob(std::string(10000 << i, 'b'));
+    testproto.set_int_value(i);
+    for (int j = 0; j < 100; j++) {
+      testproto.add_entries()->set_key(absl::StrCat("key", j));
+    }
+    auto proto = absl::make_unique<TestProto>(testproto);
+    AllocationCounter counter;
+    absl::Status status = pds.Write(std::move(proto));
+    const uint64_t allocations = counter.allocations();
+    ASSERT_OK(status);
+    // Independent of the size of the proto: the file is written from a
+    // pooled buffer; what remains are file names, handles and the shared
+    // ownership of the installed proto.
+    EXPECT_THAT(allocations, Le(16));
+  }
+}
+
+TEST_F(ProtoDataStoreTest, SerializedPassthrough) {
+  FileStorage storage;
+  std::string testfile = TestFile("SerializedPassthrough");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  testproto.set_blob(std::string(100000, 'b'));
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+    EXPECT_THAT(pds.ReadSerialized(),
+                IsOkAndHolds(Eq(testproto.SerializeAsString())));
+  }
+
+  // Relayed bytes are parsed by the first Read() only.
+  testproto.set_int_value(1);
+  ProtoDataStore<TestProto> relay(storage, testfile);
+  int notifications = 0;
+  relay.Subscribe([&](std::shared_ptr<const TestProto>, uint64_t) {
+    notifications++;
+  });
+  ASSERT_OK(relay.WriteSerialized(absl::Cord(testproto.SerializeAsString())));
+  EXPECT_THAT(notifications, Eq(0));
+  EXPECT_THAT(relay.ReadSerialized(),
+              IsOkAndHolds(Eq(testproto.SerializeAsString())));
+  EXPECT_THAT(relay.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  EXPECT_THAT(notifications, Eq(1));
+  {
+    ProtoDataStore<TestProto> pds(storage, testfile);
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+
+  // Validation rejects what does not parse; otherwise Read() does.
+  EXPECT_THAT(relay.WriteSerialized(absl::Cord("junk"), /*validate=*/true),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(relay.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  ASSERT_OK(relay.WriteSerialized(absl::Cord("junk")));
+  EXPECT_THAT(relay.ReadSerialized(), IsOkAndHolds(Eq("junk")));
+  EXPECT_THAT(relay.Read(), StatusIs(absl::StatusCode::kInternal));
+
+  {
+    auto out = storage.OpenForAppend(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("more junk"));
+  }
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  EXPECT_THAT(pds.ReadSerialized(), StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(ProtoDataStoreTest, ExportAndImport) {
+  FileStorage storage;
+  std::string source_file = TestFile("source");
+  std::string replica_file = TestFile("replica");
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  // Larger than the buffer of a pipe.
+  testproto.set_blob(std::string(300000, 'b'));
+  ProtoDataStore<TestProto> source(storage, source_file);
+  ASSERT_OK(source.Write(absl::make_unique<TestProto>(testproto)));
+
+  ProtoDataStore<TestProto> replica(storage, replica_file);
+  for (int i = 0; i < 2; i++) {
+    int fds[2];
+    ASSERT_THAT(pipe(fds), Eq(0));
+    std::thread exporter([&]() {
+      EXPECT_THAT(source.ExportTo(fds[1]),
+                  IsOkAndHolds(Eq(testproto.ByteSizeLong())));
+      close(fds[1]);
+    });
+    EXPECT_OK(replica.ImportFrom(fds[0], testproto.ByteSizeLong()));
+    exporter.join();
+    close(fds[0]);
+    EXPECT_THAT(replica.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+    testproto.set_int_value(1);
+    ASSERT_OK(source.Write(absl::make_unique<TestProto>(testproto)));
+  }
+  {
+    ProtoDataStore<TestProto> pds(storage, replica_file);
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+
+  // The input ending early leaves the replica alone.
+  int fds[2];
+  ASSERT_THAT(pipe(fds), Eq(0));
+  ASSERT_THAT(write(fds[1], "junk", 4), Eq(4));
+  close(fds[1]);
+  EXPECT_THAT(replica.ImportFrom(fds[0], 100),
+              StatusIs(absl::StatusCode::kOutOfRange));
+  close(fds[0]);
+  ProtoDataStore<TestProto> pds(storage, replica_file);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+
+  // Corruptions are not exported; nothing is sent.
+  {
+    auto out = storage.OpenForAppend(source_file);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("junk"));
+  }
+  ProtoDataStore<TestProto> corrupted(storage, source_file);
+  EXPECT_THAT(corrupted.ExportTo(-1),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(ProtoDataStoreTest, WritesDoNotWaitForExports) {
+  FileStorage storage;
+  std::string source_file = TestFile("source");
+  TestProto old_proto;
+  // Larger than the buffer of a pipe, so the export blocks until imported.
+  old_proto.set_blob(std::string(300000, 'b'));
+  TestProto new_proto;
+  new_proto.set_string_value("new");
+  ProtoDataStore<TestProto> source(storage, source_file);
+  ASSERT_OK(source.Write(absl::make_unique<TestProto>(old_proto)));
+
+  int fds[2];
+  ASSERT_THAT(pipe(fds), Eq(0));
+  std::thread exporter([&]() {
+    EXPECT_THAT(source.ExportTo(fds[1]),
+                IsOkAndHolds(Eq(old_proto.ByteSizeLong())));
+    close(fds[1]);
+  });
+  // Once bytes arrive, the export has opened the file.
+  struct pollfd pfd = {fds[0], POLLIN, 0};
+  ASSERT_THAT(poll(&pfd, 1, -1), Eq(1));
+  ASSERT_OK(source.Write(absl::make_unique<TestProto>(new_proto)));
+
+  // The export still sends the version it verified.
+  ProtoDataStore<TestProto> replica(storage, TestFile("replica"));
+  EXPECT_OK(replica.ImportFrom(fds[0], old_proto.ByteSizeLong()));
+  exporter.join();
+  close(fds[0]);
+  EXPECT_THAT(replica.Read(), IsOkAndHolds(Pointee(EqualsProto(old_proto))));
+}
+
 }  // namespace
 }  // namespace protostore
@@ -0,0 +1,154 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROTOSTORE_PROTO_INDEX_H_
+#define PROTOSTORE_PROTO_INDEX_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "protostore/executor.h"
+#include "protostore/status-macros.h"
+
+namespace protostore {
+
+/// \brief Maps keys to the elements of a repeated field for O(1) lookups.
+///
+/// The index points into the proto it was built from, so it must not outlive
+/// it. Indexes handed out by ProtoIndex::Get() keep their proto alive. When
+/// several elements share a key, the first one wins.
+template <typename KeyT, typename ElementT>
+class HashIndex {
+ public:
+  /// Indexes `elements` (e.g. a RepeatedPtrField<ElementT>) by `key_fn`.
+  /// `key_fn` is invoked as `KeyT key_fn(const ElementT&)`.
+  template <typename Container, typename KeyFn>
+  HashIndex(const Container& elements, KeyFn key_fn) {
+    index_.reserve(elements.size());
+    for (const ElementT& element : elements) {
+      index_.emplace(key_fn(element), &element);
+    }
+  }
+
+  HashIndex(const HashIndex&) = delete;
+  HashIndex& operator=(const HashIndex&) = delete;
+
+  /// Returns the element with `key`, or nullptr if there is none.
+  template <typename K>
+  const ElementT* Find(const K& key) const {
+    auto it = index_.find(key);
+    return it == index_.end() ? nullptr : it->second;
+  }
+
+  size_t size() const { return index_.size(); }
+
+ private:
+  absl::flat_hash_map<KeyT, const ElementT*> index_;
+};
+
+/// \brief An index derived from each version of the proto of a
+/// ProtoDataStore, e.g. a HashIndex over a large repeated field.
+///
+/// Thread-safe.
+template <typename ProtoT, typename IndexT>
+class ProtoIndex {
+ public:
+  using Builder = std::function<std::unique_ptr<IndexT>(const ProtoT& proto)>;
+
+  /// \brief Indexes the proto of `store`, a ProtoDataStore of ProtoT that
+  /// must outlive the index. `builder` is invoked once per version of the
+  /// proto.
+  ///
+  /// If `executor` is non-null, the index is rebuilt on it as soon as a new
+  /// version is written or loaded; otherwise it is built by the first Get()
+  /// call that needs it.
+  template <typename StoreT>
+  ProtoIndex(StoreT* store, Builder builder, Executor* executor = nullptr)
+      : builder_(std::move(builder)) {
+    read_ = [store](uint64_t* version) { return store->ReadShared(version); };
+    if (executor != nullptr) {
+      const uint64_t id = store->Subscribe(
+          [this](std::shared_ptr<const ProtoT> proto, uint64_t version) {
+            Build(std::move(proto), version);
+          },
+          executor);
+      unsubscribe_ = [store, id]() { store->Unsubscribe(id); };
+    }
+  }
+
+  ProtoIndex(const ProtoIndex&) = delete;
+  ProtoIndex& operator=(const ProtoIndex&) = delete;
+
+  /// Waits for a rebuild in progress, and drops those not yet started.
+  ~ProtoIndex() {
+    if (unsubscribe_) {
+      unsubscribe_();
+    }
+  }
+
+  /// \brief Returns the index for the current version of the proto. The
+  /// index (and the proto it refers to) stays valid for as long as it is
+  /// held, even across later writes.
+  ///
+  /// Returns the same errors as ProtoDataStore::Read().
+  absl::StatusOr<std::shared_ptr<const IndexT>> Get() const
+      ABSL_LOCKS_EXCLUDED(mutex_) {
+    uint64_t version;
+    PDS_ASSIGN_OR_RETURN(std::shared_ptr<const ProtoT> proto,
+                         read_(&version));
+    return Build(std::move(proto), version);
+  }
+
+ private:
+  // Returns the index for `version` of `proto`, building it if needed. If a
+  // newer version has already been indexed, that index is returned instead.
+  std::shared_ptr<const IndexT> Build(std::shared_ptr<const ProtoT> proto,
+                                      uint64_t version) const
+      ABSL_LOCKS_EXCLUDED(mutex_) {
+    absl::MutexLock lock(&mutex_);
+    if (index_ != nullptr && version_ >= version) {
+      return index_;
+    }
+    std::shared_ptr<const IndexT> built = builder_(*proto);
+    // Tie the lifetime of the proto to the index pointing into it.
+    index_ = std::shared_ptr<const IndexT>(
+        built.get(), [built, proto](const IndexT*) mutable {
+          built.reset();
+          proto.reset();
+        });
+    version_ = version;
+    return index_;
+  }
+
+  const Builder builder_;
+  std::function<absl::StatusOr<std::shared_ptr<const ProtoT>>(
+      uint64_t* version)>
+      read_;
+  std::function<void()> unsubscribe_;
+
+  // Held while building so that concurrent callers share one build.
+  mutable absl::Mutex mutex_;
+  mutable uint64_t version_ ABSL_GUARDED_BY(mutex_) = 0;
+  mutable std::shared_ptr<const IndexT> index_ ABSL_GUARDED_BY(mutex_);
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_PROTO_INDEX_H_
@@ -0,0 +1,440 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROTOSTORE_PROTO_LOG_STORE_H_
+#define PROTOSTORE_PROTO_LOG_STORE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "protostore/crc32.h"
+#include "protostore/file-storage.h"
+#include "protostore/status-macros.h"
+
+namespace protostore {
+namespace internal {
+
+// The log is a sequence of fixed-size blocks. Each record is split into one
+// or more fragments so that no fragment header ever straddles a block
+// boundary; a block tail too small for a header is zero-filled.
+//
+// Fragment layout:
+//   checksum: uint32, little-endian, Crc32 of `type` followed by the payload
+//   length:   uint16, little-endian, payload length
+//   type:     uint8, one of LogRecordType
+//   payload:  `length` bytes
+constexpr uint64_t kLogBlockSize = 32 * 1024;
+constexpr uint64_t kLogHeaderSize = 4 + 2 + 1;
+
+enum LogRecordType : uint8_t {
+  kFullRecord = 1,
+  kFirstRecord = 2,
+  kMiddleRecord = 3,
+  kLastRecord = 4,
+};
+
+inline uint32_t LogFragmentChecksum(char type, absl::string_view payload) {
+  Crc32 crc;
+  crc.Append(absl::string_view(&type, 1));
+  crc.Append(payload);
+  return crc.Get();
+}
+
+// Appends the fragments making up `record` to `out`, given that the log
+// currently ends `*block_offset` bytes into a block. Updates `*block_offset`.
+inline void EncodeLogRecord(absl::string_view record, uint64_t* block_offset,
+                            std::string* out) {
+  bool begin = true;
+  do {
+    const uint64_t leftover = kLogBlockSize - *block_offset;
+    if (leftover < kLogHeaderSize) {
+      out->append(leftover, '\0');
+      *block_offset = 0;
+    }
+    const uint64_t available = kLogBlockSize - *block_offset - kLogHeaderSize;
+    const uint64_t length = std::min<uint64_t>(record.size(), available);
+    const bool end = length == record.size();
+    const char type = begin && end ? kFullRecord
+                      : begin      ? kFirstRecord
+                      : end        ? kLastRecord
+                                   : kMiddleRecord;
+    const absl::string_view fragment = record.substr(0, length);
+    const uint32_t checksum = LogFragmentChecksum(type, fragment);
+    const char header[kLogHeaderSize] = {
+        static_cast<char>(checksum & 0xff),
+        static_cast<char>((checksum >> 8) & 0xff),
+        static_cast<char>((checksum >> 16) & 0xff),
+        static_cast<char>((checksum >> 24) & 0xff),
+        static_cast<char>(length & 0xff),
+        static_cast<char>((length >> 8) & 0xff),
+        type,
+    };
+    out->append(header, kLogHeaderSize);
+    out->append(fragment.data(), fragment.size());
+    *block_offset += kLogHeaderSize + length;
+    record.remove_prefix(length);
+    begin = false;
+  } while (!record.empty());
+}
+
+// Reassembles records from the blocks of a log.
+class LogReader {
+ public:
+  // Sets `*block` to the next block of the log. A block shorter than
+  // kLogBlockSize (including an empty one) marks the end of the log.
+  using BlockSource = std::function<absl::Status(absl::string_view* block)>;
+
+  LogReader(absl::string_view filename, BlockSource next_block)
+      : filename_(filename), next_block_(std::move(next_block)) {}
+
+  // Sets `*record` to the next record. `*record` may point into `scratch` or
+  // into the current block, and is valid until the next call.
+  //
+  // Returns OUT_OF_RANGE at the end of the log, including when the log ends
+  // in a torn (partially written) record or in zeros.
+  // Returns INTERNAL_ERROR if a corrupted fragment was encountered.
+  absl::Status ReadRecord(absl::string_view* record, std::string* scratch) {
+    bool in_fragmented_record = false;
+    scratch->clear();
+    while (true) {
+      if (buffer_.size() < kLogHeaderSize) {
+        if (eof_) {
+          return absl::OutOfRangeError(filename_);
+        }
+        // Skip the zero-filled block trailer.
+        offset_ += buffer_.size();
+        PDS_RETURN_IF_ERROR(next_block_(&buffer_));
+        eof_ = buffer_.size() < kLogBlockSize;
+        continue;
+      }
+
+      // A crash may leave the file extended with zeros its data never
+      // reached; an all-zero header ends the valid data.
+      if (buffer_.substr(0, kLogHeaderSize)
+              .find_first_not_of('\0') == absl::string_view::npos) {
+        return absl::OutOfRangeError(filename_);
+      }
+
+      const auto* header = reinterpret_cast<const uint8_t*>(buffer_.data());
+      const uint32_t checksum = header[0] | (header[1] << 8) |
+                                (header[2] << 16) |
+                                (static_cast<uint32_t>(header[3]) << 24);
+      const uint64_t length = header[4] | (header[5] << 8);
+      const char type = buffer_[6];
+      if (kLogHeaderSize + length > buffer_.size()) {
+        if (eof_) {
+          return absl::OutOfRangeError(filename_);
+        }
+        // The length cannot be trusted, but no fragment outlasts its block.
+        corruption_end_ = offset_ + buffer_.size();
+        return Corruption("fragment crosses block boundary");
+      }
+      const absl::string_view fragment =
+          buffer_.substr(kLogHeaderSize, length);
+      if (LogFragmentChecksum(type, fragment) != checksum) {
+        corruption_end_ = offset_ + kLogHeaderSize + length;
+        return Corruption("checksum mismatch");
+      }
+      buffer_.remove_prefix(kLogHeaderSize + length);
+      offset_ += kLogHeaderSize + length;
+      corruption_end_ = offset_;
+
+      switch (type) {
+        case kFullRecord:
+          if (in_fragmented_record) {
+            return Corruption("unterminated record");
+          }
+          *record = fragment;
+          record_end_ = offset_;
+          return absl::OkStatus();
+        case kFirstRecord:
+          if (in_fragmented_record) {
+            return Corruption("unterminated record");
+          }
+          scratch->assign(fragment.data(), fragment.size());
+          in_fragmented_record = true;
+          break;
+        case kMiddleRecord:
+          if (!in_fragmented_record) {
+            return Corruption("missing start of record");
+          }
+          scratch->append(fragment.data(), fragment.size());
+          break;
+        case kLastRecord:
+          if (!in_fragmented_record) {
+            return Corruption("missing start of record");
+          }
+          scratch->append(fragment.data(), fragment.size());
+          *record = *scratch;
+          record_end_ = offset_;
+          return absl::OkStatus();
+        default:
+          return Corruption("unknown fragment type");
+      }
+    }
+  }
+
+  // Offset just past the last record successfully returned.
+  uint64_t record_end() const { return record_end_; }
+
+  // After INTERNAL_ERROR, the offset just past the corrupted fragment, as
+  // far as its header can be trusted.
+  uint64_t corruption_end() const { return corruption_end_; }
+
+ private:
+  absl::Status Corruption(absl::string_view reason) const {
+    return absl::InternalError(absl::StrCat(
+        "Log corrupted at offset ", offset_, " (", reason, "): ", filename_));
+  }
+
+  const std::string filename_;
+  BlockSource next_block_;
+  absl::string_view buffer_;
+  bool eof_ = false;
+  uint64_t offset_ = 0;
+  uint64_t record_end_ = 0;
+  uint64_t corruption_end_ = 0;
+};
+
+}  // namespace internal
+
+/// \brief An append-only, file-backed log of protos.
+///
+/// Every record carries its own checksum, so appending costs I/O
+/// proportional to the record rather than to the whole history. A record that
+/// was only partially written (e.g. due to a crash) is dropped, and truncated
+/// away by the next Append(). A corruption followed by further data is not
+/// a torn write; Append() then fails and leaves the log untouched.
+///
+/// This class is thread-safe.
+template <typename ProtoT>
+class ProtoLogStore final {
+ public:
+  /// \brief Iterates over the records of a log, oldest first.
+  class Iterator {
+   public:
+    virtual ~Iterator() = default;
+
+    // Parses the next record into `proto`.
+    //
+    // Returns OUT_OF_RANGE after the last record.
+    // Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+    absl::Status Next(ProtoT* proto) {
+      absl::string_view record;
+      PDS_RETURN_IF_ERROR(reader_.ReadRecord(&record, &scratch_));
+      if (!proto->ParseFromArray(record.data(), record.size())) {
+        return absl::InternalError(absl::StrCat(
+            "Proto parse failed. Log corrupted: ", filename_));
+      }
+      return absl::OkStatus();
+    }
+
+   protected:
+    Iterator(absl::string_view filename,
+             internal::LogReader::BlockSource next_block)
+        : filename_(filename), reader_(filename, std::move(next_block)) {}
+
+   private:
+    friend class ProtoLogStore;
+
+    const std::string filename_;
+    internal::LogReader reader_;
+    std::string scratch_;
+  };
+
+  // Uses the specified file to store the log.
+  ProtoLogStore(const FileStorage& file_storage, absl::string_view filename);
+
+  ~ProtoLogStore() = default;
+
+  // Appends `proto` to the log and flushes it to the operating system.
+  //
+  // Returns INTERNAL_ERROR if any IO error is encountered, or if the log is
+  // corrupted before its last record. A failed append never corrupts earlier
+  // records.
+  absl::Status Append(const ProtoT& proto) ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Returns an iterator reading the log with sequential IO.
+  //
+  // Returns NOT_FOUND if nothing was ever appended to the log.
+  absl::StatusOr<std::unique_ptr<Iterator>> NewIterator() const;
+
+  // Returns an iterator over a memory mapping of the log. Records appended
+  // after the call are not visited.
+  //
+  // Returns NOT_FOUND if nothing was ever appended to the log.
+  absl::StatusOr<std::unique_ptr<Iterator>> NewMappedIterator() const;
+
+  // Disallow copy and assign.
+  ProtoLogStore(const ProtoLogStore&) = delete;
+  ProtoLogStore& operator=(const ProtoLogStore&) = delete;
+
+ private:
+  class StreamIterator;
+  class MappedIterator;
+
+  // Finds the end of the last intact record, truncates a torn tail after it
+  // and opens the log for appending.
+  absl::Status RecoverLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  absl::Mutex mutex_;
+
+  const FileStorage& file_storage_;
+  const std::string filename_;
+
+  // Open while the tail of the log is known to be intact.
+  std::unique_ptr<OutputStream> output_stream_ ABSL_GUARDED_BY(mutex_);
+  uint64_t block_offset_ ABSL_GUARDED_BY(mutex_) = 0;
+};
+
+template <typename ProtoT>
+class ProtoLogStore<ProtoT>::StreamIterator final : public Iterator {
+ public:
+  StreamIterator(absl::string_view filename,
+                 std::unique_ptr<InputStream> input_stream)
+      : Iterator(filename,
+                 [this](absl::string_view* block) { return NextBlock(block); }),
+        input_stream_(std::move(input_stream)),
+        block_(absl::make_unique<char[]>(internal::kLogBlockSize)) {}
+
+ private:
+  absl::Status NextBlock(absl::string_view* block) {
+    absl::Status status =
+        input_stream_->Read(internal::kLogBlockSize, block, block_.get());
+    // A short final block is expected.
+    if (absl::IsOutOfRange(status)) {
+      return absl::OkStatus();
+    }
+    return status;
+  }
+
+  std::unique_ptr<InputStream> input_stream_;
+  std::unique_ptr<char[]> block_;
+};
+
+template <typename ProtoT>
+class ProtoLogStore<ProtoT>::MappedIterator final : public Iterator {
+ public:
+  explicit MappedIterator(std::unique_ptr<MappedFile> mapped_file)
+      : Iterator(mapped_file->filename(),
+                 [this](absl::string_view* block) { return NextBlock(block); }),
+        mapped_file_(std::move(mapped_file)),
+        remaining_(mapped_file_->data()) {}
+
+ private:
+  absl::Status NextBlock(absl::string_view* block) {
+    *block = remaining_.substr(0, internal::kLogBlockSize);
+    remaining_.remove_prefix(block->size());
+    return absl::OkStatus();
+  }
+
+  std::unique_ptr<MappedFile> mapped_file_;
+  absl::string_view remaining_;
+};
+
+template <typename ProtoT>
+ProtoLogStore<ProtoT>::ProtoLogStore(const FileStorage& file_storage,
+                                     absl::string_view filename)
+    : file_storage_(file_storage), filename_(filename) {}
+
+template <typename ProtoT>
+absl::Status ProtoLogStore<ProtoT>::Append(const ProtoT& proto) {
+  absl::MutexLock lock(&mutex_);
+  if (output_stream_ == nullptr) {
+    PDS_RETURN_IF_ERROR(RecoverLocked());
+  }
+
+  std::string fragments;
+  uint64_t block_offset = block_offset_;
+  internal::EncodeLogRecord(proto.SerializeAsString(), &block_offset,
+                            &fragments);
+
+  absl::Status status = output_stream_->Append(fragments);
+  if (status.ok()) {
+    status = output_stream_->Flush();
+  }
+  if (!status.ok()) {
+    // The tail may now hold a torn record; recover before the next append.
+    output_stream_.reset();
+    return status;
+  }
+  block_offset_ = block_offset;
+  return absl::OkStatus();
+}
+
+template <typename ProtoT>
+absl::Status ProtoLogStore<ProtoT>::RecoverLocked() {
+  uint64_t valid_end = 0;
+  absl::StatusOr<uint64_t> file_size = file_storage_.GetFileSize(filename_);
+  if (file_size.ok()) {
+    PDS_ASSIGN_OR_RETURN(std::unique_ptr<InputStream> input_stream,
+                         file_storage_.OpenForRead(filename_));
+    StreamIterator iterator(filename_, std::move(input_stream));
+    absl::string_view record;
+    absl::Status status;
+    do {
+      status = iterator.reader_.ReadRecord(&record, &iterator.scratch_);
+    } while (status.ok());
+    if (!absl::IsOutOfRange(status) && !absl::IsInternal(status)) {
+      return status;
+    }
+    // Only a corrupted last fragment can be a torn write; intact records may
+    // follow a corruption elsewhere, so those are reported rather than
+    // truncated away.
+    if (absl::IsInternal(status) &&
+        iterator.reader_.corruption_end() < *file_size) {
+      return status;
+    }
+    valid_end = iterator.reader_.record_end();
+    if (valid_end < *file_size) {
+      PDS_RETURN_IF_ERROR(file_storage_.Truncate(filename_, valid_end));
+    }
+  } else if (!absl::IsNotFound(file_size.status())) {
+    return file_size.status();
+  }
+
+  PDS_ASSIGN_OR_RETURN(output_stream_, file_storage_.OpenForAppend(filename_));
+  block_offset_ = valid_end % internal::kLogBlockSize;
+  return absl::OkStatus();
+}
+
+template <typename ProtoT>
+absl::StatusOr<std::unique_ptr<typename ProtoLogStore<ProtoT>::Iterator>>
+ProtoLogStore<ProtoT>::NewIterator() const {
+  PDS_ASSIGN_OR_RETURN(std::unique_ptr<InputStream> input_stream,
+                       file_storage_.OpenForRead(filename_));
+  return absl::make_unique<StreamIterator>(filename_, std::move(input_stream));
+}
+
+template <typename ProtoT>
+absl::StatusOr<std::unique_ptr<typename ProtoLogStore<ProtoT>::Iterator>>
+ProtoLogStore<ProtoT>::NewMappedIterator() const {
+  PDS_ASSIGN_OR_RETURN(std::unique_ptr<MappedFile> mapped_file,
+                       file_storage_.MapForRead(filename_));
+  return absl::make_unique<MappedIterator>(std::move(mapped_file));
+}
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_PROTO_LOG_STORE_H_
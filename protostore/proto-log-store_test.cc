@@ -0,0 +1,302 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protostore/proto-log-store.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protostore/file-storage.h"
+#include "protostore/testing-matchers.h"
+#include "protostore/testfile-fixture.h"
+#include "protostore/test.pb.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Lt;
+using ::testing::Ne;
+using testing::EqualsProto;
+using testing::IsOk;
+using testing::StatusIs;
+
+class ProtoLogStoreTest : public testing::TestFileFixture {};
+
+// Reads every record of the log with both iterator flavors, checking that
+// they agree.
+std::vector<TestProto> ReadAll(const ProtoLogStore<TestProto>& log) {
+  std::vector<TestProto> stream_records;
+  std::vector<TestProto> mapped_records;
+  auto stream = log.NewIterator();
+  auto mapped = log.NewMappedIterator();
+  EXPECT_THAT(stream, IsOk());
+  EXPECT_THAT(mapped, IsOk());
+  if (!stream.ok() || !mapped.ok()) return {};
+
+  TestProto proto;
+  absl::Status status;
+  while ((status = (*stream)->Next(&proto)).ok()) {
+    stream_records.push_back(proto);
+  }
+  EXPECT_THAT(status, StatusIs(absl::StatusCode::kOutOfRange));
+  while ((status = (*mapped)->Next(&proto)).ok()) {
+    mapped_records.push_back(proto);
+  }
+  EXPECT_THAT(status, StatusIs(absl::StatusCode::kOutOfRange));
+
+  EXPECT_THAT(mapped_records.size(), Eq(stream_records.size()));
+  for (size_t i = 0; i < stream_records.size() && i < mapped_records.size();
+       i++) {
+    EXPECT_THAT(mapped_records[i], EqualsProto(stream_records[i]));
+  }
+  return stream_records;
+}
+
+TEST_F(ProtoLogStoreTest, AppendAndIterate) {
+  FileStorage storage;
+  std::string testfile = TestFile("AppendAndIterate");
+  ProtoLogStore<TestProto> log(storage, testfile);
+  EXPECT_THAT(log.NewIterator(), StatusIs(absl::StatusCode::kNotFound));
+
+  for (int i = 0; i < 10; i++) {
+    TestProto testproto;
+    testproto.set_int_value(i);
+    ASSERT_OK(log.Append(testproto));
+  }
+
+  std::vector<TestProto> records = ReadAll(log);
+  ASSERT_THAT(records.size(), Eq(10));
+  for (int i = 0; i < 10; i++) {
+    EXPECT_THAT(records[i].int_value(), Eq(i));
+  }
+}
+
+TEST_F(ProtoLogStoreTest, RecordsSpanningBlocks) {
+  FileStorage storage;
+  std::string testfile = TestFile("RecordsSpanningBlocks");
+  std::vector<TestProto> expected;
+  {
+    ProtoLogStore<TestProto> log(storage, testfile);
+    // Sizes chosen to exercise full, fragmented and block-trailer cases.
+    for (int size : {0, 100, 40000, 32000, 5, 100000, 32761, 1}) {
+      TestProto testproto;
+      testproto.set_string_value(std::string(size, 'a' + expected.size()));
+      ASSERT_OK(log.Append(testproto));
+      expected.push_back(testproto);
+    }
+  }
+
+  // Reopen and keep appending at the right block offset.
+  ProtoLogStore<TestProto> log(storage, testfile);
+  TestProto testproto;
+  testproto.set_string_value("after reopen");
+  ASSERT_OK(log.Append(testproto));
+  expected.push_back(testproto);
+
+  std::vector<TestProto> records = ReadAll(log);
+  ASSERT_THAT(records.size(), Eq(expected.size()));
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_THAT(records[i], EqualsProto(expected[i]));
+  }
+}
+
+TEST_F(ProtoLogStoreTest, TornTailIsDroppedAndTruncated) {
+  FileStorage storage;
+  std::string testfile = TestFile("TornTailIsDroppedAndTruncated");
+  TestProto testproto;
+  testproto.set_string_value(std::string(1000, 'x'));
+  {
+    ProtoLogStore<TestProto> log(storage, testfile);
+    ASSERT_OK(log.Append(testproto));
+    ASSERT_OK(log.Append(testproto));
+  }
+  auto size = storage.GetFileSize(testfile);
+  ASSERT_THAT(size, IsOk());
+  // Simulate a crash halfway through the second append.
+  ASSERT_OK(storage.Truncate(testfile, *size - 500));
+
+  ProtoLogStore<TestProto> log(storage, testfile);
+  EXPECT_THAT(ReadAll(log).size(), Eq(1));
+
+  TestProto next;
+  next.set_int_value(3);
+  ASSERT_OK(log.Append(next));
+  std::vector<TestProto> records = ReadAll(log);
+  ASSERT_THAT(records.size(), Eq(2));
+  EXPECT_THAT(records[0], EqualsProto(testproto));
+  EXPECT_THAT(records[1], EqualsProto(next));
+  auto new_size = storage.GetFileSize(testfile);
+  ASSERT_THAT(new_size, IsOk());
+  EXPECT_THAT(*new_size, Lt(*size));
+}
+
+TEST_F(ProtoLogStoreTest, ZeroFilledTailIsDroppedAndTruncated) {
+  FileStorage storage;
+  std::string testfile = TestFile("ZeroFilledTailIsDroppedAndTruncated");
+  TestProto testproto;
+  testproto.set_string_value("ZeroFilledTailIsDroppedAndTruncated");
+  {
+    ProtoLogStore<TestProto> log(storage, testfile);
+    ASSERT_OK(log.Append(testproto));
+  }
+  auto size = storage.GetFileSize(testfile);
+  ASSERT_THAT(size, IsOk());
+  // Simulate a crash after the file grew but before the data landed.
+  {
+    auto out = storage.OpenForAppend(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append(std::string(100, '\0')));
+  }
+
+  ProtoLogStore<TestProto> log(storage, testfile);
+  EXPECT_THAT(ReadAll(log).size(), Eq(1));
+
+  ASSERT_OK(log.Append(testproto));
+  EXPECT_THAT(ReadAll(log).size(), Eq(2));
+  auto new_size = storage.GetFileSize(testfile);
+  ASSERT_THAT(new_size, IsOk());
+  EXPECT_THAT(*new_size, Eq(2 * *size));
+}
+
+TEST_F(ProtoLogStoreTest, CorruptionIsReported) {
+  FileStorage storage;
+  std::string testfile = TestFile("CorruptionIsReported");
+  {
+    ProtoLogStore<TestProto> log(storage, testfile);
+    TestProto testproto;
+    testproto.set_string_value("CorruptionIsReported");
+    ASSERT_OK(log.Append(testproto));
+    ASSERT_OK(log.Append(testproto));
+  }
+  std::string contents;
+  {
+    auto mapped = storage.MapForRead(testfile);
+    ASSERT_THAT(mapped, IsOk());
+    contents = std::string((*mapped)->data());
+  }
+  // Flip a payload byte of the first record.
+  contents[10] ^= 0x1;
+  {
+    auto out = storage.OpenForWrite(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append(contents));
+  }
+
+  ProtoLogStore<TestProto> log(storage, testfile);
+  auto iterator = log.NewIterator();
+  ASSERT_THAT(iterator, IsOk());
+  TestProto proto;
+  EXPECT_THAT((*iterator)->Next(&proto),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(ProtoLogStoreTest, MidLogCorruptionIsNotTruncated) {
+  FileStorage storage;
+  std::string testfile = TestFile("MidLogCorruptionIsNotTruncated");
+  TestProto first;
+  first.set_string_value("first");
+  TestProto second;
+  second.set_string_value("second");
+  TestProto third;
+  third.set_string_value("third");
+  {
+    ProtoLogStore<TestProto> log(storage, testfile);
+    ASSERT_OK(log.Append(first));
+    ASSERT_OK(log.Append(second));
+    ASSERT_OK(log.Append(third));
+  }
+  std::string contents;
+  {
+    auto mapped = storage.MapForRead(testfile);
+    ASSERT_THAT(mapped, IsOk());
+    contents = std::string((*mapped)->data());
+  }
+  // Flip a payload byte of the second record.
+  const size_t second_offset = contents.find("second");
+  ASSERT_THAT(second_offset, Ne(std::string::npos));
+  contents[second_offset] ^= 0x1;
+  {
+    auto out = storage.OpenForWrite(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append(contents));
+  }
+
+  ProtoLogStore<TestProto> log(storage, testfile);
+  TestProto next;
+  next.set_int_value(4);
+  EXPECT_THAT(log.Append(next), StatusIs(absl::StatusCode::kInternal));
+  EXPECT_THAT(log.Append(next), StatusIs(absl::StatusCode::kInternal));
+
+  // The third record is still there.
+  auto mapped = storage.MapForRead(testfile);
+  ASSERT_THAT(mapped, IsOk());
+  EXPECT_THAT((*mapped)->data(), Eq(contents));
+  auto iterator = log.NewIterator();
+  ASSERT_THAT(iterator, IsOk());
+  TestProto proto;
+  ASSERT_OK((*iterator)->Next(&proto));
+  EXPECT_THAT(proto, EqualsProto(first));
+  EXPECT_THAT((*iterator)->Next(&proto),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(ProtoLogStoreTest, CorruptedLengthIsNotTruncated) {
+  FileStorage storage;
+  std::string testfile = TestFile("CorruptedLengthIsNotTruncated");
+  TestProto first;
+  first.set_string_value("first");
+  TestProto filler;
+  filler.set_string_value(std::string(1000, 'x'));
+  {
+    ProtoLogStore<TestProto> log(storage, testfile);
+    ASSERT_OK(log.Append(first));
+    // Fill more than one block, but less than the largest fragment.
+    for (int i = 0; i < 40; i++) {
+      ASSERT_OK(log.Append(filler));
+    }
+  }
+  std::string contents;
+  {
+    auto mapped = storage.MapForRead(testfile);
+    ASSERT_THAT(mapped, IsOk());
+    contents = std::string((*mapped)->data());
+  }
+  ASSERT_THAT(contents.size(), Lt(internal::kLogHeaderSize + 0xffff));
+  // Make the length of the second record reach past the end of the file.
+  const size_t length_offset =
+      internal::kLogHeaderSize + first.ByteSizeLong() + 4;
+  contents[length_offset] = '\xff';
+  contents[length_offset + 1] = '\xff';
+  {
+    auto out = storage.OpenForWrite(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append(contents));
+  }
+
+  ProtoLogStore<TestProto> log(storage, testfile);
+  TestProto next;
+  next.set_int_value(4);
+  EXPECT_THAT(log.Append(next), StatusIs(absl::StatusCode::kInternal));
+  auto mapped = storage.MapForRead(testfile);
+  ASSERT_THAT(mapped, IsOk());
+  EXPECT_THAT((*mapped)->data(), Eq(contents));
+}
+
+}  // namespace
+}  // namespace protostore
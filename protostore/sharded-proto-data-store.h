@@ -0,0 +1,482 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_SHARDED_PROTO_DATA_STORE_H_
+#define PROTOSTORE_SHARDED_PROTO_DATA_STORE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "protostore/buffer-pool.h"
+#include "protostore/crc32.h"
+#include "protostore/executor.h"
+#include "protostore/file-storage.h"
+#include "protostore/status-macros.h"
+#include "protostore/store-format.h"
+#include "protostore/store-policies.h"
+#include "protostore/wire-format.h"
+
+namespace protostore {
+
+/// \brief Stores one proto in several files ("shards") by top-level field,
+/// so that a Write() only rewrites the shards whose fields changed.
+///
+/// Options::field_shards assigns top-level fields to shards; fields not
+/// listed go to shard 0. Each shard is a checksummed store file named
+/// `<filename>.<shard>.<generation>`, and the file `filename` is a manifest
+/// listing the generation of each shard.
+///
+/// A Write() serializes the proto and compares each shard with that of the
+/// cached proto. It writes the shards that differ to files of a new
+/// generation and syncs them, then durably replaces the manifest, and only
+/// then removes the superseded files. Readers thus always see a consistent
+/// set of shards, and the IO of a write is that of the shards that changed.
+///
+/// Read() reads and verifies the shards listed by the manifest in parallel
+/// on Options::read_executor, then parses them as one proto. The proto is
+/// cached as by ProtoDataStore; as there, only one process may write.
+///
+/// The lock, checksum and storage policies are as for ProtoDataStore.
+template <typename ProtoT, typename LockT = MutexLockPolicy,
+          typename ChecksumT = Crc32, typename StorageT = FileStorage>
+class ShardedProtoDataStore final {
+ public:
+  // Header stored at the beginning of each file.
+  using Header = StoreHeader;
+
+  // Default upper bound of the size of each shard.
+  static constexpr uint64_t kDefaultMaxFileSize = 1 * 1024 * 1024;  // 1 MiB.
+
+  struct Options {
+    // Shard of each top-level field number. Shards are numbered from 0 to
+    // the largest shard listed.
+    absl::flat_hash_map<int, int> field_shards;
+
+    // Upper bound of the size of each shard.
+    uint64_t max_file_size = kDefaultMaxFileSize;
+
+    // Reads and verifies the shards on this executor; inline if null. Must
+    // outlive the store.
+    Executor* read_executor = nullptr;
+
+    // Recycles the buffers that protos are serialized into. Must outlive
+    // the store.
+    BufferPool* buffer_pool = BufferPool::Default();
+  };
+
+  ShardedProtoDataStore(const StorageT& file_storage,
+                        absl::string_view filename, Options options);
+
+  ShardedProtoDataStore(const ShardedProtoDataStore&) = delete;
+  ShardedProtoDataStore& operator=(const ShardedProtoDataStore&) = delete;
+
+  // Returns the proto assembled from the shards, cached after the first
+  // call. The returned object is only valid until the next Write().
+  //
+  // Returns NOT_FOUND if the proto was never written.
+  // Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+  absl::StatusOr<const ProtoT*> Read() const ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // Writes the shards of `proto` that changed, see the class comment.
+  //
+  // Returns INVALID_ARGUMENT if a shard is larger than
+  // Options::max_file_size.
+  // Returns INTERNAL_ERROR if an IO error was encountered, leaving the
+  // stored proto unchanged.
+  absl::Status Write(std::unique_ptr<ProtoT> proto)
+      ABSL_LOCKS_EXCLUDED(mutex_, write_mutex_);
+
+  int num_shards() const { return num_shards_; }
+
+ private:
+  // Contents of the manifest.
+  struct Manifest {
+    // Increases with every write; 0 if nothing was written.
+    uint64_t generation = 0;
+    // Generation of the file of each shard.
+    std::vector<uint64_t> shard_generations;
+
+    bool operator==(const Manifest& other) const {
+      return generation == other.generation &&
+             shard_generations == other.shard_generations;
+    }
+  };
+
+  // Field numbers of the manifest, which is encoded as a proto.
+  static constexpr int kGenerationField = 1;
+  static constexpr int kShardGenerationField = 2;
+
+  // Times a load is retried after a concurrent Write() removed a shard.
+  static constexpr int kMaxLoadAttempts = 3;
+
+  static int NumShards(const absl::flat_hash_map<int, int>& field_shards) {
+    int num_shards = 1;
+    for (const auto& field_shard : field_shards) {
+      num_shards = std::max(num_shards, field_shard.second + 1);
+    }
+    return num_shards;
+  }
+
+  std::string ShardFilename(size_t shard, uint64_t generation) const {
+    return absl::StrCat(filename_, ".", shard, ".", generation);
+  }
+
+  // Serializes `proto` into `*buffer` and splits it into one Cord per
+  // shard, aliasing the buffer.
+  std::vector<absl::Cord> SerializeShards(const ProtoT& proto,
+                                          BufferPool::Buffer* buffer) const;
+
+  // Returns the header and `contents` of a file.
+  static absl::Cord EncodeFile(const absl::Cord& contents);
+
+  // Writes a file of a new generation and syncs it.
+  absl::Status WriteShard(const std::string& filename,
+                          const absl::Cord& contents) const;
+
+  // Returns NOT_FOUND if the proto was never written.
+  absl::StatusOr<Manifest> ReadManifest() const;
+
+  // Replaces the manifest durably.
+  absl::Status WriteManifest(const Manifest& manifest) const;
+
+  // Reads the shards of `manifest` and parses them.
+  absl::StatusOr<std::unique_ptr<ProtoT>> Load(const Manifest& manifest) const;
+
+  const StorageT& file_storage_;
+  const std::string filename_;
+  const Options options_;
+  const int num_shards_;
+
+  // Serializes writes. Held for their IO, unlike `mutex_`, so that readers
+  // of the cached proto never wait for it.
+  mutable LockT write_mutex_ ABSL_ACQUIRED_BEFORE(mutex_);
+
+  mutable LockT mutex_;
+  mutable std::shared_ptr<const ProtoT> cached_proto_ ABSL_GUARDED_BY(mutex_);
+  // The manifest `cached_proto_` was read or written with.
+  mutable Manifest manifest_ ABSL_GUARDED_BY(mutex_);
+};
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+constexpr uint64_t ShardedProtoDataStore<ProtoT, LockT, ChecksumT,
+                                         StorageT>::kDefaultMaxFileSize;
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::
+    ShardedProtoDataStore(const StorageT& file_storage,
+                          absl::string_view filename, Options options)
+    : file_storage_(file_storage),
+      filename_(filename),
+      options_(std::move(options)),
+      num_shards_(NumShards(options_.field_shards)) {}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<const ProtoT*>
+ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Read() const {
+  {
+    internal::ReaderLock<LockT> lock(&mutex_);
+    if (cached_proto_ != nullptr) {
+      return cached_proto_.get();
+    }
+  }
+
+  internal::WriterLock<LockT> lock(&mutex_);
+  // Another thread may have loaded it meanwhile.
+  if (cached_proto_ != nullptr) {
+    return cached_proto_.get();
+  }
+  for (int attempt = 1;; attempt++) {
+    PDS_ASSIGN_OR_RETURN(Manifest manifest, ReadManifest());
+    absl::StatusOr<std::unique_ptr<ProtoT>> proto = Load(manifest);
+    if (absl::IsNotFound(proto.status()) && attempt < kMaxLoadAttempts) {
+      // A write replaced the manifest and removed a shard meanwhile.
+      continue;
+    }
+    PDS_RETURN_IF_ERROR(proto.status());
+    cached_proto_ = std::move(*proto);
+    manifest_ = std::move(manifest);
+    return cached_proto_.get();
+  }
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Write(
+    std::unique_ptr<ProtoT> proto) {
+  BufferPool::Buffer buffer;
+  const std::vector<absl::Cord> shards = SerializeShards(*proto, &buffer);
+  for (const absl::Cord& shard : shards) {
+    if (shard.size() >= options_.max_file_size) {
+      return absl::InvalidArgumentError(
+          absl::StrFormat("New shard too large. size: %lu; limit: %lu.",
+                          shard.size(), options_.max_file_size));
+    }
+  }
+
+  internal::WriterLock<LockT> write_lock(&write_mutex_);
+  absl::StatusOr<Manifest> current = ReadManifest();
+  if (!current.ok() && !absl::IsNotFound(current.status())) {
+    return current.status();
+  }
+  const Manifest old_manifest = current.ok() ? *current : Manifest();
+
+  // The cached proto tells which shards changed, unless another process
+  // wrote since it was cached.
+  std::shared_ptr<const ProtoT> cached;
+  {
+    internal::ReaderLock<LockT> lock(&mutex_);
+    if (manifest_ == old_manifest) {
+      cached = cached_proto_;
+    }
+  }
+  BufferPool::Buffer cached_buffer;
+  std::vector<absl::Cord> cached_shards;
+  if (cached != nullptr &&
+      old_manifest.shard_generations.size() == shards.size()) {
+    cached_shards = SerializeShards(*cached, &cached_buffer);
+  }
+
+  Manifest manifest;
+  manifest.generation = old_manifest.generation + 1;
+  manifest.shard_generations = old_manifest.shard_generations;
+  manifest.shard_generations.resize(shards.size());
+  bool changed = false;
+  for (size_t i = 0; i < shards.size(); i++) {
+    if (!cached_shards.empty() && cached_shards[i] == shards[i]) {
+      continue;
+    }
+    PDS_RETURN_IF_ERROR(
+        WriteShard(ShardFilename(i, manifest.generation), shards[i]));
+    manifest.shard_generations[i] = manifest.generation;
+    changed = true;
+  }
+  if (!changed) {
+    return absl::OkStatus();
+  }
+  PDS_RETURN_IF_ERROR(WriteManifest(manifest));
+
+  // A file left behind by a failure here is merely wasted space.
+  for (size_t i = 0; i < old_manifest.shard_generations.size(); i++) {
+    const uint64_t generation = old_manifest.shard_generations[i];
+    if (i >= shards.size() || manifest.shard_generations[i] != generation) {
+      file_storage_.Delete(ShardFilename(i, generation)).IgnoreError();
+    }
+  }
+
+  internal::WriterLock<LockT> lock(&mutex_);
+  cached_proto_ = std::move(proto);
+  manifest_ = std::move(manifest);
+  return absl::OkStatus();
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+std::vector<absl::Cord>
+ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::SerializeShards(
+    const ProtoT& proto, BufferPool::Buffer* buffer) const {
+  const size_t size = proto.ByteSizeLong();
+  *buffer = options_.buffer_pool->Acquire(size);
+  proto.SerializeWithCachedSizesToArray(
+      reinterpret_cast<uint8_t*>(buffer->data()));
+
+  std::vector<std::vector<absl::string_view>> ranges(num_shards_);
+  // Our own serialization is well-formed.
+  internal::SplitFieldsIntoShards(absl::string_view(buffer->data(), size),
+                                  options_.field_shards, &ranges);
+  std::vector<absl::Cord> shards(num_shards_);
+  for (int i = 0; i < num_shards_; i++) {
+    for (absl::string_view range : ranges[i]) {
+      shards[i].Append(
+          absl::MakeCordFromExternal(range, [](absl::string_view) {}));
+    }
+  }
+  return shards;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Cord
+ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::EncodeFile(
+    const absl::Cord& contents) {
+  ChecksumT crc;
+  for (absl::string_view chunk : contents.Chunks()) {
+    crc.Append(chunk);
+  }
+  const Header header = MakeStoreHeader(crc);
+  absl::Cord file(absl::string_view(reinterpret_cast<const char*>(&header),
+                                    sizeof(Header)));
+  file.Append(contents);
+  return file;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status
+ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::WriteShard(
+    const std::string& filename, const absl::Cord& contents) const {
+  PDS_ASSIGN_OR_RETURN(std::unique_ptr<OutputStream> output_stream,
+                       file_storage_.OpenForWrite(filename));
+  PDS_RETURN_IF_ERROR(output_stream->AppendCord(EncodeFile(contents)));
+  // Must be durable before the manifest refers to it.
+  PDS_RETURN_IF_ERROR(output_stream->Sync());
+  return output_stream->Close();
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<typename ShardedProtoDataStore<ProtoT, LockT, ChecksumT,
+                                              StorageT>::Manifest>
+ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::ReadManifest()
+    const {
+  PDS_ASSIGN_OR_RETURN(std::unique_ptr<MappedFile> mapped_file,
+                       file_storage_.MapForRead(filename_));
+  PDS_ASSIGN_OR_RETURN(const absl::string_view contents,
+                       ValidateStoreContents<ChecksumT>(
+                           filename_, mapped_file->data()));
+  const absl::Status corrupted = absl::InternalError(
+      absl::StrCat("Manifest corrupted: ", filename_));
+  Manifest manifest;
+  internal::WireFieldScanner scanner(contents);
+  internal::WireField field;
+  while (scanner.Next(&field)) {
+    uint64_t value;
+    absl::string_view varint = field.value;
+    if (field.wire_type != internal::kVarint ||
+        !internal::ReadVarint(&varint, &value)) {
+      return corrupted;
+    }
+    if (field.number == kGenerationField) {
+      manifest.generation = value;
+    } else if (field.number == kShardGenerationField) {
+      manifest.shard_generations.push_back(value);
+    }
+  }
+  if (!scanner.ok() || manifest.generation == 0) {
+    return corrupted;
+  }
+  return manifest;
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status
+ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::WriteManifest(
+    const Manifest& manifest) const {
+  std::string contents;
+  {
+    google::protobuf::io::StringOutputStream stream(&contents);
+    google::protobuf::io::CodedOutputStream output(&stream);
+    output.WriteTag(kGenerationField << 3 | internal::kVarint);
+    output.WriteVarint64(manifest.generation);
+    for (uint64_t generation : manifest.shard_generations) {
+      output.WriteTag(kShardGenerationField << 3 | internal::kVarint);
+      output.WriteVarint64(generation);
+    }
+  }
+
+  const std::string tmp_filename = absl::StrCat(filename_, ".tmp");
+  PDS_ASSIGN_OR_RETURN(std::unique_ptr<OutputStream> output_stream,
+                       file_storage_.OpenForWrite(tmp_filename));
+  PDS_RETURN_IF_ERROR(
+      output_stream->AppendCord(EncodeFile(absl::Cord(contents))));
+  PDS_RETURN_IF_ERROR(output_stream->Sync());
+  PDS_RETURN_IF_ERROR(output_stream->Close());
+  PDS_RETURN_IF_ERROR(file_storage_.Rename(tmp_filename, filename_));
+  // The old shards are removed next; the old manifest must not come back.
+  return file_storage_.SyncDirectory(filename_);
+}
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::StatusOr<std::unique_ptr<ProtoT>>
+ShardedProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>::Load(
+    const Manifest& manifest) const {
+  struct Shard {
+    std::unique_ptr<MappedFile> mapped_file;
+    absl::string_view contents;
+    absl::Status status;
+  };
+  std::vector<Shard> shards(manifest.shard_generations.size());
+  Executor* executor = options_.read_executor != nullptr
+                           ? options_.read_executor
+                           : InlineExecutor::Default();
+  absl::BlockingCounter pending(shards.size());
+  for (size_t i = 0; i < shards.size(); i++) {
+    executor->Schedule([&, i]() {
+      Shard& shard = shards[i];
+      const std::string filename =
+          ShardFilename(i, manifest.shard_generations[i]);
+      absl::StatusOr<std::unique_ptr<MappedFile>> mapped_file =
+          file_storage_.MapForRead(filename);
+      if (!mapped_file.ok()) {
+        shard.status = mapped_file.status();
+      } else if ((*mapped_file)->data().size() > options_.max_file_size) {
+        shard.status = absl::InternalError(absl::StrCat(
+            "File larger than expected, couldn't read: ", filename));
+      } else {
+        absl::StatusOr<absl::string_view> contents =
+            ValidateStoreContents<ChecksumT>(filename,
+                                             (*mapped_file)->data());
+        shard.status = contents.status();
+        if (contents.ok()) {
+          shard.contents = *contents;
+          shard.mapped_file = std::move(*mapped_file);
+        }
+      }
+      pending.DecrementCount();
+    });
+  }
+  pending.Wait();
+
+  std::vector<absl::string_view> ranges;
+  for (const Shard& shard : shards) {
+    PDS_RETURN_IF_ERROR(shard.status);
+    ranges.push_back(shard.contents);
+  }
+  // The shards hold disjoint fields, so parsing their concatenation merges
+  // them.
+  internal::RangesInputStream input(std::move(ranges));
+  google::protobuf::io::CodedInputStream coded_input(&input);
+  auto proto = absl::make_unique<ProtoT>();
+  if (!proto->ParsePartialFromCodedStream(&coded_input) ||
+      !proto->IsInitialized()) {
+    return absl::InternalError(
+        absl::StrCat("Proto parse failed. File corrupted: ", filename_));
+  }
+  return proto;
+}
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_SHARDED_PROTO_DATA_STORE_H_
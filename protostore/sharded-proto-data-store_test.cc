@@ -0,0 +1,187 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/sharded-proto-data-store.h"
+
+#include <memory>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protostore/file-storage.h"
+#include "protostore/testing-matchers.h"
+#include "protostore/testfile-fixture.h"
+#include "protostore/thread-pool.h"
+#include "protostore/test.pb.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Not;
+using ::testing::Pointee;
+
+using testing::EqualsProto;
+using testing::IsOk;
+using testing::IsOkAndHolds;
+using testing::StatusIs;
+
+using Store = ShardedProtoDataStore<TestProto>;
+
+class ShardedProtoDataStoreTest : public testing::TestFileFixture {
+ protected:
+  // Entries and the blob each get a shard of their own.
+  static Store::Options ShardedOptions() {
+    Store::Options options;
+    options.field_shards = {{TestProto::kEntriesFieldNumber, 1},
+                            {TestProto::kBlobFieldNumber, 2}};
+    return options;
+  }
+
+  static TestProto MakeTestProto() {
+    TestProto testproto;
+    testproto.set_string_value("hello");
+    testproto.set_int_value(1);
+    for (int i = 0; i < 100; i++) {
+      testproto.add_entries()->set_key(absl::StrCat("key", i));
+    }
+    testproto.set_blob(std::string(10000, 'b'));
+    testproto.mutable_entry()->set_key("entry");
+    return testproto;
+  }
+
+  bool Exists(const std::string& filename) {
+    return storage_.GetFileSize(filename).ok();
+  }
+
+  FileStorage storage_;
+};
+
+TEST_F(ShardedProtoDataStoreTest, ReadWrite) {
+  std::string testfile = TestFile("ReadWrite");
+  TestProto testproto = MakeTestProto();
+  {
+    Store pds(storage_, testfile, ShardedOptions());
+    EXPECT_THAT(pds.num_shards(), Eq(3));
+    EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kNotFound));
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+  Store pds(storage_, testfile, ShardedOptions());
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ShardedProtoDataStoreTest, WritesOnlyChangedShards) {
+  std::string testfile = TestFile("WritesOnlyChangedShards");
+  TestProto testproto = MakeTestProto();
+  Store pds(storage_, testfile, ShardedOptions());
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  for (int shard = 0; shard < 3; shard++) {
+    EXPECT_TRUE(Exists(absl::StrCat(testfile, ".", shard, ".1")));
+  }
+
+  testproto.set_int_value(2);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_TRUE(Exists(absl::StrCat(testfile, ".0.2")));
+  EXPECT_FALSE(Exists(absl::StrCat(testfile, ".0.1")));
+  EXPECT_TRUE(Exists(absl::StrCat(testfile, ".1.1")));
+  EXPECT_TRUE(Exists(absl::StrCat(testfile, ".2.1")));
+
+  testproto.add_entries()->set_key("new");
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_TRUE(Exists(absl::StrCat(testfile, ".0.2")));
+  EXPECT_TRUE(Exists(absl::StrCat(testfile, ".1.3")));
+  EXPECT_FALSE(Exists(absl::StrCat(testfile, ".1.1")));
+  EXPECT_TRUE(Exists(absl::StrCat(testfile, ".2.1")));
+
+  // Identical writes write nothing.
+  auto manifest_id = storage_.GetFileId(testfile);
+  ASSERT_THAT(manifest_id, IsOk());
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(storage_.GetFileId(testfile), IsOkAndHolds(Eq(*manifest_id)));
+
+  Store reopened(storage_, testfile, ShardedOptions());
+  EXPECT_THAT(reopened.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ShardedProtoDataStoreTest, ParallelLoadDetectsCorruption) {
+  std::string testfile = TestFile("ParallelLoadDetectsCorruption");
+  TestProto testproto = MakeTestProto();
+  {
+    Store pds(storage_, testfile, ShardedOptions());
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  ThreadPool pool(3);
+  Store::Options options = ShardedOptions();
+  options.read_executor = &pool;
+  {
+    Store pds(storage_, testfile, options);
+    EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+  }
+
+  {
+    auto out = storage_.OpenForAppend(absl::StrCat(testfile, ".2.1"));
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("junk"));
+  }
+  Store pds(storage_, testfile, options);
+  EXPECT_THAT(pds.Read(), StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(ShardedProtoDataStoreTest, ShardsCanBeReassigned) {
+  std::string testfile = TestFile("ShardsCanBeReassigned");
+  TestProto testproto = MakeTestProto();
+  {
+    Store pds(storage_, testfile, ShardedOptions());
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  }
+
+  // Files written with other shards are read as they were written.
+  Store::Options options;
+  options.field_shards = {{TestProto::kBlobFieldNumber, 1}};
+  Store pds(storage_, testfile, options);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+
+  // The next write rewrites them all.
+  testproto.set_int_value(2);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_TRUE(Exists(absl::StrCat(testfile, ".0.2")));
+  EXPECT_TRUE(Exists(absl::StrCat(testfile, ".1.2")));
+  EXPECT_FALSE(Exists(absl::StrCat(testfile, ".2.1")));
+  Store reopened(storage_, testfile, options);
+  EXPECT_THAT(reopened.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+TEST_F(ShardedProtoDataStoreTest, ShardsAreLimitedInSize) {
+  std::string testfile = TestFile("ShardsAreLimitedInSize");
+  Store::Options options = ShardedOptions();
+  options.max_file_size = 5000;
+  Store pds(storage_, testfile, options);
+  TestProto testproto = MakeTestProto();
+  EXPECT_THAT(pds.Write(absl::make_unique<TestProto>(testproto)),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(pds.Read(), Not(IsOk()));
+
+  testproto.clear_blob();
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(testproto))));
+}
+
+}  // namespace
+}  // namespace protostore
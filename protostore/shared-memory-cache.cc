@@ -0,0 +1,251 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/shared-memory-cache.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "protostore/status-macros.h"
+
+namespace protostore {
+namespace {
+
+// Readers that keep seeing an update in progress, e.g. because its writer
+// died, take the advisory lock instead, which repairs the seqlock.
+constexpr int kMaxSeqlockRetries = 1000;
+
+absl::Status ShmError(absl::string_view context) {
+  return absl::Status(absl::ErrnoToStatusCode(errno),
+                      absl::StrCat(context, ": ", strerror(errno)));
+}
+
+// Holds the advisory lock of a control segment.
+class FileLock {
+ public:
+  explicit FileLock(int fd) : fd_(fd) {}
+  FileLock(const FileLock&) = delete;
+  FileLock& operator=(const FileLock&) = delete;
+  ~FileLock() {
+    if (locked_) {
+      flock(fd_, LOCK_UN);
+    }
+  }
+
+  absl::Status Lock(absl::string_view name) {
+    while (flock(fd_, LOCK_EX) != 0) {
+      if (errno != EINTR) {
+        return ShmError(name);
+      }
+    }
+    locked_ = true;
+    return absl::OkStatus();
+  }
+
+ private:
+  const int fd_;
+  bool locked_ = false;
+};
+
+}  // namespace
+
+// Layout of the control segment. A new segment is all zeros: nothing is
+// published. Only the holder of the advisory lock writes it.
+struct SharedMemoryCache::Control {
+  // Odd while an update is in progress.
+  std::atomic<uint64_t> sequence;
+  std::atomic<uint64_t> device;
+  std::atomic<uint64_t> inode;
+  std::atomic<uint64_t> size;
+  std::atomic<uint64_t> mtime_nsec;
+  // Of the segment holding the contents; 0 if there is none.
+  std::atomic<uint64_t> generation;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Control is shared between processes");
+
+absl::StatusOr<std::unique_ptr<SharedMemoryCache>> SharedMemoryCache::Open(
+    absl::string_view name) {
+  const std::string name_str(name);
+  const int fd = shm_open(name_str.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return ShmError(name);
+  }
+  // Extending an existing segment to its size is a no-op.
+  if (ftruncate(fd, sizeof(Control)) != 0) {
+    absl::Status status = ShmError(name);
+    close(fd);
+    return status;
+  }
+  void* data = mmap(nullptr, sizeof(Control), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    absl::Status status = ShmError(name);
+    close(fd);
+    return status;
+  }
+  return absl::WrapUnique(new SharedMemoryCache(
+      name_str, fd, static_cast<Control*>(data)));
+}
+
+absl::Status SharedMemoryCache::Remove(absl::string_view name) {
+  PDS_ASSIGN_OR_RETURN(std::unique_ptr<SharedMemoryCache> cache, Open(name));
+  FileLock lock(cache->fd_);
+  PDS_RETURN_IF_ERROR(lock.Lock(name));
+  const uint64_t generation = cache->control_->generation.load();
+  if (generation != 0) {
+    shm_unlink(cache->SegmentName(generation).c_str());
+  }
+  if (shm_unlink(cache->name_.c_str()) != 0) {
+    return ShmError(name);
+  }
+  return absl::OkStatus();
+}
+
+SharedMemoryCache::SharedMemoryCache(std::string name, int fd,
+                                     Control* control)
+    : name_(std::move(name)), fd_(fd), control_(control) {}
+
+SharedMemoryCache::~SharedMemoryCache() {
+  munmap(control_, sizeof(Control));
+  close(fd_);
+}
+
+absl::StatusOr<std::shared_ptr<const MappedFile>>
+SharedMemoryCache::LookupOrLoad(const FileId& id, const Loader& load) {
+  if (std::shared_ptr<const MappedFile> contents = Lookup(id)) {
+    return contents;
+  }
+  FileLock lock(fd_);
+  PDS_RETURN_IF_ERROR(lock.Lock(name_));
+  // Another process may have loaded it meanwhile.
+  if (std::shared_ptr<const MappedFile> contents = Lookup(id)) {
+    return contents;
+  }
+  PDS_ASSIGN_OR_RETURN(std::shared_ptr<const MappedFile> loaded, load());
+  if (loaded->data().size() != id.size) {
+    // The file was replaced after `id` was taken; do not pass it off as `id`.
+    return loaded;
+  }
+  return Publish(id, loaded->data());
+}
+
+std::shared_ptr<const MappedFile> SharedMemoryCache::Lookup(
+    const FileId& id) const {
+  FileId published;
+  uint64_t generation;
+  for (int retries = 0;; retries++) {
+    if (retries == kMaxSeqlockRetries) {
+      return nullptr;
+    }
+    const uint64_t sequence =
+        control_->sequence.load(std::memory_order_acquire);
+    if (sequence & 1) {
+      std::this_thread::yield();
+      continue;
+    }
+    published.device = control_->device.load(std::memory_order_relaxed);
+    published.inode = control_->inode.load(std::memory_order_relaxed);
+    published.size = control_->size.load(std::memory_order_relaxed);
+    published.mtime_nsec =
+        control_->mtime_nsec.load(std::memory_order_relaxed);
+    generation = control_->generation.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (control_->sequence.load(std::memory_order_relaxed) == sequence) {
+      break;
+    }
+  }
+  if (generation == 0 || published != id) {
+    return nullptr;
+  }
+
+  // The segment is gone if a newer generation superseded it meanwhile.
+  const std::string segment = SegmentName(generation);
+  const int fd = shm_open(segment.c_str(), O_RDONLY | O_CLOEXEC, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  void* data = mmap(nullptr, id.size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  return std::make_shared<const MappedFile>(segment, data, id.size);
+}
+
+absl::StatusOr<std::shared_ptr<const MappedFile>> SharedMemoryCache::Publish(
+    const FileId& id, absl::string_view contents) {
+  const uint64_t previous =
+      control_->generation.load(std::memory_order_relaxed);
+  const uint64_t generation = previous + 1;
+  const std::string segment = SegmentName(generation);
+  // Left behind if a process died while publishing it.
+  shm_unlink(segment.c_str());
+  const int fd = shm_open(segment.c_str(),
+                          O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return ShmError(segment);
+  }
+  void* data = MAP_FAILED;
+  if (ftruncate(fd, contents.size()) == 0) {
+    data = mmap(nullptr, contents.size(), PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, 0);
+  }
+  if (data == MAP_FAILED) {
+    absl::Status status = ShmError(segment);
+    close(fd);
+    shm_unlink(segment.c_str());
+    return status;
+  }
+  close(fd);
+  std::memcpy(data, contents.data(), contents.size());
+  auto published =
+      std::make_shared<const MappedFile>(segment, data, contents.size());
+
+  // Repairs the seqlock if a writer died amid an update.
+  const uint64_t sequence =
+      control_->sequence.load(std::memory_order_relaxed) | 1;
+  control_->sequence.store(sequence, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  control_->device.store(id.device, std::memory_order_relaxed);
+  control_->inode.store(id.inode, std::memory_order_relaxed);
+  control_->size.store(id.size, std::memory_order_relaxed);
+  control_->mtime_nsec.store(id.mtime_nsec, std::memory_order_relaxed);
+  control_->generation.store(generation, std::memory_order_relaxed);
+  control_->sequence.store(sequence + 1, std::memory_order_release);
+
+  if (previous != 0) {
+    shm_unlink(SegmentName(previous).c_str());
+  }
+  return published;
+}
+
+std::string SharedMemoryCache::SegmentName(uint64_t generation) const {
+  return absl::StrCat(name_, ".", generation);
+}
+
+}  // namespace protostore
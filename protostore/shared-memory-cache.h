@@ -0,0 +1,89 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_SHARED_MEMORY_CACHE_H_
+#define PROTOSTORE_SHARED_MEMORY_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "protostore/file-storage.h"
+#include "protostore/store-extensions.h"
+
+namespace protostore {
+
+/// \brief Shares the validated contents of one store file between the
+/// processes of a host through POSIX shared memory, so that only one of them
+/// reads and checksums each version of the file.
+///
+/// A small control segment, named `name`, records under a seqlock which
+/// version of the file (by FileId) is published, and in which generation.
+/// The contents of each generation live in an immutable segment of their
+/// own, named `name` followed by "." and the generation, that is unlinked
+/// once superseded; processes still mapping it keep it alive. Loads are
+/// serialized across processes by an advisory lock on the control segment.
+///
+/// All processes sharing a file must use the same name, and the same user.
+/// Not thread-safe; ProtoDataStore serializes its calls, so give each store
+/// a cache of its own, see ProtoDataStore::Options::contents_cache.
+class SharedMemoryCache final : public ContentsCache {
+ public:
+  /// Opens the control segment `name` (e.g. "/myapp-config"), creating it
+  /// if needed.
+  static absl::StatusOr<std::unique_ptr<SharedMemoryCache>> Open(
+      absl::string_view name);
+
+  /// Removes the segments of `name`. Processes that mapped them keep their
+  /// mappings; later loads start over.
+  static absl::Status Remove(absl::string_view name);
+
+  SharedMemoryCache(const SharedMemoryCache&) = delete;
+  SharedMemoryCache& operator=(const SharedMemoryCache&) = delete;
+  ~SharedMemoryCache() override;
+
+  /// Returns the contents published for version `id` of the file. If there
+  /// are none, calls `load`, unless another process publishes them first,
+  /// and publishes what it returns. The returned mapping is read-only in
+  /// effect and stays valid for its lifetime.
+  absl::StatusOr<std::shared_ptr<const MappedFile>> LookupOrLoad(
+      const FileId& id, const Loader& load) override;
+
+ private:
+  struct Control;
+
+  SharedMemoryCache(std::string name, int fd, Control* control);
+
+  // Returns the contents published for `id`, or null.
+  std::shared_ptr<const MappedFile> Lookup(const FileId& id) const;
+
+  // Copies `contents` into a new generation and publishes it for `id`.
+  // Requires the advisory lock.
+  absl::StatusOr<std::shared_ptr<const MappedFile>> Publish(
+      const FileId& id, absl::string_view contents);
+
+  std::string SegmentName(uint64_t generation) const;
+
+  const std::string name_;
+  const int fd_;
+  Control* const control_;
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_SHARED_MEMORY_CACHE_H_
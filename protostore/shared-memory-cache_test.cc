@@ -0,0 +1,122 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/shared-memory-cache.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protostore/testing-matchers.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Ne;
+using testing::IsOk;
+using testing::StatusIs;
+
+class SharedMemoryCacheTest : public ::testing::Test {
+ protected:
+  void TearDown() override { SharedMemoryCache::Remove(name_).IgnoreError(); }
+
+  // Returns a loader of `contents` counting its calls in `loads_`.
+  SharedMemoryCache::Loader LoaderOf(std::string contents) {
+    return [this, contents]()
+               -> absl::StatusOr<std::shared_ptr<const MappedFile>> {
+      loads_++;
+      void* data = mmap(nullptr, contents.size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      std::memcpy(data, contents.data(), contents.size());
+      return std::make_shared<const MappedFile>("loaded", data,
+                                                contents.size());
+    };
+  }
+
+  const std::string name_ = absl::StrCat("/protostore-test-", getpid());
+  int loads_ = 0;
+};
+
+FileId IdOf(uint64_t inode, uint64_t size) {
+  FileId id;
+  id.inode = inode;
+  id.size = size;
+  return id;
+}
+
+TEST_F(SharedMemoryCacheTest, LoadsEachVersionOnce) {
+  auto first = SharedMemoryCache::Open(name_);
+  auto second = SharedMemoryCache::Open(name_);
+  ASSERT_THAT(first, IsOk());
+  ASSERT_THAT(second, IsOk());
+
+  auto contents = (*first)->LookupOrLoad(IdOf(1, 5), LoaderOf("hello"));
+  ASSERT_THAT(contents, IsOk());
+  EXPECT_THAT((*contents)->data(), Eq("hello"));
+  contents = (*second)->LookupOrLoad(IdOf(1, 5), LoaderOf("wrong"));
+  ASSERT_THAT(contents, IsOk());
+  EXPECT_THAT((*contents)->data(), Eq("hello"));
+  EXPECT_THAT(loads_, Eq(1));
+
+  // A new version replaces the old one, whose mappings stay valid.
+  auto updated = (*second)->LookupOrLoad(IdOf(2, 7), LoaderOf("updated"));
+  ASSERT_THAT(updated, IsOk());
+  EXPECT_THAT((*updated)->data(), Eq("updated"));
+  EXPECT_THAT((*contents)->data(), Eq("hello"));
+  EXPECT_THAT((*first)->LookupOrLoad(IdOf(2, 7), LoaderOf("wrong")), IsOk());
+  EXPECT_THAT(loads_, Eq(2));
+}
+
+TEST_F(SharedMemoryCacheTest, FailedLoadsAreNotPublished) {
+  auto cache = SharedMemoryCache::Open(name_);
+  ASSERT_THAT(cache, IsOk());
+  auto fail = []() -> absl::StatusOr<std::shared_ptr<const MappedFile>> {
+    return absl::InternalError("corrupted");
+  };
+  EXPECT_THAT((*cache)->LookupOrLoad(IdOf(1, 5), fail),
+              StatusIs(absl::StatusCode::kInternal));
+  EXPECT_THAT((*cache)->LookupOrLoad(IdOf(1, 5), LoaderOf("hello")), IsOk());
+  EXPECT_THAT(loads_, Eq(1));
+}
+
+TEST_F(SharedMemoryCacheTest, SharesWithOtherProcesses) {
+  auto cache = SharedMemoryCache::Open(name_);
+  ASSERT_THAT(cache, IsOk());
+  ASSERT_THAT((*cache)->LookupOrLoad(IdOf(1, 5), LoaderOf("hello")), IsOk());
+
+  const pid_t pid = fork();
+  ASSERT_THAT(pid, Ne(-1));
+  if (pid == 0) {
+    auto child = SharedMemoryCache::Open(name_);
+    if (!child.ok()) _exit(1);
+    auto contents = (*child)->LookupOrLoad(IdOf(1, 5), LoaderOf("wrong"));
+    _exit(contents.ok() && (*contents)->data() == "hello" ? 0 : 2);
+  }
+  int status;
+  ASSERT_THAT(waitpid(pid, &status, 0), Eq(pid));
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_THAT(WEXITSTATUS(status), Eq(0));
+}
+
+}  // namespace
+}  // namespace protostore
@@ -0,0 +1,130 @@
+# Copyright (C) 2021 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compiles a default proto into the binary for ProtoDataStore.
+
+proto_snapshot() turns a text-format proto into a cc_library exposing the
+contents of a store file, checksummed at build time, for
+ProtoDataStore::Options::default_snapshot:
+
+    proto_snapshot(
+        name = "default_config",
+        src = "default_config.textproto",
+        proto = ":config_proto",
+        message = "myapp.Config",
+        function = "myapp::DefaultConfig",
+    )
+
+The cc_library has the header "<package>/default_config.h" declaring
+`absl::string_view myapp::DefaultConfig()`.
+"""
+
+def _import_path(src, proto_info):
+    """Returns the path by which protoc knows the .proto file `src`."""
+    root = proto_info.proto_source_root
+    if root and root != "." and src.path.startswith(root + "/"):
+        return src.path[len(root) + 1:]
+    return src.short_path
+
+def _proto_snapshot_encode_impl(ctx):
+    proto_info = ctx.attr.proto[ProtoInfo]
+    descriptor_sets = proto_info.transitive_descriptor_sets.to_list()
+    ctx.actions.run_shell(
+        inputs = [ctx.file.src] + descriptor_sets,
+        outputs = [ctx.outputs.out],
+        tools = [ctx.executable._protoc],
+        command = "%s --descriptor_set_in=%s --encode=%s %s < %s > %s" % (
+            ctx.executable._protoc.path,
+            ctx.configuration.host_path_separator.join(
+                [f.path for f in descriptor_sets],
+            ),
+            ctx.attr.message,
+            " ".join([
+                _import_path(f, proto_info)
+                for f in proto_info.direct_sources
+            ]),
+            ctx.file.src.path,
+            ctx.outputs.out.path,
+        ),
+        mnemonic = "ProtoSnapshotEncode",
+        progress_message = "Encoding proto snapshot %s" % ctx.label,
+    )
+
+_proto_snapshot_encode = rule(
+    implementation = _proto_snapshot_encode_impl,
+    attrs = {
+        "src": attr.label(allow_single_file = True, mandatory = True),
+        "proto": attr.label(providers = [ProtoInfo], mandatory = True),
+        "message": attr.string(mandatory = True),
+        "out": attr.output(mandatory = True),
+        "_protoc": attr.label(
+            default = Label("@com_google_protobuf//:protoc"),
+            executable = True,
+            cfg = "exec",
+        ),
+    },
+)
+
+def proto_snapshot(
+        name,
+        src,
+        proto,
+        message,
+        function,
+        checksum = "crc32",
+        **kwargs):
+    """Compiles the text-format proto `src` into a cc_library `name`.
+
+    Args:
+      name: Name of the cc_library, and of its header without ".h".
+      src: Text-format proto of type `message`.
+      proto: proto_library defining `message`.
+      message: Fully qualified name of the message type.
+      function: Qualified name of the generated C++ function returning the
+        contents of the store file.
+      checksum: Checksum policy of the store, "crc32" or "crc32c".
+      **kwargs: Common attributes, e.g. visibility, of the targets.
+    """
+    _proto_snapshot_encode(
+        name = name + "_encoded",
+        src = src,
+        proto = proto,
+        message = message,
+        out = name + ".binpb",
+        **kwargs
+    )
+    tool = str(Label("//protostore:embed-snapshot"))
+    native.genrule(
+        name = name + "_embed",
+        srcs = [name + ".binpb"],
+        outs = [name + ".h", name + ".cc"],
+        cmd = ("$(location %s) --function=%s --checksum=%s --include=%s " +
+               "$(SRCS) $(RULEDIR)/%s.h $(RULEDIR)/%s.cc") % (
+            tool,
+            function,
+            checksum,
+            native.package_name() + "/" + name + ".h",
+            name,
+            name,
+        ),
+        tools = [tool],
+        **kwargs
+    )
+    native.cc_library(
+        name = name,
+        srcs = [name + ".cc"],
+        hdrs = [name + ".h"],
+        deps = ["@com_google_absl//absl/strings"],
+        **kwargs
+    )
@@ -0,0 +1,67 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protostore/file-storage.h"
+#include "protostore/proto-data-store.h"
+#include "protostore/store-format.h"
+#include "protostore/test-snapshot.h"
+#include "protostore/testing-matchers.h"
+#include "protostore/testfile-fixture.h"
+#include "protostore/test.pb.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+using ::testing::Pointee;
+using testing::EqualsProto;
+using testing::IsOkAndHolds;
+
+class SnapshotTest : public testing::TestFileFixture {};
+
+// Matches test-snapshot.textproto.
+TestProto ExpectedSnapshot() {
+  TestProto proto;
+  proto.set_string_value("default");
+  proto.set_int_value(7);
+  TestProto::Entry* entry = proto.add_entries();
+  entry->set_key("a");
+  entry->set_value(1);
+  entry = proto.add_entries();
+  entry->set_key("b");
+  entry->set_value(2);
+  return proto;
+}
+
+TEST_F(SnapshotTest, EmbedsStoreFile) {
+  EXPECT_THAT(ValidateStoreContents("TestSnapshot", TestSnapshot()),
+              IsOkAndHolds(Eq(ExpectedSnapshot().SerializeAsString())));
+}
+
+TEST_F(SnapshotTest, ServesEmbeddedSnapshot) {
+  FileStorage storage;
+  ProtoDataStore<TestProto>::Options options;
+  options.default_snapshot = TestSnapshot();
+  ProtoDataStore<TestProto> pds(storage, TestFile("ServesEmbeddedSnapshot"),
+                                options);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(
+                              ExpectedSnapshot()))));
+}
+
+}  // namespace
+}  // namespace protostore
@@ -0,0 +1,89 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROTOSTORE_STORE_EXTENSIONS_H_
+#define PROTOSTORE_STORE_EXTENSIONS_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "google/protobuf/message_lite.h"
+#include "protostore/file-storage.h"
+
+// Interfaces through which ProtoDataStore uses its optional features, so
+// that the store itself does not link them in. The implementations live in
+// targets of their own.
+
+namespace protostore {
+
+/// \brief Default top-level field number under which ProtoDataStore stores
+/// columns: the largest valid one, which the proto must not use.
+constexpr int kDefaultColumnsFieldNumber = 536870911;
+
+/// \brief Encodes columns of a serialized proto, stored ahead of it, for
+/// ProtoDataStore::Options::column_encoder; see ColumnarFieldEncoder.
+class ColumnEncoder {
+ public:
+  virtual ~ColumnEncoder() = default;
+
+  /// \brief Appends to `*out` the columns of the serialized proto `data`,
+  /// to be stored as the payload of a length-delimited field.
+  ///
+  /// Returns false if the data is malformed.
+  virtual bool Encode(absl::string_view data, std::string* out) const = 0;
+};
+
+/// \brief Caches the validated contents of a store file by version, for
+/// ProtoDataStore::Options::contents_cache; see SharedMemoryCache.
+class ContentsCache {
+ public:
+  /// Reads the contents of the file, returning them validated.
+  using Loader =
+      std::function<absl::StatusOr<std::shared_ptr<const MappedFile>>()>;
+
+  virtual ~ContentsCache() = default;
+
+  /// Returns the contents cached for version `id` of the file. If there are
+  /// none, calls `load` and caches what it returns. The returned mapping
+  /// stays valid for its lifetime.
+  virtual absl::StatusOr<std::shared_ptr<const MappedFile>> LookupOrLoad(
+      const FileId& id, const Loader& load) = 0;
+};
+
+/// \brief Serializes protos straight into an OutputStream, for
+/// ProtoDataStore::Options::stream_serializer; see PipelinedSerializer.
+///
+/// Must be safe for concurrent use by multiple threads.
+template <typename ChecksumT>
+class StreamSerializer {
+ public:
+  virtual ~StreamSerializer() = default;
+
+  /// \brief Appends `proto` serialized to `output` and sets `*checksum` to
+  /// the checksum of the bytes appended. The sizes cached in `proto` are
+  /// current.
+  ///
+  /// Returns the first error of `output`.
+  virtual absl::Status Serialize(const google::protobuf::MessageLite& proto,
+                                 OutputStream* output,
+                                 ChecksumT* checksum) const = 0;
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_STORE_EXTENSIONS_H_
@@ -0,0 +1,80 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protostore/store-format.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include "absl/strings/str_cat.h"
+#include "protostore/status-macros.h"
+
+namespace protostore {
+
+constexpr int32_t StoreHeader::kMagic;
+constexpr int32_t StoreHeader::kCrc32cMagic;
+constexpr int32_t StoreHeader::kNoChecksumMagic;
+
+absl::StatusOr<absl::string_view> ParseStoreHeader(absl::string_view filename,
+                                                   absl::string_view contents,
+                                                   StoreHeader* header) {
+  if (contents.size() < sizeof(StoreHeader)) {
+    return absl::InternalError(
+        absl::StrCat("File too small for header: ", filename));
+  }
+  memcpy(header, contents.data(), sizeof(StoreHeader));
+  if (header->magic != StoreHeader::kMagic &&
+      header->magic != StoreHeader::kCrc32cMagic &&
+      header->magic != StoreHeader::kNoChecksumMagic) {
+    return absl::InternalError(
+        absl::StrCat("Invalid header kMagic for: ", filename));
+  }
+  return contents.substr(sizeof(StoreHeader));
+}
+
+absl::string_view StoreChecksumName(int32_t magic) {
+  switch (magic) {
+    case StoreHeader::kMagic:
+      return "crc32";
+    case StoreHeader::kCrc32cMagic:
+      return "crc32c";
+    case StoreHeader::kNoChecksumMagic:
+      return "none";
+    default:
+      return "unknown";
+  }
+}
+
+absl::StatusOr<absl::string_view> ValidateStoreContents(
+    absl::string_view filename, absl::string_view contents) {
+  StoreHeader header;
+  PDS_RETURN_IF_ERROR(ParseStoreHeader(filename, contents, &header).status());
+  switch (header.magic) {
+    case StoreHeader::kCrc32cMagic:
+      return ValidateStoreContents<Crc32c>(filename, contents);
+    case StoreHeader::kNoChecksumMagic:
+      return ValidateStoreContents<NoChecksum>(filename, contents);
+    default:
+      return ValidateStoreContents<Crc32>(filename, contents);
+  }
+}
+
+absl::Status VerifyStoreFile(const FileStorage& file_storage,
+                             const std::string& filename) {
+  PDS_ASSIGN_OR_RETURN(std::unique_ptr<MappedFile> mapped_file,
+                       file_storage.MapForRead(filename));
+  return ValidateStoreContents(filename, mapped_file->data()).status();
+}
+
+}  // namespace protostore
@@ -0,0 +1,190 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROTOSTORE_STORE_FORMAT_H_
+#define PROTOSTORE_STORE_FORMAT_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "protostore/crc32.h"
+#include "protostore/crc32c.h"
+#include "protostore/file-storage.h"
+#include "protostore/store-policies.h"
+
+namespace protostore {
+
+// Header stored at the beginning of a ProtoDataStore file before the proto.
+struct StoreHeader {
+  // The magic tells the checksum policy the file was written with.
+  static constexpr int32_t kMagic = 0x726f746f;            // Crc32.
+  static constexpr int32_t kCrc32cMagic = 0x726f7463;      // Crc32c.
+  static constexpr int32_t kNoChecksumMagic = 0x726f746e;  // NoChecksum.
+
+  // Holds the magic as a quick sanity check against file corruption.
+  int32_t magic;
+
+  // Checksum of the serialized proto, for a more thorough check against file
+  // corruption.
+  uint32_t proto_checksum;
+};
+
+// The header magic of files written with the checksum policy `ChecksumT`.
+// Other checksum policies need a specialization with a magic of their own.
+template <typename ChecksumT>
+struct StoreMagic;
+
+template <>
+struct StoreMagic<Crc32> {
+  static constexpr int32_t kValue = StoreHeader::kMagic;
+};
+
+template <>
+struct StoreMagic<Crc32c> {
+  static constexpr int32_t kValue = StoreHeader::kCrc32cMagic;
+};
+
+template <>
+struct StoreMagic<NoChecksum> {
+  static constexpr int32_t kValue = StoreHeader::kNoChecksumMagic;
+};
+
+// Returns the header of a file written with `ChecksumT`, whose proto has
+// the checksum `crc`.
+template <typename ChecksumT>
+StoreHeader MakeStoreHeader(const ChecksumT& crc) {
+  return StoreHeader{.magic = StoreMagic<ChecksumT>::kValue,
+                     .proto_checksum = crc.Get()};
+}
+
+// Whether `crc`, computed over the proto of a file, matches the checksum
+// `stored` in its header. Always true for NoChecksum, which may also read
+// files written with another policy.
+template <typename ChecksumT>
+bool StoreChecksumMatches(uint32_t stored, const ChecksumT& crc) {
+  return std::is_same<ChecksumT, NoChecksum>::value || stored == crc.Get();
+}
+
+// Checks the header of the full `contents` of a store file, but not its
+// checksum, and copies it to `*header`. Files of any known checksum policy
+// are accepted.
+//
+// Returns the serialized proto following the header.
+// Returns INTERNAL_ERROR if the header is corrupted.
+absl::StatusOr<absl::string_view> ParseStoreHeader(absl::string_view filename,
+                                                   absl::string_view contents,
+                                                   StoreHeader* header);
+
+// Returns the name of the checksum policy of files with header `magic`.
+absl::string_view StoreChecksumName(int32_t magic);
+
+// Checks that the file `filename` with `header` can be read with the
+// checksum policy `ChecksumT`: it was written with it, or `ChecksumT` is
+// NoChecksum.
+//
+// Returns FAILED_PRECONDITION otherwise.
+template <typename ChecksumT>
+absl::Status CheckStoreChecksumPolicy(absl::string_view filename,
+                                      const StoreHeader& header) {
+  if (std::is_same<ChecksumT, NoChecksum>::value ||
+      header.magic == StoreMagic<ChecksumT>::kValue) {
+    return absl::OkStatus();
+  }
+  return absl::FailedPreconditionError(absl::StrCat(
+      "File written with checksum policy ", StoreChecksumName(header.magic),
+      ", read with ", StoreChecksumName(StoreMagic<ChecksumT>::kValue), ": ",
+      filename));
+}
+
+// Like ParseStoreHeader(), and checks the checksum policy of the file with
+// CheckStoreChecksumPolicy().
+template <typename ChecksumT>
+absl::StatusOr<absl::string_view> ParseStoreHeader(absl::string_view filename,
+                                                   absl::string_view contents,
+                                                   StoreHeader* header) {
+  absl::StatusOr<absl::string_view> parsed =
+      ParseStoreHeader(filename, contents, header);
+  if (!parsed.ok()) {
+    return parsed.status();
+  }
+  absl::Status status = CheckStoreChecksumPolicy<ChecksumT>(filename, *header);
+  if (!status.ok()) {
+    return status;
+  }
+  return parsed;
+}
+
+// Checks the header and checksum of the full `contents` of a store file,
+// without parsing the proto. `ChecksumT` is the checksum policy of the
+// store reading the file.
+//
+// Returns the serialized proto following the header.
+// Returns INTERNAL_ERROR if a corruption was encountered.
+// Returns FAILED_PRECONDITION if the file was written with another checksum
+// policy, see CheckStoreChecksumPolicy().
+template <typename ChecksumT>
+absl::StatusOr<absl::string_view> ValidateStoreContents(
+    absl::string_view filename, absl::string_view contents) {
+  StoreHeader header;
+  absl::StatusOr<absl::string_view> parsed =
+      ParseStoreHeader<ChecksumT>(filename, contents, &header);
+  if (!parsed.ok()) {
+    return parsed.status();
+  }
+
+  absl::string_view proto_str = *parsed;
+  ChecksumT crc;
+  crc.Append(proto_str);
+  if (!StoreChecksumMatches(header.proto_checksum, crc)) {
+    return absl::InternalError(
+        absl::StrCat("Checksum of file does not match: ", filename));
+  }
+  return proto_str;
+}
+
+// Like ValidateStoreContents(), with the checksum policy the header of the
+// file names, e.g. for tools checking stores of any policy.
+absl::StatusOr<absl::string_view> ValidateStoreContents(
+    absl::string_view filename, absl::string_view contents);
+
+// Returns the full contents of a store file holding the serialized
+// `proto_str`, checksummed with `ChecksumT`.
+template <typename ChecksumT = Crc32>
+std::string EncodeStoreContents(absl::string_view proto_str) {
+  ChecksumT crc;
+  crc.Append(proto_str);
+  const StoreHeader header = MakeStoreHeader(crc);
+  std::string contents(sizeof(header), '\0');
+  memcpy(&contents[0], &header, sizeof(header));
+  contents.append(proto_str.data(), proto_str.size());
+  return contents;
+}
+
+// Maps `filename` and validates it with ValidateStoreContents(), whatever
+// its checksum policy.
+//
+// Returns NOT_FOUND if the file does not exist.
+// Returns INTERNAL_ERROR if an IO error or a corruption was encountered.
+absl::Status VerifyStoreFile(const FileStorage& file_storage,
+                             const std::string& filename);
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_STORE_FORMAT_H_
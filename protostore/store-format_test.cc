@@ -0,0 +1,107 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protostore/store-format.h"
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protostore/crc32.h"
+#include "protostore/crc32c.h"
+#include "protostore/file-storage.h"
+#include "protostore/proto-data-store.h"
+#include "protostore/store-policies.h"
+#include "protostore/testing-matchers.h"
+#include "protostore/testfile-fixture.h"
+#include "protostore/test.pb.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+using testing::IsOk;
+using testing::IsOkAndHolds;
+using testing::StatusIs;
+
+class StoreFormatTest : public testing::TestFileFixture {};
+
+TEST_F(StoreFormatTest, VerifiesFilesWrittenByProtoDataStore) {
+  FileStorage storage;
+  std::string testfile = TestFile("VerifiesFilesWrittenByProtoDataStore");
+  TestProto testproto;
+  testproto.set_string_value("VerifiesFilesWrittenByProtoDataStore");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+
+  EXPECT_OK(VerifyStoreFile(storage, testfile));
+
+  auto mapped = storage.MapForRead(testfile);
+  ASSERT_THAT(mapped, IsOk());
+  EXPECT_THAT(ValidateStoreContents(testfile, (*mapped)->data()),
+              IsOkAndHolds(Eq(testproto.SerializeAsString())));
+}
+
+TEST_F(StoreFormatTest, DetectsCorruption) {
+  FileStorage storage;
+  std::string testfile = TestFile("DetectsCorruption");
+  TestProto testproto;
+  testproto.set_string_value("DetectsCorruption");
+  ProtoDataStore<TestProto> pds(storage, testfile);
+  ASSERT_OK(pds.Write(absl::make_unique<TestProto>(testproto)));
+  {
+    auto out = storage.OpenForAppend(testfile);
+    ASSERT_THAT(out, IsOk());
+    ASSERT_OK((*out)->Append("junk"));
+  }
+
+  EXPECT_THAT(VerifyStoreFile(storage, testfile),
+              StatusIs(absl::StatusCode::kInternal));
+  EXPECT_THAT(VerifyStoreFile(storage, TestFile("missing")),
+              StatusIs(absl::StatusCode::kNotFound));
+  EXPECT_THAT(ValidateStoreContents("short", "abc"),
+              StatusIs(absl::StatusCode::kInternal));
+  EXPECT_THAT(ValidateStoreContents("magic", std::string(16, 'x')),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST_F(StoreFormatTest, HeaderNamesChecksumPolicy) {
+  const std::string proto_str = "\x0a\x05hello";
+  const std::string crc32 = EncodeStoreContents<Crc32>(proto_str);
+  const std::string crc32c = EncodeStoreContents<Crc32c>(proto_str);
+  const std::string unchecked = EncodeStoreContents<NoChecksum>(proto_str);
+
+  // Files of any policy validate without naming it.
+  EXPECT_THAT(ValidateStoreContents("crc32", crc32),
+              IsOkAndHolds(Eq(proto_str)));
+  EXPECT_THAT(ValidateStoreContents("crc32c", crc32c),
+              IsOkAndHolds(Eq(proto_str)));
+  EXPECT_THAT(ValidateStoreContents("unchecked", unchecked),
+              IsOkAndHolds(Eq(proto_str)));
+  std::string corrupted = crc32c;
+  corrupted.back() ^= 1;
+  EXPECT_THAT(ValidateStoreContents("corrupted", corrupted),
+              StatusIs(absl::StatusCode::kInternal));
+
+  // A policy other than the file's is rejected, except NoChecksum.
+  EXPECT_THAT(ValidateStoreContents<Crc32>("crc32c", crc32c),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+  EXPECT_THAT(ValidateStoreContents<Crc32c>("unchecked", unchecked),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+  EXPECT_THAT(ValidateStoreContents<NoChecksum>("crc32", crc32),
+              IsOkAndHolds(Eq(proto_str)));
+}
+
+}  // namespace
+}  // namespace protostore
@@ -0,0 +1,123 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_STORE_POLICIES_H_
+#define PROTOSTORE_STORE_POLICIES_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+
+// Policies for the template parameters of ProtoDataStore, chosen at compile
+// time so that unused features cost nothing and no call is virtual.
+//
+// A lock policy has Lock(), Unlock(), ReaderLock() and ReaderUnlock(). The
+// reader lock guards the fast path of Read() that returns the cached proto.
+//
+// A checksum policy is a default-constructible value type with Append(),
+// Get() and Concat(), like Crc32, and a StoreMagic specialization (see
+// store-format.h) that names it in the header of the files it writes. Files
+// must be read with the checksum policy they were written with, or with
+// NoChecksum.
+//
+// A storage policy is a class with the methods of FileStorage used by the
+// store, returning the same stream and mapping types, e.g. one decorating a
+// FileStorage.
+
+namespace protostore {
+
+/// \brief Lock policy for stores only ever used by one thread at a time.
+class ABSL_LOCKABLE NoLockPolicy {
+ public:
+  void Lock() ABSL_EXCLUSIVE_LOCK_FUNCTION() {}
+  void Unlock() ABSL_UNLOCK_FUNCTION() {}
+  void ReaderLock() ABSL_SHARED_LOCK_FUNCTION() {}
+  void ReaderUnlock() ABSL_UNLOCK_FUNCTION() {}
+};
+
+/// \brief Lock policy serializing all calls, including cached reads.
+class ABSL_LOCKABLE MutexLockPolicy {
+ public:
+  void Lock() ABSL_EXCLUSIVE_LOCK_FUNCTION() { mutex_.Lock(); }
+  void Unlock() ABSL_UNLOCK_FUNCTION() { mutex_.Unlock(); }
+  void ReaderLock() ABSL_SHARED_LOCK_FUNCTION() { mutex_.Lock(); }
+  void ReaderUnlock() ABSL_UNLOCK_FUNCTION() { mutex_.Unlock(); }
+
+ private:
+  absl::Mutex mutex_;
+};
+
+/// \brief Lock policy letting cached reads run concurrently, at the cost of
+/// a slightly more expensive lock.
+class ABSL_LOCKABLE SharedLockPolicy {
+ public:
+  void Lock() ABSL_EXCLUSIVE_LOCK_FUNCTION() { mutex_.Lock(); }
+  void Unlock() ABSL_UNLOCK_FUNCTION() { mutex_.Unlock(); }
+  void ReaderLock() ABSL_SHARED_LOCK_FUNCTION() { mutex_.ReaderLock(); }
+  void ReaderUnlock() ABSL_UNLOCK_FUNCTION() { mutex_.ReaderUnlock(); }
+
+ private:
+  absl::Mutex mutex_;
+};
+
+/// \brief Checksum policy skipping the checksum; the header holds 0.
+class NoChecksum {
+ public:
+  uint32_t Get() const { return 0; }
+  uint32_t Append(absl::string_view) { return 0; }
+  uint32_t Concat(const NoChecksum&, size_t) { return 0; }
+};
+
+namespace internal {
+
+// Holds the exclusive lock of a lock policy for its lifetime.
+template <typename LockT>
+class ABSL_SCOPED_LOCKABLE WriterLock {
+ public:
+  explicit WriterLock(LockT* lock) ABSL_EXCLUSIVE_LOCK_FUNCTION(lock)
+      : lock_(lock) {
+    lock_->Lock();
+  }
+  WriterLock(const WriterLock&) = delete;
+  WriterLock& operator=(const WriterLock&) = delete;
+  ~WriterLock() ABSL_UNLOCK_FUNCTION() { lock_->Unlock(); }
+
+ private:
+  LockT* const lock_;
+};
+
+// Holds the reader lock of a lock policy for its lifetime.
+template <typename LockT>
+class ABSL_SCOPED_LOCKABLE ReaderLock {
+ public:
+  explicit ReaderLock(LockT* lock) ABSL_SHARED_LOCK_FUNCTION(lock)
+      : lock_(lock) {
+    lock_->ReaderLock();
+  }
+  ReaderLock(const ReaderLock&) = delete;
+  ReaderLock& operator=(const ReaderLock&) = delete;
+  ~ReaderLock() ABSL_UNLOCK_FUNCTION() { lock_->ReaderUnlock(); }
+
+ private:
+  LockT* const lock_;
+};
+
+}  // namespace internal
+}  // namespace protostore
+
+#endif  // PROTOSTORE_STORE_POLICIES_H_
@@ -0,0 +1,443 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Generates load on ProtoDataStore the way servers do: reader threads call
+// Read() while a few writer threads call Write() with payloads of varying
+// size, on several stores on a real file system, for a fixed duration.
+// Meant to judge changes to locking and IO by their tail latency.
+//
+// Usage: stress-test [--dir=PATH] [--stores=N] [--readers=N] [--writers=N]
+//                    [--write_interval=D] [--payload_sizes=BYTES:WEIGHT,...]
+//                    [--duration=D] [--deadline=D] [--shared_lock]
+//                    [--disk_latency=D] [--disk_stall=D]
+//                    [--disk_stall_probability=P]
+//
+// Prints, for reads and writes, the number of calls, their throughput, the
+// 50th, 99th and 99.9th percentiles and the maximum of their latency, the
+// mean number of heap allocations made by the calling thread, and the
+// number of failed calls, of which those that exceeded the deadline.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/memory/memory.h"
+#include "absl/random/discrete_distribution.h"
+#include "absl/random/distributions.h"
+#include "absl/random/random.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "protostore/allocation-counter.h"
+#include "protostore/crc32.h"
+#include "protostore/file-storage.h"
+#include "protostore/proto-data-store.h"
+#include "protostore/store-policies.h"
+#include "protostore/test.pb.h"
+
+ABSL_FLAG(std::string, dir, "",
+          "Directory for the store files. If empty, a temporary directory "
+          "is created and removed afterwards.");
+ABSL_FLAG(int, stores, 4, "Number of stores, each picked at random per call.");
+ABSL_FLAG(int, readers, 8, "Number of threads calling Read().");
+ABSL_FLAG(int, writers, 1, "Number of threads calling Write().");
+ABSL_FLAG(absl::Duration, write_interval, absl::ZeroDuration(),
+          "Pause of each writer between two writes.");
+ABSL_FLAG(std::string, payload_sizes, "4096:90,262144:9,4194304:1",
+          "Sizes in bytes of the written payloads, each with its relative "
+          "weight.");
+ABSL_FLAG(absl::Duration, duration, absl::Seconds(10), "Length of the run.");
+ABSL_FLAG(absl::Duration, deadline, absl::ZeroDuration(),
+          "If non-zero, calls the overloads of Read() and Write() taking a "
+          "deadline this far in the future.");
+ABSL_FLAG(bool, shared_lock, false,
+          "Uses SharedLockPolicy rather than MutexLockPolicy.");
+ABSL_FLAG(absl::Duration, disk_latency, absl::ZeroDuration(),
+          "Slow-disk emulation: latency added to every file operation.");
+ABSL_FLAG(absl::Duration, disk_stall, absl::ZeroDuration(),
+          "Slow-disk emulation: further latency added to the file operations "
+          "that stall.");
+ABSL_FLAG(double, disk_stall_probability, 0.01,
+          "Slow-disk emulation: probability of a file operation stalling.");
+
+namespace protostore {
+namespace {
+
+// Forwards to FileStorage, delaying every call that goes to the disk.
+class SlowFileStorage {
+ public:
+  SlowFileStorage(absl::Duration latency, absl::Duration stall,
+                  double stall_probability)
+      : latency_(latency),
+        stall_(stall),
+        stall_probability_(stall_probability) {}
+
+  absl::StatusOr<uint64_t> GetFileSize(const std::string& filename) const {
+    Delay();
+    return storage_.GetFileSize(filename);
+  }
+  absl::StatusOr<FileId> GetFileId(const std::string& filename) const {
+    Delay();
+    return storage_.GetFileId(filename);
+  }
+  absl::StatusOr<std::unique_ptr<InputStream>> OpenForRead(
+      const std::string& filename) const {
+    Delay();
+    return storage_.OpenForRead(filename);
+  }
+  absl::StatusOr<std::unique_ptr<OutputStream>> OpenForWrite(
+      const std::string& filename) const {
+    Delay();
+    return storage_.OpenForWrite(filename);
+  }
+  absl::StatusOr<std::unique_ptr<MappedFile>> MapForRead(
+      const std::string& filename) const {
+    Delay();
+    return storage_.MapForRead(filename);
+  }
+  absl::StatusOr<std::unique_ptr<CreationWatch>> WatchForCreation(
+      const std::string& filename) const {
+    return storage_.WatchForCreation(filename);
+  }
+  absl::Status Rename(const std::string& from, const std::string& to) const {
+    Delay();
+    return storage_.Rename(from, to);
+  }
+  absl::Status Delete(const std::string& filename) const {
+    return storage_.Delete(filename);
+  }
+
+ private:
+  void Delay() const {
+    thread_local absl::BitGen gen;
+    absl::Duration delay = latency_;
+    if (stall_ > absl::ZeroDuration() &&
+        absl::Bernoulli(gen, stall_probability_)) {
+      delay += stall_;
+    }
+    if (delay > absl::ZeroDuration()) {
+      absl::SleepFor(delay);
+    }
+  }
+
+  const FileStorage storage_;
+  const absl::Duration latency_;
+  const absl::Duration stall_;
+  const double stall_probability_;
+};
+
+// Counts latencies in buckets spaced 1/16 of a power of two apart, so that
+// percentiles are accurate to about 6% at any scale.
+class LatencyHistogram {
+ public:
+  void Record(absl::Duration latency) {
+    const uint64_t nanos = std::max<int64_t>(0, latency / absl::Nanoseconds(1));
+    buckets_[Bucket(nanos)]++;
+    count_++;
+    max_ = std::max(max_, nanos);
+  }
+
+  void Merge(const LatencyHistogram& other) {
+    for (int i = 0; i < kBuckets; i++) {
+      buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  // Returns the smallest latency that `quantile` of the calls did not
+  // exceed, rounded up to its bucket.
+  absl::Duration Percentile(double quantile) const {
+    const uint64_t rank = std::max<uint64_t>(1, quantile * count_);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += buckets_[i];
+      if (seen >= rank) {
+        return absl::Nanoseconds(std::min(UpperBound(i), max_));
+      }
+    }
+    return absl::Nanoseconds(max_);
+  }
+
+  uint64_t count() const { return count_; }
+  absl::Duration max() const { return absl::Nanoseconds(max_); }
+
+ private:
+  static constexpr int kSubBits = 4;
+  static constexpr int kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+  static int Bucket(uint64_t nanos) {
+    if (nanos < (uint64_t{1} << kSubBits)) {
+      return nanos;
+    }
+    const int exponent = 63 - __builtin_clzll(nanos);
+    const int shift = exponent - kSubBits;
+    return ((shift + 1) << kSubBits) +
+           ((nanos >> shift) & ((1 << kSubBits) - 1));
+  }
+
+  static uint64_t UpperBound(int bucket) {
+    if (bucket < (1 << kSubBits)) {
+      return bucket;
+    }
+    const int shift = (bucket >> kSubBits) - 1;
+    const uint64_t sub = bucket & ((1 << kSubBits) - 1);
+    return (((uint64_t{1} << kSubBits) + sub + 1) << shift) - 1;
+  }
+
+  uint64_t buckets_[kBuckets] = {};
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+};
+
+// What each thread observed of one operation.
+struct OpStats {
+  LatencyHistogram latencies;
+  uint64_t allocations = 0;
+  uint64_t errors = 0;
+  uint64_t deadline_exceeded = 0;
+  absl::Status first_error;
+
+  void Record(absl::Duration latency, uint64_t call_allocations,
+              const absl::Status& status) {
+    latencies.Record(latency);
+    allocations += call_allocations;
+    if (!status.ok()) {
+      if (errors++ == 0) {
+        first_error = status;
+      }
+      if (absl::IsDeadlineExceeded(status)) {
+        deadline_exceeded++;
+      }
+    }
+  }
+
+  void Merge(const OpStats& other) {
+    latencies.Merge(other.latencies);
+    allocations += other.allocations;
+    if (errors == 0) {
+      first_error = other.first_error;
+    }
+    errors += other.errors;
+    deadline_exceeded += other.deadline_exceeded;
+  }
+};
+
+void PrintHeader() {
+  printf("%-6s %10s %10s %10s %10s %10s %10s %9s %8s %8s\n", "op", "calls",
+         "calls/s", "p50", "p99", "p999", "max", "allocs/op", "errors",
+         "deadline");
+}
+
+void PrintStats(const char* op, const OpStats& stats, absl::Duration elapsed) {
+  const auto format = [](absl::Duration d) {
+    return absl::FormatDuration(d);
+  };
+  const LatencyHistogram& latencies = stats.latencies;
+  printf("%-6s %10llu %10.0f %10s %10s %10s %10s %9.1f %8llu %8llu\n", op,
+         static_cast<unsigned long long>(latencies.count()),
+         latencies.count() / absl::ToDoubleSeconds(elapsed),
+         format(latencies.Percentile(0.5)).c_str(),
+         format(latencies.Percentile(0.99)).c_str(),
+         format(latencies.Percentile(0.999)).c_str(),
+         format(latencies.max()).c_str(),
+         latencies.count() == 0
+             ? 0.0
+             : static_cast<double>(stats.allocations) / latencies.count(),
+         static_cast<unsigned long long>(stats.errors),
+         static_cast<unsigned long long>(stats.deadline_exceeded));
+  if (!stats.first_error.ok()) {
+    fflush(stdout);
+    fprintf(stderr, "First %s error: %s\n", op,
+            stats.first_error.ToString().c_str());
+  }
+}
+
+// A payload size and its relative weight, from --payload_sizes.
+struct PayloadSize {
+  size_t bytes;
+  double weight;
+};
+
+bool ParsePayloadSizes(absl::string_view flag,
+                       std::vector<PayloadSize>* sizes) {
+  for (absl::string_view entry : absl::StrSplit(flag, ',')) {
+    std::vector<absl::string_view> parts = absl::StrSplit(entry, ':');
+    PayloadSize size;
+    if (parts.size() != 2 || !absl::SimpleAtoi(parts[0], &size.bytes) ||
+        !absl::SimpleAtod(parts[1], &size.weight) || size.weight < 0) {
+      return false;
+    }
+    sizes->push_back(size);
+  }
+  return !sizes->empty();
+}
+
+template <typename LockT>
+int Run(const std::string& dir, const std::vector<PayloadSize>& sizes) {
+  using Store = ProtoDataStore<TestProto, LockT, Crc32, SlowFileStorage>;
+  const absl::Duration deadline = absl::GetFlag(FLAGS_deadline);
+  SlowFileStorage storage(absl::GetFlag(FLAGS_disk_latency),
+                          absl::GetFlag(FLAGS_disk_stall),
+                          absl::GetFlag(FLAGS_disk_stall_probability));
+
+  std::vector<std::string> blobs;
+  std::vector<double> weights;
+  typename Store::Options options;
+  for (const PayloadSize& size : sizes) {
+    blobs.emplace_back(size.bytes, 'b');
+    weights.push_back(size.weight);
+    // Leaves room for the header and the other fields.
+    options.max_file_size = std::max<uint64_t>(options.max_file_size,
+                                               2 * size.bytes + 1024);
+  }
+
+  // Written once up front, so that reads never find the files missing.
+  std::vector<std::string> filenames;
+  std::vector<std::unique_ptr<Store>> stores;
+  for (int i = 0; i < std::max(1, absl::GetFlag(FLAGS_stores)); i++) {
+    filenames.push_back(absl::StrCat(dir, "/store-", i));
+    stores.push_back(
+        absl::make_unique<Store>(storage, filenames.back(), options));
+    auto proto = absl::make_unique<TestProto>();
+    proto->set_blob(blobs[0]);
+    absl::Status status = stores.back()->Write(std::move(proto));
+    if (!status.ok()) {
+      fprintf(stderr, "Cannot write %s: %s\n", filenames.back().c_str(),
+              status.ToString().c_str());
+      return 1;
+    }
+  }
+
+  const int num_readers = std::max(0, absl::GetFlag(FLAGS_readers));
+  const int num_writers = std::max(0, absl::GetFlag(FLAGS_writers));
+  std::vector<OpStats> read_stats(num_readers);
+  std::vector<OpStats> write_stats(num_writers);
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_readers; i++) {
+    threads.emplace_back([&, &stats = read_stats[i]]() {
+      absl::BitGen gen;
+      while (!stop.load(std::memory_order_relaxed)) {
+        const Store& store =
+            *stores[absl::Uniform(gen, size_t{0}, stores.size())];
+        const AllocationCounter allocations;
+        const auto start = std::chrono::steady_clock::now();
+        absl::StatusOr<const TestProto*> proto =
+            deadline > absl::ZeroDuration()
+                ? store.Read(absl::Now() + deadline)
+                : store.Read();
+        stats.Record(
+            absl::FromChrono(std::chrono::steady_clock::now() - start),
+            allocations.allocations(), proto.status());
+      }
+    });
+  }
+  for (int i = 0; i < num_writers; i++) {
+    threads.emplace_back([&, &stats = write_stats[i]]() {
+      absl::BitGen gen;
+      absl::discrete_distribution<size_t> pick_size(weights.begin(),
+                                                    weights.end());
+      int32_t counter = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        Store& store = *stores[absl::Uniform(gen, size_t{0}, stores.size())];
+        // Every write differs, so none is skipped as identical.
+        auto proto = absl::make_unique<TestProto>();
+        proto->set_int_value(++counter);
+        proto->set_blob(blobs[pick_size(gen)]);
+        const AllocationCounter allocations;
+        const auto start = std::chrono::steady_clock::now();
+        absl::Status status =
+            deadline > absl::ZeroDuration()
+                ? store.Write(std::move(proto), absl::Now() + deadline)
+                : store.Write(std::move(proto));
+        stats.Record(
+            absl::FromChrono(std::chrono::steady_clock::now() - start),
+            allocations.allocations(), status);
+        absl::SleepFor(absl::GetFlag(FLAGS_write_interval));
+      }
+    });
+  }
+
+  const absl::Time start = absl::Now();
+  absl::SleepFor(absl::GetFlag(FLAGS_duration));
+  stop = true;
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  const absl::Duration elapsed = absl::Now() - start;
+
+  OpStats reads;
+  for (const OpStats& stats : read_stats) reads.Merge(stats);
+  OpStats writes;
+  for (const OpStats& stats : write_stats) writes.Merge(stats);
+  PrintHeader();
+  PrintStats("read", reads, elapsed);
+  PrintStats("write", writes, elapsed);
+
+  // Waits for the calls still completing in the background.
+  stores.clear();
+  if (absl::GetFlag(FLAGS_dir).empty()) {
+    for (const std::string& filename : filenames) {
+      storage.Delete(filename).IgnoreError();
+    }
+    rmdir(dir.c_str());
+  }
+  return 0;
+}
+
+int Main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  std::vector<PayloadSize> sizes;
+  if (!ParsePayloadSizes(absl::GetFlag(FLAGS_payload_sizes), &sizes)) {
+    fprintf(stderr, "Invalid --payload_sizes: %s\n",
+            absl::GetFlag(FLAGS_payload_sizes).c_str());
+    return 2;
+  }
+
+  std::string dir = absl::GetFlag(FLAGS_dir);
+  if (dir.empty()) {
+    char tmpl[] = "/tmp/stress-test.XXXXXX";
+    if (mkdtemp(tmpl) == nullptr) {
+      fprintf(stderr, "Cannot create a temporary directory: %s\n",
+              strerror(errno));
+      return 1;
+    }
+    dir = tmpl;
+  }
+
+  return absl::GetFlag(FLAGS_shared_lock) ? Run<SharedLockPolicy>(dir, sizes)
+                                          : Run<MutexLockPolicy>(dir, sizes);
+}
+
+}  // namespace
+}  // namespace protostore
+
+int main(int argc, char** argv) { return protostore::Main(argc, argv); }
@@ -17,12 +17,19 @@
 
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/strings/escaping.h"
 #include "absl/strings/str_cat.h"
-#include "google/protobuf/message.h"
+#include "google/protobuf/message_lite.h"
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
+namespace google {
+namespace protobuf {
+class Message;
+}  // namespace protobuf
+}  // namespace google
+
 namespace protostore {
 namespace testing {
 
@@ -138,15 +145,26 @@ class IsOkAndHoldsMatcher {
   const InnerMatcher inner_matcher_;
 };
 
+// Returns the text format of `msg`, or without reflection (i.e. for
+// LITE_RUNTIME protos) its serialization.
+template <typename Message>
+std::string ProtoString(const Message& msg) {
+  if constexpr (std::is_base_of<google::protobuf::Message, Message>::value) {
+    return msg.DebugString();
+  } else {
+    return absl::CEscape(msg.SerializeAsString());
+  }
+}
+
 class ProtoStringMatcher {
  public:
-  ProtoStringMatcher(const google::protobuf::Message& msg)
-    : expected_(msg.DebugString()) {}
+  explicit ProtoStringMatcher(std::string expected)
+    : expected_(std::move(expected)) {}
 
   template <typename Message> bool MatchAndExplain(const Message& p,
     MatchResultListener *listener) const {
-      *listener << p.DebugString();
-      return p.DebugString() == expected_;
+      *listener << ProtoString(p);
+      return ProtoString(p) == expected_;
   }
 
   void DescribeTo(std::ostream* os) const {
@@ -181,9 +199,9 @@ IsOkAndHoldsMatcher<typename std::decay<InnerMatcher>::type> IsOkAndHolds(
       std::forward<InnerMatcher>(inner_matcher));
 }
 
-PolymorphicMatcher<ProtoStringMatcher> EqualsProto(
-    const google::protobuf::Message& x) {
-  return MakePolymorphicMatcher(ProtoStringMatcher(x));
+template <typename Message>
+PolymorphicMatcher<ProtoStringMatcher> EqualsProto(const Message& x) {
+  return MakePolymorphicMatcher(ProtoStringMatcher(ProtoString(x)));
 }
 
 #define EXPECT_OK(status) \
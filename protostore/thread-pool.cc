@@ -0,0 +1,76 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protostore/thread-pool.h"
+
+#include <utility>
+
+namespace protostore {
+namespace {
+
+// The pool whose WorkLoop() the current thread runs, if any.
+thread_local const ThreadPool* current_pool = nullptr;
+
+}  // namespace
+
+ThreadPool::ThreadPool(int num_threads) {
+  for (int i = 0; i < num_threads; i++) {
+    threads_.emplace_back(&ThreadPool::WorkLoop, this);
+  }
+}
+
+ThreadPool* ThreadPool::Default() {
+  static ThreadPool* const kPool = new ThreadPool(4);
+  return kPool;
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    absl::MutexLock lock(&mutex_);
+    stopping_ = true;
+  }
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Schedule(std::function<void()> closure) {
+  absl::MutexLock lock(&mutex_);
+  queue_.push_back(std::move(closure));
+}
+
+bool ThreadPool::RunsOnCurrentThread() const { return current_pool == this; }
+
+bool ThreadPool::WorkAvailable() const {
+  return stopping_ || !queue_.empty();
+}
+
+void ThreadPool::WorkLoop() {
+  current_pool = this;
+  while (true) {
+    std::function<void()> closure;
+    {
+      absl::MutexLock lock(&mutex_);
+      mutex_.Await(absl::Condition(this, &ThreadPool::WorkAvailable));
+      if (queue_.empty()) {
+        return;  // Stopping and drained.
+      }
+      closure = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    closure();
+  }
+}
+
+}  // namespace protostore
@@ -0,0 +1,59 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROTOSTORE_THREAD_POOL_H_
+#define PROTOSTORE_THREAD_POOL_H_
+
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "protostore/executor.h"
+
+namespace protostore {
+
+/// \brief Runs closures on a fixed number of threads, in FIFO order.
+class ThreadPool final : public Executor {
+ public:
+  explicit ThreadPool(int num_threads);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  /// \brief Runs all scheduled closures, then joins the threads.
+  ~ThreadPool() override;
+
+  /// Returns a process-wide pool of a few threads, never destroyed.
+  static ThreadPool* Default();
+
+  void Schedule(std::function<void()> closure) override
+      ABSL_LOCKS_EXCLUDED(mutex_);
+  bool RunsOnCurrentThread() const override;
+
+  int num_threads() const { return threads_.size(); }
+
+ private:
+  bool WorkAvailable() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void WorkLoop() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  absl::Mutex mutex_;
+  std::deque<std::function<void()>> queue_ ABSL_GUARDED_BY(mutex_);
+  bool stopping_ ABSL_GUARDED_BY(mutex_) = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_THREAD_POOL_H_
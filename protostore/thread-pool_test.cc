@@ -0,0 +1,71 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protostore/thread-pool.h"
+
+#include <atomic>
+
+#include "absl/synchronization/barrier.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/synchronization/notification.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::Eq;
+
+TEST(ThreadPoolTest, RunsEveryClosure) {
+  std::atomic<int> runs{0};
+  {
+    ThreadPool pool(4);
+    EXPECT_THAT(pool.num_threads(), Eq(4));
+    for (int i = 0; i < 1000; i++) {
+      pool.Schedule([&runs]() { runs++; });
+    }
+  }
+  // The destructor drains the queue.
+  EXPECT_THAT(runs.load(), Eq(1000));
+}
+
+TEST(ThreadPoolTest, RunsClosuresConcurrently) {
+  ThreadPool pool(2);
+  // Deadlocks unless both closures run at the same time.
+  auto* both_running = new absl::Barrier(2);
+  absl::BlockingCounter done(2);
+  for (int i = 0; i < 2; i++) {
+    pool.Schedule([&]() {
+      if (both_running->Block()) delete both_running;
+      done.DecrementCount();
+    });
+  }
+  done.Wait();
+}
+
+TEST(ThreadPoolTest, KnowsItsOwnThreads) {
+  ThreadPool pool(1);
+  ThreadPool other(1);
+  EXPECT_FALSE(pool.RunsOnCurrentThread());
+  absl::Notification done;
+  pool.Schedule([&]() {
+    EXPECT_TRUE(pool.RunsOnCurrentThread());
+    EXPECT_FALSE(other.RunsOnCurrentThread());
+    done.Notify();
+  });
+  done.WaitForNotification();
+}
+
+}  // namespace
+}  // namespace protostore
@@ -0,0 +1,187 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Verifies the header magic and checksum of every ProtoDataStore file under
+// the given files and directories, without parsing the stored protos.
+//
+// Usage: verify-stores [--threads=N] [--suffix=.pb] PATH...
+//
+// Each bad file is printed to stdout as one tab-separated line:
+//   <status code>\t<path>\t<message>
+// with backslashes, tabs and newlines in the path and message escaped as
+// \\, \t and \n.
+// A throughput summary is printed to stderr. Exits with 1 if any file is bad.
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_replace.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "protostore/file-storage.h"
+#include "protostore/store-format.h"
+#include "protostore/thread-pool.h"
+
+ABSL_FLAG(int, threads, std::thread::hardware_concurrency(),
+          "Number of files verified concurrently.");
+ABSL_FLAG(std::string, suffix, "",
+          "Only verify files whose name ends with this suffix.");
+
+namespace protostore {
+namespace {
+
+// Escapes `field` for a line of tab-separated output.
+std::string EscapeField(absl::string_view field) {
+  return absl::StrReplaceAll(
+      field, {{"\\", "\\\\"}, {"\t", "\\t"}, {"\n", "\\n"}});
+}
+
+class Scrubber {
+ public:
+  Scrubber(int num_threads, std::string suffix)
+      : pool_(absl::make_unique<ThreadPool>(num_threads)),
+        suffix_(std::move(suffix)) {}
+
+  // Schedules verification of `path`, descending into directories.
+  void Add(const std::string& path) {
+    struct stat sbuf;
+    if (lstat(path.c_str(), &sbuf) != 0) {
+      Report(path, absl::ErrnoToStatus(errno, "lstat"));
+      return;
+    }
+    if (S_ISDIR(sbuf.st_mode)) {
+      AddDirectory(path);
+    } else if (S_ISREG(sbuf.st_mode) && absl::EndsWith(path, suffix_)) {
+      const uint64_t size = sbuf.st_size;
+      pool_->Schedule([this, path, size]() { Verify(path, size); });
+    }
+  }
+
+  // Waits for all scheduled verifications. No files may be added afterwards.
+  void Finish() { pool_.reset(); }
+
+  int files() const {
+    absl::MutexLock lock(&mutex_);
+    return files_;
+  }
+
+  int bad_files() const {
+    absl::MutexLock lock(&mutex_);
+    return bad_files_;
+  }
+
+  uint64_t bytes() const {
+    absl::MutexLock lock(&mutex_);
+    return bytes_;
+  }
+
+ private:
+  void AddDirectory(const std::string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+      Report(path, absl::ErrnoToStatus(errno, "opendir"));
+      return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      absl::string_view name = entry->d_name;
+      if (name == "." || name == "..") continue;
+      Add(absl::StrCat(path, "/", name));
+    }
+    closedir(dir);
+  }
+
+  void Verify(const std::string& path, uint64_t size) {
+    const absl::Status status = VerifyStoreFile(storage_, path);
+
+    absl::MutexLock lock(&mutex_);
+    files_++;
+    bytes_ += size;
+    if (!status.ok()) {
+      ReportLocked(path, status);
+    }
+  }
+
+  void Report(const std::string& path, const absl::Status& status) {
+    absl::MutexLock lock(&mutex_);
+    ReportLocked(path, status);
+  }
+
+  void ReportLocked(const std::string& path, const absl::Status& status)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    bad_files_++;
+    printf("%s\t%s\t%s\n", absl::StatusCodeToString(status.code()).c_str(),
+           EscapeField(path).c_str(), EscapeField(status.message()).c_str());
+  }
+
+  FileStorage storage_;
+
+  mutable absl::Mutex mutex_;
+  int files_ ABSL_GUARDED_BY(mutex_) = 0;
+  int bad_files_ ABSL_GUARDED_BY(mutex_) = 0;
+  uint64_t bytes_ ABSL_GUARDED_BY(mutex_) = 0;
+
+  // Declared after the state used by in-flight verifications, so that it is
+  // drained first on destruction.
+  std::unique_ptr<ThreadPool> pool_;
+  const std::string suffix_;
+};
+
+int Main(int argc, char** argv) {
+  std::vector<char*> paths = absl::ParseCommandLine(argc, argv);
+  if (paths.size() < 2) {
+    fprintf(stderr, "Usage: %s [--threads=N] [--suffix=S] PATH...\n",
+            argv[0]);
+    return 2;
+  }
+
+  Scrubber scrubber(std::max(1, absl::GetFlag(FLAGS_threads)),
+                    absl::GetFlag(FLAGS_suffix));
+  const absl::Time start = absl::Now();
+  for (size_t i = 1; i < paths.size(); i++) {
+    scrubber.Add(paths[i]);
+  }
+  scrubber.Finish();
+  const double seconds = absl::ToDoubleSeconds(absl::Now() - start);
+
+  fprintf(stderr,
+          "Verified %d files (%llu bytes) in %.3fs: %.1f MiB/s, "
+          "%d bad.\n",
+          scrubber.files(), static_cast<unsigned long long>(scrubber.bytes()),
+          seconds,
+          seconds > 0 ? scrubber.bytes() / seconds / (1024 * 1024) : 0.0,
+          scrubber.bad_files());
+  return scrubber.bad_files() == 0 ? 0 : 1;
+}
+
+}  // namespace
+}  // namespace protostore
+
+int main(int argc, char** argv) { return protostore::Main(argc, argv); }
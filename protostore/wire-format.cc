@@ -0,0 +1,340 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protostore/wire-format.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "absl/algorithm/container.h"
+
+namespace protostore {
+namespace internal {
+namespace {
+
+// Advances `*data` past the value of a field with `wire_type`, setting
+// `*value` to the payload. `number` is needed to match the end of groups.
+bool SkipValue(absl::string_view* data, int number, WireType wire_type,
+               absl::string_view* value) {
+  const absl::string_view start = *data;
+  uint64_t n;
+  switch (wire_type) {
+    case kVarint:
+      if (!ReadVarint(data, &n)) return false;
+      *value = start.substr(0, start.size() - data->size());
+      return true;
+    case kFixed64:
+      if (data->size() < 8) return false;
+      *value = data->substr(0, 8);
+      data->remove_prefix(8);
+      return true;
+    case kFixed32:
+      if (data->size() < 4) return false;
+      *value = data->substr(0, 4);
+      data->remove_prefix(4);
+      return true;
+    case kLengthDelimited:
+      if (!ReadVarint(data, &n) || n > data->size()) return false;
+      *value = data->substr(0, n);
+      data->remove_prefix(n);
+      return true;
+    case kStartGroup:
+      while (true) {
+        uint64_t tag;
+        if (!ReadVarint(data, &tag)) return false;
+        const int inner_number = tag >> 3;
+        const auto inner_type = static_cast<WireType>(tag & 7);
+        if (inner_type == kEndGroup) {
+          if (inner_number != number) return false;
+          *value = start.substr(0, start.size() - data->size());
+          return true;
+        }
+        absl::string_view unused;
+        if (!SkipValue(data, inner_number, inner_type, &unused)) return false;
+      }
+    default:
+      return false;
+  }
+}
+
+// Appends `range` to `*ranges`, extending the last range if it is adjacent.
+void AppendRange(absl::string_view range,
+                 std::vector<absl::string_view>* ranges) {
+  if (!ranges->empty() &&
+      ranges->back().data() + ranges->back().size() == range.data()) {
+    ranges->back() = absl::string_view(ranges->back().data(),
+                                       ranges->back().size() + range.size());
+  } else {
+    ranges->push_back(range);
+  }
+}
+
+}  // namespace
+
+bool ReadVarint(absl::string_view* data, uint64_t* value) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < data->size() && i < 10; i++) {
+    const uint8_t byte = (*data)[i];
+    result |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      data->remove_prefix(i + 1);
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+void AppendVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+bool WireFieldScanner::Next(WireField* field) {
+  if (!ok_ || offset_ == data_.size()) {
+    return false;
+  }
+  absl::string_view rest = data_.substr(offset_);
+  uint64_t tag;
+  if (!ReadVarint(&rest, &tag) || (tag >> 3) == 0) {
+    ok_ = false;
+    return false;
+  }
+  field->number = tag >> 3;
+  field->wire_type = static_cast<WireType>(tag & 7);
+  if (!SkipValue(&rest, field->number, field->wire_type, &field->value)) {
+    ok_ = false;
+    return false;
+  }
+  const size_t end = data_.size() - rest.size();
+  field->encoded = data_.substr(offset_, end - offset_);
+  offset_ = end;
+  return true;
+}
+
+bool FindLengthDelimitedField(absl::string_view data,
+                              absl::Span<const int> field_path,
+                              absl::string_view* value) {
+  if (field_path.empty()) {
+    *value = data;
+    return true;
+  }
+  WireFieldScanner scanner(data);
+  WireField field;
+  bool found = false;
+  absl::string_view last;
+  while (scanner.Next(&field)) {
+    if (field.number == field_path[0] &&
+        field.wire_type == kLengthDelimited) {
+      last = field.value;
+      found = true;
+    }
+  }
+  if (!scanner.ok() || !found) {
+    return false;
+  }
+  return FindLengthDelimitedField(last, field_path.subspan(1), value);
+}
+
+bool RangesInputStream::Next(const void** data, int* size) {
+  if (index_ > 0 && position_ < ranges_[index_ - 1].size()) {
+    // Hand out what was backed up.
+    absl::string_view range = ranges_[index_ - 1].substr(position_);
+    position_ = ranges_[index_ - 1].size();
+    *data = range.data();
+    *size = range.size();
+    byte_count_ += range.size();
+    return true;
+  }
+  while (index_ < ranges_.size() && ranges_[index_].empty()) {
+    index_++;
+  }
+  if (index_ == ranges_.size()) {
+    return false;
+  }
+  absl::string_view range = ranges_[index_++];
+  position_ = range.size();
+  *data = range.data();
+  *size = range.size();
+  byte_count_ += range.size();
+  return true;
+}
+
+void RangesInputStream::BackUp(int count) {
+  position_ -= count;
+  byte_count_ -= count;
+}
+
+bool RangesInputStream::Skip(int count) {
+  const void* data;
+  int size;
+  while (count > 0) {
+    if (!Next(&data, &size)) {
+      return false;
+    }
+    if (size > count) {
+      BackUp(size - count);
+      return true;
+    }
+    count -= size;
+  }
+  return true;
+}
+
+bool CordOutputStream::Next(void** data, int* size) {
+  FlushBlock();
+  // Left uninitialized; the caller overwrites it.
+  block_ = buffer_pool_->Acquire(block_size_);
+  used_ = block_size_;
+  *data = block_.data();
+  *size = block_size_;
+  byte_count_ += block_size_;
+  return true;
+}
+
+void CordOutputStream::BackUp(int count) {
+  used_ -= count;
+  byte_count_ -= count;
+}
+
+absl::Cord CordOutputStream::Consume() {
+  FlushBlock();
+  return std::move(cord_);
+}
+
+void CordOutputStream::FlushBlock() {
+  if (block_.data() == nullptr) {
+    return;
+  }
+  cord_.Append(BufferPool::MakeCord(std::move(block_), used_));
+  used_ = 0;
+}
+
+bool RangesExcludingFields(absl::string_view data,
+                           absl::Span<const int> excluded_fields,
+                           std::vector<absl::string_view>* ranges) {
+  ranges->clear();
+  WireFieldScanner scanner(data);
+  WireField field;
+  const char* range_start = data.data();
+  const char* range_end = data.data();
+  while (scanner.Next(&field)) {
+    if (absl::c_linear_search(excluded_fields, field.number)) {
+      if (range_end != range_start) {
+        ranges->emplace_back(range_start, range_end - range_start);
+      }
+      range_start = range_end = field.encoded.data() + field.encoded.size();
+    } else {
+      range_end = field.encoded.data() + field.encoded.size();
+    }
+  }
+  if (range_end != range_start) {
+    ranges->emplace_back(range_start, range_end - range_start);
+  }
+  return scanner.ok();
+}
+
+bool SplitRepeatedField(absl::string_view data, int field_number,
+                        absl::Span<const int> excluded_fields,
+                        size_t part_size, std::vector<absl::string_view>* rest,
+                        std::vector<std::vector<absl::string_view>>* parts) {
+  rest->clear();
+  parts->clear();
+  WireFieldScanner scanner(data);
+  WireField field;
+  size_t current_part_size = 0;
+  while (scanner.Next(&field)) {
+    if (absl::c_linear_search(excluded_fields, field.number)) {
+      continue;
+    }
+    if (field.number != field_number) {
+      AppendRange(field.encoded, rest);
+      continue;
+    }
+    if (parts->empty() || current_part_size >= part_size) {
+      parts->emplace_back();
+      current_part_size = 0;
+    }
+    AppendRange(field.encoded, &parts->back());
+    current_part_size += field.encoded.size();
+  }
+  return scanner.ok();
+}
+
+bool SplitFieldsIntoShards(
+    absl::string_view data, const absl::flat_hash_map<int, int>& field_shards,
+    std::vector<std::vector<absl::string_view>>* shards) {
+  for (std::vector<absl::string_view>& shard : *shards) {
+    shard.clear();
+  }
+  WireFieldScanner scanner(data);
+  WireField field;
+  while (scanner.Next(&field)) {
+    auto it = field_shards.find(field.number);
+    const int shard = it == field_shards.end() ? 0 : it->second;
+    AppendRange(field.encoded, &(*shards)[shard]);
+  }
+  return scanner.ok();
+}
+
+bool DropLeadingField(int field_number,
+                      std::vector<absl::string_view>* ranges) {
+  // The tag and the length take at most 15 bytes, but may be split across
+  // ranges.
+  char prefix[15];
+  size_t prefix_size = 0;
+  for (absl::string_view range : *ranges) {
+    const size_t n = std::min(range.size(), sizeof(prefix) - prefix_size);
+    std::memcpy(prefix + prefix_size, range.data(), n);
+    prefix_size += n;
+    if (prefix_size == sizeof(prefix)) {
+      break;
+    }
+  }
+  if (prefix_size == 0) {
+    return true;
+  }
+  absl::string_view rest(prefix, prefix_size);
+  uint64_t tag;
+  if (!ReadVarint(&rest, &tag)) {
+    return false;
+  }
+  if (tag != (static_cast<uint64_t>(field_number) << 3 | kLengthDelimited)) {
+    return true;
+  }
+  uint64_t length;
+  if (!ReadVarint(&rest, &length)) {
+    return false;
+  }
+  uint64_t remaining = (prefix_size - rest.size()) + length;
+  auto range = ranges->begin();
+  while (range != ranges->end() && remaining >= range->size()) {
+    remaining -= range->size();
+    ++range;
+  }
+  if (range == ranges->end() && remaining > 0) {
+    return false;
+  }
+  if (range != ranges->end()) {
+    range->remove_prefix(remaining);
+  }
+  ranges->erase(ranges->begin(), range);
+  return true;
+}
+
+}  // namespace internal
+}  // namespace protostore
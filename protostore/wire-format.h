@@ -0,0 +1,182 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROTOSTORE_WIRE_FORMAT_H_
+#define PROTOSTORE_WIRE_FORMAT_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "protostore/buffer-pool.h"
+
+namespace protostore {
+namespace internal {
+
+// Wire types of the protobuf encoding.
+enum WireType {
+  kVarint = 0,
+  kFixed64 = 1,
+  kLengthDelimited = 2,
+  kStartGroup = 3,
+  kEndGroup = 4,
+  kFixed32 = 5,
+};
+
+// A field of a serialized proto, as found by WireFieldScanner.
+struct WireField {
+  int number;
+  WireType wire_type;
+  // The whole field, tag included.
+  absl::string_view encoded;
+  // The payload of length-delimited fields; the raw value bytes otherwise.
+  absl::string_view value;
+};
+
+// Reads a base-128 varint from the front of `*data`, advancing past it.
+// Returns false if `*data` does not start with a well-formed varint.
+bool ReadVarint(absl::string_view* data, uint64_t* value);
+
+// Appends `value` to `*out` as a base-128 varint.
+void AppendVarint(uint64_t value, std::string* out);
+
+// Iterates over the fields of a serialized proto without parsing it, in the
+// order in which they were encoded. Only the fields of the outermost message
+// are visited.
+class WireFieldScanner {
+ public:
+  explicit WireFieldScanner(absl::string_view data) : data_(data) {}
+
+  // Sets `*field` to the next field. Returns false at the end of the data or
+  // if it is malformed; ok() tells the two apart.
+  bool Next(WireField* field);
+
+  bool ok() const { return ok_; }
+
+  // Offset of the next field within the data.
+  size_t offset() const { return offset_; }
+
+ private:
+  absl::string_view data_;
+  size_t offset_ = 0;
+  bool ok_ = true;
+};
+
+// Returns in `*value` the last occurrence of the length-delimited field at
+// `field_path` (field numbers, outermost first) within `data`, descending
+// into the embedded messages named by all but the last number.
+//
+// Returns false if the field is absent or the data is malformed.
+bool FindLengthDelimitedField(absl::string_view data,
+                              absl::Span<const int> field_path,
+                              absl::string_view* value);
+
+// Streams a sequence of byte ranges as if they were one contiguous buffer.
+class RangesInputStream final : public google::protobuf::io::ZeroCopyInputStream {
+ public:
+  explicit RangesInputStream(std::vector<absl::string_view> ranges)
+      : ranges_(std::move(ranges)) {}
+
+  bool Next(const void** data, int* size) override;
+  void BackUp(int count) override;
+  bool Skip(int count) override;
+  int64_t ByteCount() const override { return byte_count_; }
+
+ private:
+  std::vector<absl::string_view> ranges_;
+  size_t index_ = 0;
+  // Bytes of ranges_[index_ - 1] returned by the last Next() and not backed up.
+  size_t position_ = 0;
+  int64_t byte_count_ = 0;
+};
+
+// Collects serialized output into an absl::Cord made of separate blocks of
+// `block_size` bytes taken from `buffer_pool`, avoiding one large contiguous
+// buffer. The blocks go back to the pool when the Cord releases them.
+class CordOutputStream final
+    : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  explicit CordOutputStream(size_t block_size,
+                            BufferPool* buffer_pool = BufferPool::Default())
+      : block_size_(block_size), buffer_pool_(buffer_pool) {}
+
+  bool Next(void** data, int* size) override;
+  void BackUp(int count) override;
+  int64_t ByteCount() const override { return byte_count_; }
+
+  // Returns everything written so far, leaving the stream empty.
+  absl::Cord Consume();
+
+ private:
+  // Moves the used part of the current block into `cord_`.
+  void FlushBlock();
+
+  const size_t block_size_;
+  BufferPool* const buffer_pool_;
+  absl::Cord cord_;
+  BufferPool::Buffer block_;
+  size_t used_ = 0;
+  int64_t byte_count_ = 0;
+};
+
+// Returns the ranges of `data` holding all of its top-level fields except
+// those numbered in `excluded_fields`, merging adjacent fields.
+//
+// Returns false if the data is malformed.
+bool RangesExcludingFields(absl::string_view data,
+                           absl::Span<const int> excluded_fields,
+                           std::vector<absl::string_view>* ranges);
+
+// Splits the top-level fields of `data`, except those numbered in
+// `excluded_fields`, into the occurrences of `field_number` and the rest, so
+// that the occurrences of a large repeated field can be parsed in parallel.
+// The occurrences are grouped in order into `*parts` of at least `part_size`
+// bytes each (bar the last); the other fields go to `*rest`. Adjacent fields
+// are merged into one range.
+//
+// Returns false if the data is malformed.
+bool SplitRepeatedField(absl::string_view data, int field_number,
+                        absl::Span<const int> excluded_fields,
+                        size_t part_size, std::vector<absl::string_view>* rest,
+                        std::vector<std::vector<absl::string_view>>* parts);
+
+// Splits the top-level fields of `data` into `shards->size()` shards, in
+// the order in which they were encoded: the fields numbered in
+// `field_shards` go to the shard they map to, the others to shard 0.
+// Adjacent fields of a shard are merged into one range. The shard numbers
+// must be less than `shards->size()`.
+//
+// Returns false if the data is malformed.
+bool SplitFieldsIntoShards(
+    absl::string_view data, const absl::flat_hash_map<int, int>& field_shards,
+    std::vector<std::vector<absl::string_view>>* shards);
+
+// If the first top-level field of the concatenation of `*ranges` is the
+// length-delimited field `field_number`, removes it from `*ranges`, leaving
+// the other fields. The field may span several ranges.
+//
+// Returns false if the data is malformed.
+bool DropLeadingField(int field_number, std::vector<absl::string_view>* ranges);
+
+}  // namespace internal
+}  // namespace protostore
+
+#endif  // PROTOSTORE_WIRE_FORMAT_H_
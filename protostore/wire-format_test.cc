@@ -0,0 +1,210 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protostore/wire-format.h"
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "gtest/gtest.h"
+#include "protostore/test.pb.h"
+
+namespace protostore {
+namespace internal {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::IsFalse;
+using ::testing::IsTrue;
+using ::testing::Le;
+
+TestProto MakeTestProto() {
+  TestProto testproto;
+  testproto.set_string_value("hello");
+  testproto.set_int_value(-7);
+  testproto.add_entries()->set_key("a");
+  testproto.set_blob(std::string(300, 'b'));
+  testproto.add_entries()->set_key("b");
+  testproto.mutable_entry()->set_key("nested");
+  return testproto;
+}
+
+TEST(WireFormatTest, ScansTopLevelFields) {
+  const std::string data = MakeTestProto().SerializeAsString();
+  WireFieldScanner scanner(data);
+  WireField field;
+  std::vector<int> numbers;
+  size_t encoded_size = 0;
+  while (scanner.Next(&field)) {
+    numbers.push_back(field.number);
+    encoded_size += field.encoded.size();
+  }
+  EXPECT_THAT(scanner.ok(), IsTrue());
+  // Serialization orders fields by number.
+  EXPECT_THAT(numbers, ElementsAre(1, 2, 3, 3, 4, 5));
+  EXPECT_THAT(encoded_size, Eq(data.size()));
+}
+
+TEST(WireFormatTest, RejectsMalformedData) {
+  std::string data = MakeTestProto().SerializeAsString();
+  data.resize(data.size() - 1);
+  WireFieldScanner scanner(data);
+  WireField field;
+  while (scanner.Next(&field)) {
+  }
+  EXPECT_THAT(scanner.ok(), IsFalse());
+}
+
+TEST(WireFormatTest, FindsLengthDelimitedFields) {
+  const std::string data = MakeTestProto().SerializeAsString();
+  absl::string_view value;
+  ASSERT_THAT(FindLengthDelimitedField(data, {4}, &value), IsTrue());
+  EXPECT_THAT(value, Eq(std::string(300, 'b')));
+  ASSERT_THAT(FindLengthDelimitedField(data, {5, 1}, &value), IsTrue());
+  EXPECT_THAT(value, Eq("nested"));
+  // Last occurrence wins.
+  ASSERT_THAT(FindLengthDelimitedField(data, {3, 1}, &value), IsTrue());
+  EXPECT_THAT(value, Eq("b"));
+  EXPECT_THAT(FindLengthDelimitedField(data, {6}, &value), IsFalse());
+}
+
+TEST(WireFormatTest, ParsesRangesExcludingFields) {
+  const TestProto testproto = MakeTestProto();
+  const std::string data = testproto.SerializeAsString();
+  std::vector<absl::string_view> ranges;
+  ASSERT_THAT(RangesExcludingFields(data, {2, 4}, &ranges), IsTrue());
+  EXPECT_THAT(ranges.size(), Eq(3));
+
+  RangesInputStream input(std::move(ranges));
+  google::protobuf::io::CodedInputStream coded_input(&input);
+  TestProto parsed;
+  ASSERT_THAT(parsed.ParseFromCodedStream(&coded_input), IsTrue());
+
+  TestProto expected = testproto;
+  expected.clear_int_value();
+  expected.clear_blob();
+  EXPECT_THAT(parsed.SerializeAsString(), Eq(expected.SerializeAsString()));
+}
+
+TEST(WireFormatTest, SplitsRepeatedField) {
+  TestProto testproto = MakeTestProto();
+  for (int i = 0; i < 8; i++) {
+    testproto.add_entries()->set_key("key");
+  }
+  const std::string data = testproto.SerializeAsString();
+  const size_t entry_size = testproto.entries(2).ByteSizeLong() + 2;
+
+  std::vector<absl::string_view> rest;
+  std::vector<std::vector<absl::string_view>> parts;
+  ASSERT_THAT(SplitRepeatedField(data, 3, {4}, 3 * entry_size, &rest, &parts),
+              IsTrue());
+
+  // The ten entries are contiguous: 4 + 3 + 3, the first two being shorter.
+  ASSERT_THAT(parts.size(), Eq(3));
+  TestProto merged;
+  for (const auto& part : parts) {
+    ASSERT_THAT(part.size(), Eq(1));
+    TestProto parsed;
+    ASSERT_THAT(parsed.ParseFromString(std::string(part[0])), IsTrue());
+    EXPECT_THAT(parsed.entries_size(), Le(4));
+    merged.MergeFrom(parsed);
+  }
+  // Fields 1 and 2 are adjacent, 4 is excluded.
+  ASSERT_THAT(rest.size(), Eq(2));
+  for (absl::string_view range : rest) {
+    ASSERT_THAT(merged.MergeFromString(std::string(range)), IsTrue());
+  }
+
+  testproto.clear_blob();
+  EXPECT_THAT(merged.SerializeAsString(), Eq(testproto.SerializeAsString()));
+
+  EXPECT_THAT(SplitRepeatedField(data.substr(0, data.size() - 1), 3, {}, 0,
+                                 &rest, &parts),
+              IsFalse());
+}
+
+TEST(WireFormatTest, CordOutputStreamUsesBoundedBlocks) {
+  TestProto testproto = MakeTestProto();
+  testproto.set_blob(std::string(100000, 'b'));
+  CordOutputStream output(4096);
+  ASSERT_THAT(testproto.SerializeToZeroCopyStream(&output), IsTrue());
+  const absl::Cord cord = output.Consume();
+  EXPECT_THAT(std::string(cord), Eq(testproto.SerializeAsString()));
+  for (absl::string_view chunk : cord.Chunks()) {
+    EXPECT_THAT(chunk.size(), Le(4096));
+  }
+}
+
+TEST(WireFormatTest, SplitsFieldsIntoShards) {
+  const TestProto testproto = MakeTestProto();
+  const std::string data = testproto.SerializeAsString();
+  std::vector<std::vector<absl::string_view>> shards(3);
+  ASSERT_THAT(SplitFieldsIntoShards(data, {{3, 1}, {4, 2}}, &shards),
+              IsTrue());
+  // Fields 1 and 2 are adjacent, 5 is not.
+  ASSERT_THAT(shards[0].size(), Eq(2));
+  ASSERT_THAT(shards[1].size(), Eq(1));
+  ASSERT_THAT(shards[2].size(), Eq(1));
+
+  TestProto merged;
+  for (const auto& shard : shards) {
+    for (absl::string_view range : shard) {
+      ASSERT_THAT(merged.MergeFromString(std::string(range)), IsTrue());
+    }
+  }
+  EXPECT_THAT(merged.entries_size(), Eq(2));
+  EXPECT_THAT(merged.blob(), Eq(testproto.blob()));
+  EXPECT_THAT(merged.entry().key(), Eq("nested"));
+
+  TestProto second;
+  ASSERT_THAT(second.ParseFromString(std::string(shards[1][0])), IsTrue());
+  EXPECT_THAT(second.entries_size(), Eq(2));
+  EXPECT_THAT(second.has_string_value(), IsFalse());
+
+  EXPECT_THAT(SplitFieldsIntoShards(data.substr(0, data.size() - 1), {},
+                                    &shards),
+              IsFalse());
+}
+
+TEST(WireFormatTest, DropsLeadingFieldAcrossRanges) {
+  TestProto first;
+  first.set_blob(std::string(20, 'x'));
+  const std::string data =
+      first.SerializeAsString() + MakeTestProto().SerializeAsString();
+  // Split so that the tag and length of the blob span two ranges.
+  std::vector<absl::string_view> ranges = {
+      absl::string_view(data).substr(0, 1), absl::string_view(data).substr(1)};
+  ASSERT_THAT(DropLeadingField(4, &ranges), IsTrue());
+  std::string rest;
+  for (absl::string_view range : ranges) {
+    rest.append(range.data(), range.size());
+  }
+  EXPECT_THAT(rest, Eq(MakeTestProto().SerializeAsString()));
+
+  // Only the leading field is dropped.
+  ASSERT_THAT(DropLeadingField(4, &ranges), IsTrue());
+  EXPECT_THAT(ranges.size(), Eq(1));
+  EXPECT_THAT(ranges[0].size(), Eq(rest.size()));
+
+  std::vector<absl::string_view> truncated = {
+      absl::string_view(data).substr(0, 10)};
+  EXPECT_THAT(DropLeadingField(4, &truncated), IsFalse());
+}
+
+}  // namespace
+}  // namespace internal
+}  // namespace protostore
@@ -0,0 +1,231 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/write-batch.h"
+
+#include <algorithm>
+#include <set>
+
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "protostore/crc32.h"
+#include "protostore/store-format.h"
+
+namespace protostore {
+
+namespace {
+
+std::string StagedFilename(absl::string_view filename) {
+  return absl::StrCat(filename, ".batch");
+}
+
+// Syncs each distinct directory holding one of `filenames` once.
+absl::Status SyncDirectories(const FileStorage& file_storage,
+                             const std::vector<std::string>& filenames) {
+  std::set<std::string> directories;
+  for (const std::string& filename : filenames) {
+    const size_t slash = filename.rfind('/');
+    const std::string directory =
+        slash == std::string::npos ? "" : filename.substr(0, slash);
+    if (directories.insert(directory).second) {
+      PDS_RETURN_IF_ERROR(file_storage.SyncDirectory(filename));
+    }
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+WriteBatch::WriteBatch(const FileStorage& file_storage,
+                       std::string marker_filename, SyncMode sync_mode)
+    : file_storage_(file_storage),
+      marker_filename_(std::move(marker_filename)),
+      sync_mode_(sync_mode) {}
+
+absl::Status WriteBatch::Commit() {
+  std::vector<Entry> entries;
+  entries.swap(entries_);
+  if (entries.empty()) {
+    return absl::OkStatus();
+  }
+
+  // The write locks of the stores are held from staging until publishing,
+  // so that no other batch reuses the staged files and no Write() lands in
+  // between. They are taken in a fixed order so that concurrent batches
+  // cannot deadlock.
+  std::vector<const Entry*> locking_order;
+  for (const Entry& entry : entries) {
+    locking_order.push_back(&entry);
+  }
+  std::sort(locking_order.begin(), locking_order.end(),
+            [](const Entry* a, const Entry* b) {
+              return std::less<const void*>()(a->store, b->store);
+            });
+  for (const Entry* entry : locking_order) {
+    entry->lock_writes();
+  }
+  std::vector<std::function<void()>> notifications;
+  const absl::Status status =
+      CommitLocked(entries, locking_order, &notifications);
+  for (auto it = locking_order.rbegin(); it != locking_order.rend(); ++it) {
+    (*it)->unlock_writes();
+  }
+  for (const std::function<void()>& notify : notifications) {
+    notify();
+  }
+  return status;
+}
+
+absl::Status WriteBatch::CommitLocked(
+    const std::vector<Entry>& entries,
+    const std::vector<const Entry*>& locking_order,
+    std::vector<std::function<void()>>* notifications) const {
+  absl::Status staged = Stage(entries);
+  if (!staged.ok()) {
+    DeleteStaged(entries);
+    return staged;
+  }
+
+  // The commit point: once the marker is durable, Recover() completes the
+  // batch. The marker has the layout of a store file, for its checksum.
+  std::vector<std::string> filenames;
+  for (const Entry& entry : entries) {
+    filenames.push_back(entry.filename);
+  }
+  absl::Status marked = WriteMarker(absl::StrJoin(filenames, "\n"));
+  if (!marked.ok()) {
+    // Without the marker, Recover() finds nothing to complete.
+    file_storage_.Delete(marker_filename_).IgnoreError();
+    DeleteStaged(entries);
+    return marked;
+  }
+
+  PDS_RETURN_IF_ERROR(Publish(entries, locking_order, notifications));
+
+  // The renames must be durable before the marker goes away.
+  PDS_RETURN_IF_ERROR(SyncDirectories(file_storage_, filenames));
+  PDS_RETURN_IF_ERROR(file_storage_.Delete(marker_filename_));
+  return file_storage_.SyncDirectory(marker_filename_);
+}
+
+absl::Status WriteBatch::Stage(const std::vector<Entry>& entries) const {
+  std::vector<std::string> staged_filenames;
+  std::vector<std::unique_ptr<OutputStream>> outputs;
+  for (const Entry& entry : entries) {
+    staged_filenames.push_back(StagedFilename(entry.filename));
+    PDS_ASSIGN_OR_RETURN(std::unique_ptr<OutputStream> output,
+                         file_storage_.OpenForWrite(staged_filenames.back()));
+    PDS_RETURN_IF_ERROR(output->AppendCord(entry.contents));
+    PDS_RETURN_IF_ERROR(output->Flush());
+    outputs.push_back(std::move(output));
+  }
+
+  // One sync pass, now that everything has been handed to the kernel.
+  switch (sync_mode_) {
+    case SyncMode::kFdatasync:
+      for (const std::unique_ptr<OutputStream>& output : outputs) {
+        PDS_RETURN_IF_ERROR(output->Sync());
+      }
+      for (const std::unique_ptr<OutputStream>& output : outputs) {
+        PDS_RETURN_IF_ERROR(output->Close());
+      }
+      // The staged files must also be found after a crash.
+      return SyncDirectories(file_storage_, staged_filenames);
+    case SyncMode::kSyncfs:
+      for (const std::unique_ptr<OutputStream>& output : outputs) {
+        PDS_RETURN_IF_ERROR(output->Close());
+      }
+      return file_storage_.SyncFilesystem(staged_filenames.front());
+  }
+  return absl::OkStatus();
+}
+
+void WriteBatch::DeleteStaged(const std::vector<Entry>& entries) const {
+  for (const Entry& entry : entries) {
+    // Files that were never created are not found.
+    file_storage_.Delete(StagedFilename(entry.filename)).IgnoreError();
+  }
+}
+
+absl::Status WriteBatch::WriteMarker(absl::string_view payload) const {
+  Crc32 crc;
+  crc.Append(payload);
+  const StoreHeader header{.magic = StoreHeader::kMagic,
+                           .proto_checksum = crc.Get()};
+  PDS_ASSIGN_OR_RETURN(std::unique_ptr<OutputStream> marker,
+                       file_storage_.OpenForWrite(marker_filename_));
+  PDS_RETURN_IF_ERROR(marker->Append(absl::string_view(
+      reinterpret_cast<const char*>(&header), sizeof(StoreHeader))));
+  PDS_RETURN_IF_ERROR(marker->Append(payload));
+  PDS_RETURN_IF_ERROR(marker->Sync());
+  PDS_RETURN_IF_ERROR(marker->Close());
+  return file_storage_.SyncDirectory(marker_filename_);
+}
+
+absl::Status WriteBatch::Publish(
+    const std::vector<Entry>& entries,
+    const std::vector<const Entry*>& locking_order,
+    std::vector<std::function<void()>>* notifications) const {
+  for (const Entry* entry : locking_order) {
+    entry->lock();
+  }
+
+  absl::Status status;
+  for (const Entry& entry : entries) {
+    absl::Status renamed =
+        file_storage_.Rename(StagedFilename(entry.filename), entry.filename);
+    if (!renamed.ok()) {
+      status.Update(renamed);
+      continue;
+    }
+    notifications->push_back(entry.install());
+  }
+
+  for (auto it = locking_order.rbegin(); it != locking_order.rend(); ++it) {
+    (*it)->unlock();
+  }
+  return status;
+}
+
+absl::Status WriteBatch::Recover(const FileStorage& file_storage,
+                                 const std::string& marker_filename) {
+  absl::StatusOr<std::unique_ptr<MappedFile>> marker =
+      file_storage.MapForRead(marker_filename);
+  if (absl::IsNotFound(marker.status())) {
+    return absl::OkStatus();
+  }
+  PDS_RETURN_IF_ERROR(marker.status());
+
+  absl::StatusOr<absl::string_view> payload =
+      ValidateStoreContents(marker_filename, (*marker)->data());
+  if (payload.ok()) {
+    std::vector<std::string> filenames =
+        absl::StrSplit(*payload, '\n', absl::SkipEmpty());
+    for (const std::string& filename : filenames) {
+      absl::Status renamed =
+          file_storage.Rename(StagedFilename(filename), filename);
+      // A missing staged file was renamed before the crash.
+      if (!renamed.ok() && !absl::IsNotFound(renamed)) {
+        return renamed;
+      }
+    }
+    PDS_RETURN_IF_ERROR(SyncDirectories(file_storage, filenames));
+  }
+  // Otherwise the marker is torn: the batch never reached its commit point.
+  PDS_RETURN_IF_ERROR(file_storage.Delete(marker_filename));
+  return file_storage.SyncDirectory(marker_filename);
+}
+
+}  // namespace protostore
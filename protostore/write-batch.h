@@ -0,0 +1,170 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef PROTOSTORE_WRITE_BATCH_H_
+#define PROTOSTORE_WRITE_BATCH_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/str_cat.h"
+#include "protostore/file-storage.h"
+#include "protostore/proto-data-store.h"
+#include "protostore/status-macros.h"
+
+namespace protostore {
+
+/// \brief Updates several ProtoDataStores atomically, with one sync pass.
+///
+/// Commit() writes every staged version to a temporary file next to its
+/// store and syncs them all. It then durably writes a commit marker that
+/// lists the stores. Only after that are the temporary files renamed into
+/// place.
+///
+/// A crash before the marker is durable leaves every store at its old
+/// version. A batch that crashes after that point is completed by
+/// Recover(). Call Recover() with the same marker before opening the stores
+/// again.
+///
+/// While it commits, the batch holds the write locks of all of its stores,
+/// so Write() calls wait for it. While it renames the files, it also holds
+/// the locks of their cached versions, so readers in this process see
+/// either all of the new versions or none of them. Readers in other
+/// processes may see the renames happen one at a time.
+///
+/// The stores must live on `file_storage` and outlive the batch.
+class WriteBatch {
+ public:
+  // How the staged files are made durable.
+  enum class SyncMode {
+    // fdatasync() each staged file, back to back.
+    kFdatasync,
+    // One syncfs() of the file system holding the stores, which must all
+    // live on the same file system.
+    kSyncfs,
+  };
+
+  WriteBatch(const FileStorage& file_storage, std::string marker_filename,
+             SyncMode sync_mode = SyncMode::kFdatasync);
+
+  WriteBatch(const WriteBatch&) = delete;
+  WriteBatch& operator=(const WriteBatch&) = delete;
+
+  /// Stages `proto` as the next version of `store`.
+  ///
+  /// Returns INVALID_ARGUMENT if the proto is too large for the store or a
+  /// version is already staged for it.
+  template <typename ProtoT, typename LockT, typename ChecksumT,
+            typename StorageT>
+  absl::Status Put(ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>* store,
+                   std::unique_ptr<ProtoT> proto);
+
+  /// Writes all staged versions and empties the batch.
+  ///
+  /// Returns INTERNAL_ERROR if an IO error was encountered. Errors before
+  /// the commit point leave the stores unchanged and delete the staged
+  /// files. After it, the marker is
+  /// left behind for Recover() to complete the batch.
+  absl::Status Commit();
+
+  /// Completes a batch that crashed after its commit point and removes its
+  /// marker. Does nothing if there is no marker.
+  static absl::Status Recover(const FileStorage& file_storage,
+                              const std::string& marker_filename);
+
+ private:
+  struct Entry {
+    // Identifies the store.
+    const void* store;
+    std::string filename;
+    absl::Cord contents;
+    // Take and release the write lock of the store.
+    std::function<void()> lock_writes;
+    std::function<void()> unlock_writes;
+    // Take and release the lock guarding its cached version.
+    std::function<void()> lock;
+    std::function<void()> unlock;
+    // Installs the new version while the lock is held, and returns the
+    // notification of listeners to run after unlocking.
+    std::function<std::function<void()>()> install;
+  };
+
+  // Commit() once the write locks of the stores are held. Appends the
+  // notifications of listeners to run after unlocking to `*notifications`.
+  absl::Status CommitLocked(
+      const std::vector<Entry>& entries,
+      const std::vector<const Entry*>& locking_order,
+      std::vector<std::function<void()>>* notifications) const;
+
+  // Writes the entries to their staged files and syncs them.
+  absl::Status Stage(const std::vector<Entry>& entries) const;
+
+  // Deletes whatever staged files of the entries exist.
+  void DeleteStaged(const std::vector<Entry>& entries) const;
+
+  // Durably writes the commit marker listing the stores in `payload`.
+  absl::Status WriteMarker(absl::string_view payload) const;
+
+  // Renames the staged files into place and installs the new versions.
+  absl::Status Publish(
+      const std::vector<Entry>& entries,
+      const std::vector<const Entry*>& locking_order,
+      std::vector<std::function<void()>>* notifications) const;
+
+  const FileStorage& file_storage_;
+  const std::string marker_filename_;
+  const SyncMode sync_mode_;
+  std::vector<Entry> entries_;
+};
+
+template <typename ProtoT, typename LockT, typename ChecksumT,
+          typename StorageT>
+absl::Status WriteBatch::Put(
+    ProtoDataStore<ProtoT, LockT, ChecksumT, StorageT>* store,
+    std::unique_ptr<ProtoT> proto) {
+  for (const Entry& entry : entries_) {
+    if (entry.store == store) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Store already in batch: ", store->filename_));
+    }
+  }
+  PDS_ASSIGN_OR_RETURN(const absl::Cord proto_str,
+                       store->SerializeForWrite(*proto));
+
+  Entry entry;
+  entry.store = store;
+  entry.filename = store->filename_;
+  PDS_ASSIGN_OR_RETURN(entry.contents, store->EncodeFile(proto_str));
+  entry.lock_writes = [store]() { store->LockWritesForBatch(); };
+  entry.unlock_writes = [store]() { store->UnlockWritesForBatch(); };
+  entry.lock = [store]() { store->LockForBatch(); };
+  entry.unlock = [store]() { store->UnlockForBatch(); };
+  std::shared_ptr<const ProtoT> written = std::move(proto);
+  entry.install = [store, written]() -> std::function<void()> {
+    const uint64_t version = store->InstallForBatch(written);
+    return [store, written, version]() { store->Notify(written, version); };
+  };
+  entries_.push_back(std::move(entry));
+  return absl::OkStatus();
+}
+
+}  // namespace protostore
+
+#endif  // PROTOSTORE_WRITE_BATCH_H_
@@ -0,0 +1,222 @@
+// Copyright (C) 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "protostore/write-batch.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/strings/str_cat.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protostore/crc32.h"
+#include "protostore/file-storage.h"
+#include "protostore/proto-data-store.h"
+#include "protostore/store-format.h"
+#include "protostore/testing-matchers.h"
+#include "protostore/testfile-fixture.h"
+#include "protostore/test.pb.h"
+
+namespace protostore {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Pointee;
+using testing::EqualsProto;
+using testing::IsOkAndHolds;
+using testing::StatusIs;
+
+class WriteBatchTest : public testing::TestFileFixture {
+ protected:
+  TestProto MakeProto(absl::string_view value) {
+    TestProto testproto;
+    testproto.set_string_value(std::string(value));
+    return testproto;
+  }
+
+  // Writes a commit marker for `filenames`, as Commit() does.
+  void WriteMarker(const FileStorage& storage, const std::string& marker,
+                   const std::string& payload, uint32_t checksum) {
+    const StoreHeader header{.magic = StoreHeader::kMagic,
+                             .proto_checksum = checksum};
+    auto out = storage.OpenForWrite(marker);
+    ASSERT_OK(out.status());
+    ASSERT_OK((*out)->Append(absl::string_view(
+        reinterpret_cast<const char*>(&header), sizeof(header))));
+    ASSERT_OK((*out)->Append(payload));
+  }
+};
+
+class WriteBatchSyncModeTest
+    : public WriteBatchTest,
+      public ::testing::WithParamInterface<WriteBatch::SyncMode> {};
+
+TEST_P(WriteBatchSyncModeTest, CommitsAllStores) {
+  FileStorage storage;
+  const std::string marker = TestFile("marker");
+  ProtoDataStore<TestProto> first(storage, TestFile("first"));
+  ProtoDataStore<TestProto> second(storage, TestFile("second"));
+  ASSERT_OK(first.Write(absl::make_unique<TestProto>(MakeProto("old"))));
+  std::vector<uint64_t> versions;
+  second.Subscribe(
+      [&versions](std::shared_ptr<const TestProto>, uint64_t version) {
+        versions.push_back(version);
+      });
+
+  WriteBatch batch(storage, marker, GetParam());
+  ASSERT_OK(batch.Put(&first, absl::make_unique<TestProto>(MakeProto("a"))));
+  ASSERT_OK(batch.Put(&second, absl::make_unique<TestProto>(MakeProto("b"))));
+  ASSERT_OK(batch.Commit());
+
+  EXPECT_THAT(first.Read(), IsOkAndHolds(Pointee(EqualsProto(MakeProto("a")))));
+  EXPECT_THAT(second.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(MakeProto("b")))));
+  EXPECT_THAT(versions, ElementsAre(1));
+
+  ProtoDataStore<TestProto> reopened(storage, TestFile("second"));
+  EXPECT_THAT(reopened.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(MakeProto("b")))));
+  EXPECT_THAT(storage.GetFileSize(marker),
+              StatusIs(absl::StatusCode::kNotFound));
+  EXPECT_THAT(storage.GetFileSize(TestFile("first.batch")),
+              StatusIs(absl::StatusCode::kNotFound));
+
+  // An empty batch does nothing.
+  EXPECT_OK(batch.Commit());
+}
+
+INSTANTIATE_TEST_SUITE_P(SyncModes, WriteBatchSyncModeTest,
+                         ::testing::Values(WriteBatch::SyncMode::kFdatasync,
+                                           WriteBatch::SyncMode::kSyncfs));
+
+TEST_F(WriteBatchTest, PutRejectsInvalidVersions) {
+  FileStorage storage;
+  ProtoDataStore<TestProto>::Options options;
+  options.max_file_size = 16;
+  ProtoDataStore<TestProto> pds(storage, TestFile("pds"), options);
+
+  WriteBatch batch(storage, TestFile("marker"));
+  EXPECT_THAT(batch.Put(&pds, absl::make_unique<TestProto>(
+                                  MakeProto(std::string(100, 'x')))),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  ASSERT_OK(batch.Put(&pds, absl::make_unique<TestProto>(MakeProto("a"))));
+  EXPECT_THAT(batch.Put(&pds, absl::make_unique<TestProto>(MakeProto("b"))),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(WriteBatchTest, FailedStagingDeletesStagedFiles) {
+  FileStorage storage;
+  const std::string marker = TestFile("marker");
+  ProtoDataStore<TestProto> first(storage, TestFile("first"));
+  ProtoDataStore<TestProto> second(storage, TestFile("missing/second"));
+  ASSERT_OK(first.Write(absl::make_unique<TestProto>(MakeProto("old"))));
+
+  WriteBatch batch(storage, marker);
+  ASSERT_OK(batch.Put(&first, absl::make_unique<TestProto>(MakeProto("a"))));
+  ASSERT_OK(batch.Put(&second, absl::make_unique<TestProto>(MakeProto("b"))));
+  EXPECT_FALSE(batch.Commit().ok());
+
+  EXPECT_THAT(storage.GetFileSize(TestFile("first.batch")),
+              StatusIs(absl::StatusCode::kNotFound));
+  EXPECT_THAT(storage.GetFileSize(marker),
+              StatusIs(absl::StatusCode::kNotFound));
+  ProtoDataStore<TestProto> reopened(storage, TestFile("first"));
+  EXPECT_THAT(reopened.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(MakeProto("old")))));
+}
+
+TEST_F(WriteBatchTest, ConcurrentBatchesOnOneStore) {
+  FileStorage storage;
+  ProtoDataStore<TestProto> pds(storage, TestFile("pds"));
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < 20; ++j) {
+        WriteBatch batch(storage, TestFile(absl::StrCat("marker", i)));
+        ASSERT_OK(batch.Put(&pds, absl::make_unique<TestProto>(MakeProto(
+                                      std::string(1000 * (i + 1), 'x')))));
+        EXPECT_OK(batch.Commit());
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  ProtoDataStore<TestProto> reopened(storage, TestFile("pds"));
+  absl::StatusOr<const TestProto*> read = reopened.Read();
+  ASSERT_OK(read.status());
+  EXPECT_EQ((*read)->string_value().size() % 1000, 0);
+}
+
+TEST_F(WriteBatchTest, RecoverRollsForward) {
+  FileStorage storage;
+  const std::string marker = TestFile("marker");
+  const std::string first = TestFile("first");
+  const std::string second = TestFile("second");
+  {
+    ProtoDataStore<TestProto> pds(storage, first);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(MakeProto("old"))));
+  }
+  // Crash after the first rename of a committed batch.
+  {
+    ProtoDataStore<TestProto> pds(storage, first);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(MakeProto("a"))));
+    ProtoDataStore<TestProto> staged(storage, second + ".batch");
+    ASSERT_OK(staged.Write(absl::make_unique<TestProto>(MakeProto("b"))));
+  }
+  const std::string payload = absl::StrCat(first, "\n", second);
+  Crc32 crc;
+  crc.Append(payload);
+  WriteMarker(storage, marker, payload, crc.Get());
+
+  ASSERT_OK(WriteBatch::Recover(storage, marker));
+  ProtoDataStore<TestProto> first_pds(storage, first);
+  EXPECT_THAT(first_pds.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(MakeProto("a")))));
+  ProtoDataStore<TestProto> second_pds(storage, second);
+  EXPECT_THAT(second_pds.Read(),
+              IsOkAndHolds(Pointee(EqualsProto(MakeProto("b")))));
+  EXPECT_THAT(storage.GetFileSize(marker),
+              StatusIs(absl::StatusCode::kNotFound));
+
+  // Nothing left to recover.
+  EXPECT_OK(WriteBatch::Recover(storage, marker));
+}
+
+TEST_F(WriteBatchTest, RecoverDropsTornMarker) {
+  FileStorage storage;
+  const std::string marker = TestFile("marker");
+  const std::string first = TestFile("first");
+  {
+    ProtoDataStore<TestProto> pds(storage, first);
+    ASSERT_OK(pds.Write(absl::make_unique<TestProto>(MakeProto("old"))));
+    ProtoDataStore<TestProto> staged(storage, first + ".batch");
+    ASSERT_OK(staged.Write(absl::make_unique<TestProto>(MakeProto("a"))));
+  }
+  WriteMarker(storage, marker, first, 0);
+
+  ASSERT_OK(WriteBatch::Recover(storage, marker));
+  ProtoDataStore<TestProto> pds(storage, first);
+  EXPECT_THAT(pds.Read(), IsOkAndHolds(Pointee(EqualsProto(MakeProto("old")))));
+  EXPECT_THAT(storage.GetFileSize(marker),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+}  // namespace
+}  // namespace protostore